@@ -0,0 +1,129 @@
+// Copyright (c) 2022-2024  Buzz Moschetti <buzz.moschetti@gmail.com>
+//
+// Permission to use, copy, modify, and distribute this software and its documentation for any purpose, without fee, and without a written agreement is hereby granted,
+// provided that the above copyright notice and this paragraph and the following two paragraphs appear in all copies.
+//
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST PROFITS,
+// ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION, EVEN IF THE AUTHOR HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// THE AUTHOR SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+// THE SOFTWARE PROVIDED HEREUNDER IS ON AN "AS IS" BASIS, AND THE AUTHOR HAS NO OBLIGATIONS TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+
+/*
+  Key search benchmark:  libbson's bson_iter_find_descendant vs. the
+  extension's scalar and vector raw descent, on wide documents of 100,
+  1000 and 5000 top level fields.  Looks up the first, middle and last
+  field and one that isn't there.  The extension is compiled right in so
+  its static functions can be called.
+
+  usage:  bench1 [ iterations ]
+ */
+#define SQLITE_CORE 1
+#include "bsonext.c"
+
+#include <stdio.h>
+#include <sys/time.h>
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Field names of mixed length and first letter, like real documents:
+static const char* stems[] = { "id", "name", "ts", "amount", "status", "customer_region", "q", "lastModifiedBy" };
+
+static void field_name(char* buf, int i)
+{
+    sprintf(buf, "%s_%d", stems[i % 8], i);
+}
+
+static bson_t* wide_doc(int nfields)
+{
+    bson_t* b = bson_new();
+    char key[64];
+    for(int i = 0; i < nfields; i++) {
+	field_name(key, i);
+	switch(i % 4) {
+	case 0: bson_append_int32(b, key, -1, i); break;
+	case 1: bson_append_double(b, key, -1, i * 1.5); break;
+	case 2: bson_append_utf8(b, key, -1, "some string value", -1); break;
+	case 3: {
+	    bson_t sub;
+	    bson_append_document_begin(b, key, -1, &sub);
+	    bson_append_int64(&sub, "x", -1, i);
+	    bson_append_document_end(b, &sub);
+	    break;
+	}
+	}
+    }
+    return b;
+}
+
+// 0 if not found, else offset of the value within the document:
+static long via_iter(const bson_t* b, const char* key)
+{
+    bson_iter_t iter, target;
+    if(bson_iter_init(&iter, b) && bson_iter_find_descendant(&iter, key, &target)) {
+	// element offset + type byte + key + NUL:
+	return (long)bson_iter_offset(&target) + 1 + strlen(key) + 1;
+    }
+    return 0;
+}
+
+static long via_raw(const bson_t* b, const char* key, bool vec)
+{
+    uint8_t t;
+    const uint8_t* vp;
+    uint32_t vlen;
+    bool ok = vec ? _bson_find_key_raw(bson_get_data(b), b->len, key, strlen(key), &t, &vp, &vlen)
+	: _bson_find_key_scalar(bson_get_data(b), b->len, key, strlen(key), &t, &vp, &vlen);
+    return ok ? vp - bson_get_data(b) : 0;
+}
+
+int main(int argc, char* argv[]) {
+    int iters = (argc > 1) ? atoi(argv[1]) : 2000;
+    int sizes[] = { 100, 1000, 5000 };
+
+#if defined(BSONEXT_KEY_VEC)
+    printf("vector width %d bytes\n", BSONEXT_KEY_VEC);
+#else
+    printf("no vector support; raw search is scalar\n");
+#endif
+    printf("%6s %-10s %14s %14s %14s\n", "fields", "target", "libbson ns", "scalar ns", "vector ns");
+
+    for(int s = 0; s < 3; s++) {
+	int n = sizes[s];
+	bson_t* b = wide_doc(n);
+
+	char first[64], middle[64], last[64];
+	field_name(first, 0);
+	field_name(middle, n / 2);
+	field_name(last, n - 1);
+	const char* targets[] = { first, middle, last, "amount_nothere" };
+	const char* labels[] = { "first", "middle", "last", "missing" };
+
+	for(int k = 0; k < 4; k++) {
+	    long a = via_iter(b, targets[k]), c = via_raw(b, targets[k], false), d = via_raw(b, targets[k], true);
+	    if(a != c || c != d) {
+		printf("MISMATCH %d fields, %s: libbson %ld scalar %ld vector %ld\n", n, targets[k], a, c, d);
+		return 1;
+	    }
+
+	    volatile long sink = 0;
+	    double t0 = now();
+	    for(int i = 0; i < iters; i++) sink += via_iter(b, targets[k]);
+	    double t1 = now();
+	    for(int i = 0; i < iters; i++) sink += via_raw(b, targets[k], false);
+	    double t2 = now();
+	    for(int i = 0; i < iters; i++) sink += via_raw(b, targets[k], true);
+	    double t3 = now();
+
+	    printf("%6d %-10s %14.0f %14.0f %14.0f\n", n, labels[k],
+		   (t1 - t0) * 1e9 / iters, (t2 - t1) * 1e9 / iters, (t3 - t2) * 1e9 / iters);
+	}
+	bson_destroy(b);
+    }
+    return 0;
+}
@@ -12,10 +12,35 @@
 #include "sqlite3ext.h"
 SQLITE_EXTENSION_INIT1
 #include <assert.h>
+#include <math.h>
+#include <stdlib.h>
 #include <string.h>
 
+// Vector key compare in _bson_find_key_raw; whatever the compiler targets:
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define BSONEXT_KEY_VEC 32
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define BSONEXT_KEY_VEC 16
+#endif
+
 #include "bson.h"  // obviously...
 
+/*
+  A BSON blob doesn't say whether it was an array or a document.  Results
+  that are arrays (bson_group_array, bson_get_bson of an array) carry this
+  sqlite subtype so bson_group_array and bson_group_object can nest them
+  as arrays.  Like JSON's subtype it is lost once the value is stored or
+  comes out of a subquery; bson_as_array() puts it back.
+*/
+#define BSONEXT_SUBTYPE_ARRAY 'A'
+
+// Flag for functions that set a subtype; older sqlite has no such flag:
+#ifndef SQLITE_RESULT_SUBTYPE
+#define SQLITE_RESULT_SUBTYPE 0
+#endif
+
 
 static void _cvt_datetime_to_ts(char* buf, int64_t millis_since_epoch)
 {
@@ -71,302 +96,6511 @@ static void _set_json(
     sqlite3_context *context,
     bson_t* b)
 {
+    // Hand libbson's string straight to sqlite; no second copy:
     size_t blen;
     char* txt = bson_as_relaxed_extended_json(b, &blen);
-    sqlite3_result_text(context, txt, blen, SQLITE_TRANSIENT);
-    bson_free((void*)txt);
+    if(txt != 0) sqlite3_result_text64(context, txt, blen, bson_free, SQLITE_UTF8);
 }
-    
-
-static void bson_get_bson_func(
-  sqlite3_context *context,
-  int argc,
-  sqlite3_value **argv
-){
-  assert( argc==2 );
-
-  // If not a BLOB (also picks up if NULL) then don't even try to init:
-  if( sqlite3_value_type(argv[0]) != SQLITE_BLOB) return;
 
-  bson_t b; // on stack;
-  if(!_init_bson(&b, argv)) {
-      sqlite3_result_error(context, "invalid BSON", -1);
-  } else {
-      uint32_t subdoc_len;
-      const uint8_t* subdoc_data = 0;
 
-      char* dotpath = (char*) sqlite3_value_text(argv[1]);
+static void extract_and_set_context(sqlite3_context* context, bson_iter_t* p_target);
 
-      if(dotpath[0] == '\0') {
-	  subdoc_len = b.len;
-	  subdoc_data = bson_get_data(&b);
 
-      } else {
-	  bool rc = false;
-	  
-	  bson_iter_t target;
-	  bson_iter_t iter;
-	  if (bson_iter_init (&iter, &b)) {
-	      rc = bson_iter_find_descendant(&iter, dotpath, &target);
-	  }
-	  
-	  if(rc) {
-	      bson_type_t ft = bson_iter_type(&target);
-	      switch(ft) {
-	      case BSON_TYPE_DOCUMENT:  {
-		  bson_iter_document(&target, &subdoc_len, &subdoc_data);
-		  break;
-	      }
-	      case BSON_TYPE_ARRAY:  {
-		  bson_iter_array(&target, &subdoc_len, &subdoc_data);
-		  break;
-	      }
-	      default: {
-		  // ?  TBD How to "better" handle "object representation" of
-		  // noncomplex types
-	      }
-	      }
-	  }
-      }
 
-      if(subdoc_data != 0) {
-	  // Everything up to this point was pointers to pointers to pointers
-	  // in the incoming sqlite3_value_bytes(argv[0]); no new mallocs
-	  // so nothing extra to free; let TRANSIENT copy it out and we're done
-	  sqlite3_result_blob(context, subdoc_data, subdoc_len, SQLITE_TRANSIENT);	  
-      }
-  }
+/*
+  Raw BSON byte helpers.   libbson does not expose "how long is this value"
+  without a full bson_iter_t so we do it ourselves from the spec
+  (http://bsonspec.org/spec.html).   All lengths are little-endian int32.
+*/
+static uint32_t _rd_int32(const uint8_t* p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
 }
 
+// Byte length of the value of type t starting at p, or -1 if the value
+// is malformed or would run past end:
+static inline int64_t _bson_value_len(uint8_t t, const uint8_t* p, const uint8_t* end)
+{
+    int64_t avail = end - p;
+    int64_t n = -1;
+    int64_t min = 0;        // smallest well-formed length for the type
 
+    switch(t) {
+    case BSON_TYPE_DOUBLE:
+    case BSON_TYPE_DATE_TIME:
+    case BSON_TYPE_TIMESTAMP:
+    case BSON_TYPE_INT64:      n = 8; break;
+    case BSON_TYPE_INT32:      n = 4; break;
+    case BSON_TYPE_BOOL:       n = 1; break;
+    case BSON_TYPE_OID:        n = 12; break;
+    case BSON_TYPE_DECIMAL128: n = 16; break;
+    case BSON_TYPE_UNDEFINED:
+    case BSON_TYPE_NULL:
+    case BSON_TYPE_MINKEY:
+    case BSON_TYPE_MAXKEY:     n = 0; break;
 
-
-static void extract_and_set_context(
-  sqlite3_context* context,
-  bson_iter_t* p_target
-){
-    bson_type_t ft = bson_iter_type(p_target);
-    switch(ft) {
-    case BSON_TYPE_UTF8: {
-	uint32_t len;		
-	const char* txt = bson_iter_utf8(p_target, &len); // NO NEED TO free()
-	// DEF need TRANSIENT here to copy that string...
-	sqlite3_result_text(context, txt, len, SQLITE_TRANSIENT);
+    // A string length counts its NUL so is at least 1:
+    case BSON_TYPE_UTF8:
+    case BSON_TYPE_CODE:
+    case BSON_TYPE_SYMBOL:
+	if(avail >= 4) n = 4 + (int64_t)_rd_int32(p);
+	min = 5;
 	break;
-    }
-    case BSON_TYPE_DOUBLE: {
-	double v = bson_iter_double(p_target);
-	sqlite3_result_double(context, v);	      
-	break;		
-    }
-    case BSON_TYPE_INT32: {
-	int32_t v = bson_iter_int32(p_target);
-	sqlite3_result_int(context, v);	      
-	break;		
-    }
-    case BSON_TYPE_BOOL: {
-	bool v = bson_iter_bool(p_target);
-	//  Convention for bools in sqlite3 is int 1 or 0:
-	sqlite3_result_int(context, v == true ? 1 : 0);
-	break;		
-    }	
-    case BSON_TYPE_INT64: {
-	int64_t v = bson_iter_int64(p_target);
-	sqlite3_result_int64(context, v);
-	break;		
-    }
-    case BSON_TYPE_DECIMAL128: {
-	bson_decimal128_t val;
-	if(bson_iter_decimal128(p_target, &val)) {
-	    // No decimal type in sqlite and it is dangerous to
-	    // use floating pt for penny-precise numbers so safest
-	    // to turn it into a string:
-	    char buf[43];  // from bson.h...  
-	    bson_decimal128_to_string(&val, buf);
-	    // -1 means let sqlite figure out length
-	    sqlite3_result_text(context, buf, -1, SQLITE_TRANSIENT);
-	}
-	break;		
-    }
-    case BSON_TYPE_DATE_TIME: {
-	int64_t millis_since_epoch = bson_iter_date_time (p_target);
-	
-	// No date/time/datetime in sqlite so make an ISO-8601 string.
-	// BSON datetime is always Z
-	// 2023-01-01T12:13:14.567Z  is 24 chars.
-	char buf[24+1];
-	_cvt_datetime_to_ts(buf, millis_since_epoch);
-	sqlite3_result_text(context, buf, 24, SQLITE_TRANSIENT);
-	break;		
-    }								
-	
-    case BSON_TYPE_DOCUMENT: 
-    case BSON_TYPE_ARRAY: {		
-	uint32_t subdoc_len;
-	const uint8_t* subdoc_data;
-	
-	if(ft == BSON_TYPE_DOCUMENT) {
-	    bson_iter_document(p_target, &subdoc_len, &subdoc_data);
-	} else {
-	    bson_iter_array(p_target, &subdoc_len, &subdoc_data);
-	}
-	
-	bson_t b; // on stack
-	bson_init_static(&b, subdoc_data, subdoc_len);
-
-	_set_json(context, &b);	
-
+    case BSON_TYPE_DOCUMENT:
+    case BSON_TYPE_ARRAY:
+	if(avail >= 4) n = (int64_t)_rd_int32(p);
+	min = 5;
 	break;
-    }
-	
-    case BSON_TYPE_BINARY: {				
-	bson_subtype_t subtype;
-	uint32_t len;
-	const uint8_t* data;
-	
-	// What to do with subtype?  Dunno!
-	bson_iter_binary (p_target, &subtype, &len, &data);
-	
-	// sqlite likes binary hex input in this form ; here is [hello!]:
-	//    insert into zzz (f) values (x'68656c6c6f21');
-	// So given the convention that the output representation should
-	// be whatever goes between single quotes, our rep will be
-	//    68656c6c6f21 
-	// No need for space for NULL; we will build a buf and know the
-	// len to give to sqlite3_result_text:
-	
-	char* tmpp = sqlite3_malloc(len*2);
-	
-	int idx = 0;
-	for(int n = 0; n < len; n++) {
-	    // Love that pointer math....
-	    sprintf(tmpp+idx, "%02x", (uint8_t)data[n]);
-	    idx += 2;
+    case BSON_TYPE_CODEWSCOPE:
+	// int32 total, string, document
+	if(avail >= 4) n = (int64_t)_rd_int32(p);
+	min = 4 + 5 + 5;
+	break;
+    case BSON_TYPE_BINARY:
+	if(avail >= 4) n = 4 + 1 + (int64_t)_rd_int32(p);
+	break;
+    case BSON_TYPE_DBPOINTER:
+	if(avail >= 4) n = 4 + (int64_t)_rd_int32(p) + 12;
+	min = 5 + 12;
+	break;
+    case BSON_TYPE_REGEX: {
+	// Two cstrings back to back: pattern and options
+	const uint8_t* q = memchr(p, 0, avail);
+	if(q != 0) {
+	    q = memchr(q+1, 0, end - (q+1));
+	    if(q != 0) n = q + 1 - p;
 	}
-	
-	// Since we are using sqlite3_malloc to make the buffer, we can use
-	// sqlite_free as arg 4 to destroy tmpp:
-	sqlite3_result_text(context, tmpp, idx, sqlite3_free);	
 	break;
     }
-	
-    default: {
-	break; // ?
-    }		
+    default:
+	break;
     }
+
+    return (n < min || n > avail) ? -1 : n;
 }
 
+
 /*
-sqlite does not (by default) enforce column types.  The data declares its
-type, not the container.  This makes it vastly simpler to extract and
-return data because the function can call sqlite3_result_int or
-sqlite3_result_text or whatever else it wants.
- */
-static void bson_get_func(
-  sqlite3_context *context,
-  int argc,
-  sqlite3_value **argv
-){
-    assert( argc==2 );
+  Growable output buffer.   Memory is sqlite3_malloc'd so the final
+  buffer can be handed to sqlite3_result_blob with sqlite3_free as the
+  destructor -- no TRANSIENT copy.
+*/
+typedef struct {
+    uint8_t* data;
+    sqlite3_int64 len;
+    sqlite3_int64 cap;
+    int oom;
+} _buf_t;
 
-    // If not a BLOB (also picks up if NULL) then don't even try to init:
-    if( sqlite3_value_type(argv[0]) != SQLITE_BLOB) return;
+static void _buf_reserve(_buf_t* b, sqlite3_int64 n)
+{
+    if(b->oom || b->len + n <= b->cap) return;
 
-    bson_t b;
-    if(!_init_bson(&b, argv)) {
-	sqlite3_result_error(context, "invalid BSON", -1);
+    sqlite3_int64 ncap = b->cap ? b->cap * 2 : 256;
+    while(ncap < b->len + n) ncap *= 2;
+
+    uint8_t* p = sqlite3_realloc64(b->data, ncap);
+    if(p == 0) {
+	b->oom = 1;
     } else {
-	char* dotpath = (char*) sqlite3_value_text(argv[1]);
+	b->data = p;
+	b->cap = ncap;
+    }
+}
 
-	if(dotpath[0] == '\0') { // bson_get(bson,"") is basically to_json()
-	    _set_json(context, &b);
-	
-	} else {
-	    bool rc = false;
-	    bson_iter_t target;
-	    bson_iter_t iter;
-	    if (bson_iter_init (&iter, &b)) {
-		rc = bson_iter_find_descendant(&iter, dotpath, &target);
-	    }
-	    if(rc) {
-		extract_and_set_context(context, &target);
-	    }
-	}
+static void _buf_append(_buf_t* b, const void* p, sqlite3_int64 n)
+{
+    _buf_reserve(b, n);
+    if(!b->oom && n > 0) {
+	memcpy(b->data + b->len, p, n);
+	b->len += n;
     }
 }
 
-static void bson_to_json_func(
-  sqlite3_context *context,
-  int argc,
-  sqlite3_value **argv
-){
-    assert( argc==1 );
+static void _buf_byte(_buf_t* b, uint8_t c)
+{
+    _buf_append(b, &c, 1);
+}
 
-    // If not a BLOB (also picks up if NULL) then don't even try to init:
-    if( sqlite3_value_type(argv[0]) != SQLITE_BLOB) return;
+static void _buf_int32(_buf_t* b, uint32_t v)
+{
+    uint8_t le[4] = { v & 0xff, (v >> 8) & 0xff, (v >> 16) & 0xff, (v >> 24) & 0xff };
+    _buf_append(b, le, 4);
+}
 
-    bson_t b;
-    if(!_init_bson(&b, argv)) {
-	sqlite3_result_error(context, "invalid BSON", -1);
-    } else {
-	_set_json(context, &b);
+// Overwrite the int32 placeholder at offset with the bytes written since:
+static void _buf_patch_len(_buf_t* b, sqlite3_int64 offset)
+{
+    if(b->oom) return;
+    uint32_t v = (uint32_t)(b->len - offset);
+    uint8_t* p = b->data + offset;
+    p[0] = v & 0xff; p[1] = (v >> 8) & 0xff; p[2] = (v >> 16) & 0xff; p[3] = (v >> 24) & 0xff;
+}
+
+// Unsigned LEB128:
+static void _buf_varint(_buf_t* b, uint64_t v)
+{
+    uint8_t tmp[10];
+    int n = 0;
+    do {
+	tmp[n] = v & 0x7f;
+	v >>= 7;
+	if(v != 0) tmp[n] |= 0x80;
+	n++;
+    } while(v != 0);
+    _buf_append(b, tmp, n);
+}
+
+static const uint8_t* _get_varint(const uint8_t* p, const uint8_t* end, uint64_t* v)
+{
+    uint64_t r = 0;
+    for(int shift = 0; p < end && shift < 64; shift += 7) {
+	uint8_t c = *p++;
+	r |= (uint64_t)(c & 0x7f) << shift;
+	if((c & 0x80) == 0) {
+	    *v = r;
+	    return p;
+	}
     }
+    return 0; // ran off the end
 }
 
 
-static void bson_from_json_func(
-  sqlite3_context *context,
-  int argc,
-  sqlite3_value **argv
-){
-    assert( argc==1 );
+// One element of a raw BSON document:
+typedef struct {
+    uint8_t t;
+    const char* key;
+    int klen;
+    const uint8_t* v;
+    uint32_t vlen;
+} _belem;
 
-    char* jsons = (char*) sqlite3_value_text(argv[0]);
-    int slen = strlen(jsons);
+/*
+  Decode the element at p (inside a document ending at end, the terminating
+  NUL).  Returns the start of the next element, or 0 at the end of the
+  document or if the bytes are malformed; *err tells the two apart.
+*/
+static const uint8_t* _next_elem(const uint8_t* p, const uint8_t* end, _belem* e, bool* err)
+{
+    *err = false;
+    if(p >= end) return 0;
 
-    bson_error_t err; // on stack
-    bson_t* b = bson_new_from_json((const uint8_t *)jsons, slen, &err);
-    
-    if(b != NULL) {
-	// b->len is The Official way to get length of bson_t* b.
-	// SQLITE_TRANSIENT will safe-copy our data...
-	sqlite3_result_blob(context, bson_get_data(b), b->len, SQLITE_TRANSIENT);
-	// ...and now we must free it here with bson_destroy,
-	// not free or sqlite3_free.  We also cannot pass bson_destroy as
-	// arg 4 to sqlite3_result_blob
-	bson_destroy(b);
+    e->t = *p++;
+    e->key = (const char*)p;
+    const uint8_t* nul = memchr(p, 0, end - p);
+    if(nul == 0) {
+	*err = true;
+	return 0;
+    }
+    e->klen = nul - p;
+    p = nul + 1;
 
-	
-    } else {
-	sqlite3_result_error(context, "cannot parse EJSON", -1);	
+    int64_t n = _bson_value_len(e->t, p, end);
+    if(n < 0) {
+	*err = true;
+	return 0;
     }
+    e->v = p;
+    e->vlen = (uint32_t)n;
+    return p + n;
+}
+
+static void _buf_elem(_buf_t* b, uint8_t t, const char* key, int klen, const uint8_t* v, uint32_t vlen)
+{
+    _buf_byte(b, t);
+    _buf_append(b, key, klen);
+    _buf_byte(b, 0);
+    _buf_append(b, v, vlen);
 }
 
 
-#ifdef _WIN32
-__declspec(dllexport)
-#endif
-int sqlite3_bson_init(
-  sqlite3 *db, 
-  char **pzErrMsg, 
-  const sqlite3_api_routines *pApi
-){
-  int rc = SQLITE_OK;
-  SQLITE_EXTENSION_INIT2(pApi);
-  (void)pzErrMsg;  /* Unused parameter */
+/*
+  XXH64 (https://github.com/Cyan4973/xxHash), spelled out here so the
+  extension needs nothing beyond libbson and sqlite.  Output is the same on
+  every platform which matters because hashes end up in indexes.
+*/
+#define XXH_P1 0x9E3779B185EBCA87ULL
+#define XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define XXH_P3 0x165667B19E3779F9ULL
+#define XXH_P4 0x85EBCA77C2B2AE63ULL
+#define XXH_P5 0x27D4EB2F165667C5ULL
 
-  rc = sqlite3_create_function(db, "bson_get", 2,
-                   SQLITE_UTF8|SQLITE_INNOCUOUS|SQLITE_DETERMINISTIC,
-                   0, bson_get_func, 0, 0);
+static uint64_t _rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
 
-  // Nice convenience; same as bson_get(bson_column, ""):
-  rc = sqlite3_create_function(db, "bson_to_json", 1,
-                   SQLITE_UTF8|SQLITE_INNOCUOUS|SQLITE_DETERMINISTIC,
-                   0, bson_to_json_func, 0, 0);  
+static uint64_t _rd_u64(const uint8_t* p)
+{
+    return (uint64_t)_rd_int32(p) | ((uint64_t)_rd_int32(p+4) << 32);
+}
 
-  rc = sqlite3_create_function(db, "bson_get_bson", 2,
-                   SQLITE_UTF8|SQLITE_INNOCUOUS|SQLITE_DETERMINISTIC,
-                   0, bson_get_bson_func, 0, 0);
+static uint64_t _xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_P2;
+    acc = _rotl64(acc, 31);
+    return acc * XXH_P1;
+}
+
+static uint64_t _xxh64_merge(uint64_t acc, uint64_t val)
+{
+    acc ^= _xxh64_round(0, val);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+static uint64_t _xxh64(const void* input, size_t len, uint64_t seed)
+{
+    const uint8_t* p = (const uint8_t*)input;
+    const uint8_t* end = p + len;
+    uint64_t h;
+
+    if(len >= 32) {
+	uint64_t v1 = seed + XXH_P1 + XXH_P2;
+	uint64_t v2 = seed + XXH_P2;
+	uint64_t v3 = seed;
+	uint64_t v4 = seed - XXH_P1;
+	do {
+	    v1 = _xxh64_round(v1, _rd_u64(p));    p += 8;
+	    v2 = _xxh64_round(v2, _rd_u64(p));    p += 8;
+	    v3 = _xxh64_round(v3, _rd_u64(p));    p += 8;
+	    v4 = _xxh64_round(v4, _rd_u64(p));    p += 8;
+	} while(p + 32 <= end);
+
+	h = _rotl64(v1, 1) + _rotl64(v2, 7) + _rotl64(v3, 12) + _rotl64(v4, 18);
+	h = _xxh64_merge(h, v1);
+	h = _xxh64_merge(h, v2);
+	h = _xxh64_merge(h, v3);
+	h = _xxh64_merge(h, v4);
+    } else {
+	h = seed + XXH_P5;
+    }
+
+    h += (uint64_t)len;
+
+    for(; p + 8 <= end; p += 8) {
+	h ^= _xxh64_round(0, _rd_u64(p));
+	h = _rotl64(h, 27) * XXH_P1 + XXH_P4;
+    }
+    if(p + 4 <= end) {
+	h ^= (uint64_t)_rd_int32(p) * XXH_P1;
+	h = _rotl64(h, 23) * XXH_P2 + XXH_P3;
+	p += 4;
+    }
+    for(; p < end; p++) {
+	h ^= (*p) * XXH_P5;
+	h = _rotl64(h, 11) * XXH_P1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+/*
+  Find key (klen bytes, not NUL terminated) among the elements of the raw
+  BSON document (or array) at doc without building any iterators.  On
+  success *t, *vp and *vlen describe its value.  This is the scalar
+  version; _bson_find_key_raw uses it when there are no vectors to be had.
+*/
+static bool _bson_find_key_scalar(
+    const uint8_t* doc,
+    uint32_t doc_len,
+    const char* key,
+    int klen,
+    uint8_t* t,
+    const uint8_t** vp,
+    uint32_t* vlen)
+{
+    if(doc_len < 5 || _rd_int32(doc) != doc_len) return false;
+
+    const uint8_t* end = doc + doc_len - 1;
+    const uint8_t* p = doc + 4;
+    while(p < end) {
+	uint8_t et = *p++;
+	const uint8_t* ekey = p;
+	const uint8_t* nul = memchr(p, 0, end - p);
+	if(nul == 0) return false;
+	p = nul + 1;
+
+	int64_t n = _bson_value_len(et, p, end);
+	if(n < 0) return false;
+
+	if(nul - ekey == klen && (klen == 0 || ekey[0] == (uint8_t)key[0]) && memcmp(ekey, key, klen) == 0) {
+	    *t = et;
+	    *vp = p;
+	    *vlen = (uint32_t)n;
+	    return true;
+	}
+	p += n;
+    }
+    return false;
+}
+
+#ifdef BSONEXT_KEY_VEC
+#if BSONEXT_KEY_VEC == 32
+typedef __m256i _kvec;
+#define _KVEC_LOAD(p)    _mm256_loadu_si256((const __m256i*)(p))
+#define _KVEC_EQ(a,b)    ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8((a),(b))))
+#define _KVEC_ZERO()     _mm256_setzero_si256()
+#else
+typedef __m128i _kvec;
+#define _KVEC_LOAD(p)    _mm_loadu_si128((const __m128i*)(p))
+#define _KVEC_EQ(a,b)    ((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8((a),(b))))
+#define _KVEC_ZERO()     _mm_setzero_si128()
+#endif
+#endif
+
+/*
+  Same as _bson_find_key_scalar, but one vector load of each element key
+  answers both "where is its NUL" and "is it our key":  the target key
+  plus its terminating NUL is compared in one go, so a key that merely
+  starts the same never matches.  Keys too long for a vector, and the last
+  few elements where a full load would read past the document, take the
+  scalar path.  The common fixed size values are skipped inline.
+*/
+static bool _bson_find_key_raw(
+    const uint8_t* doc,
+    uint32_t doc_len,
+    const char* key,
+    int klen,
+    uint8_t* t,
+    const uint8_t** vp,
+    uint32_t* vlen)
+{
+#ifdef BSONEXT_KEY_VEC
+    if(klen >= BSONEXT_KEY_VEC) return _bson_find_key_scalar(doc, doc_len, key, klen, t, vp, vlen);
+    if(doc_len < 5 || _rd_int32(doc) != doc_len) return false;
+
+    uint8_t kbuf[BSONEXT_KEY_VEC] = {0};
+    memcpy(kbuf, key, klen);
+    const _kvec kv = _KVEC_LOAD(kbuf);
+    const _kvec zero = _KVEC_ZERO();
+    const uint32_t kmask = (klen + 1 >= 32) ? 0xffffffffu : ((1u << (klen + 1)) - 1);
+
+    const uint8_t* end = doc + doc_len - 1;
+    const uint8_t* p = doc + 4;
+    while(p < end) {
+	uint8_t et = *p++;
+	const uint8_t* ekey = p;
+	const uint8_t* nul;
+	bool match;
+
+	if(end - p >= BSONEXT_KEY_VEC) {
+	    _kvec ev = _KVEC_LOAD(p);
+	    uint32_t z = _KVEC_EQ(ev, zero);
+	    match = (_KVEC_EQ(ev, kv) & kmask) == kmask;
+	    nul = z ? p + __builtin_ctz(z) : memchr(p + BSONEXT_KEY_VEC, 0, end - (p + BSONEXT_KEY_VEC));
+	} else {
+	    nul = memchr(p, 0, end - p);
+	    match = nul != 0 && nul - ekey == klen && memcmp(ekey, key, klen) == 0;
+	}
+	if(nul == 0 || nul >= end) return false;
+	p = nul + 1;
+
+	int64_t n;
+	switch(et) {
+	case BSON_TYPE_DOUBLE:
+	case BSON_TYPE_DATE_TIME:
+	case BSON_TYPE_INT64:    n = 8; break;
+	case BSON_TYPE_INT32:    n = 4; break;
+	case BSON_TYPE_UTF8:     n = (end - p >= 4) ? 4 + (int64_t)_rd_int32(p) : -1; break;
+	case BSON_TYPE_DOCUMENT:
+	case BSON_TYPE_ARRAY:    n = (end - p >= 4) ? (int64_t)_rd_int32(p) : -1; break;
+	default:                 n = _bson_value_len(et, p, end);
+	}
+	if(n < 5 && (et == BSON_TYPE_UTF8 || et == BSON_TYPE_DOCUMENT || et == BSON_TYPE_ARRAY)) return false;
+	if(n < 0 || n > end - p) return false;
+
+	if(match) {
+	    *t = et;
+	    *vp = p;
+	    *vlen = (uint32_t)n;
+	    return true;
+	}
+	p += n;
+    }
+    return false;
+#else
+    return _bson_find_key_scalar(doc, doc_len, key, klen, t, vp, vlen);
+#endif
+}
+
+/*
+  Descend dotpath through the raw BSON document (or array) at data
+  without building any iterators.  Same matching rules as
+  bson_iter_find_descendant:  each segment must equal a key exactly, and
+  array offsets are simply the keys "0", "1", ...  On success *t, *vp and
+  *vlen describe the target value.  An empty dotpath is the document
+  itself.
+*/
+static bool _bson_find_raw(
+    const uint8_t* data,
+    uint32_t len,
+    const char* dotpath,
+    uint8_t* t,
+    const uint8_t** vp,
+    uint32_t* vlen)
+{
+    *t = BSON_TYPE_DOCUMENT;
+    *vp = data;
+    *vlen = len;
+
+    const char* seg = dotpath;
+    while(*dotpath != '\0' && seg != 0) {
+	if(*t != BSON_TYPE_DOCUMENT && *t != BSON_TYPE_ARRAY) return false;
+
+	const char* dot = strchr(seg, '.');
+	int seglen = dot ? dot - seg : strlen(seg);
+
+	if(!_bson_find_key_raw(*vp, *vlen, seg, seglen, t, vp, vlen)) return false;
+
+	seg = dot ? dot + 1 : 0;
+    }
+    return true;
+}
+
+
+
+/*
+  Wildcard dotpaths.  A segment that is "*" or "$[]" matches every element
+  of the document or array at that level, so 'payments.*.amt' is the amt
+  of each payment.  _fan_next yields the matches one at a time, depth
+  first in document order, along with the concrete path of each
+  ('payments.0.amt', 'payments.1.amt', ...).  Nothing is copied; matches
+  point into the document.
+*/
+#define BSONEXT_FAN_MAX_SEGS 32
+
+typedef struct {
+    const uint8_t* doc;     // document or array searched on this level
+    uint32_t len;
+    const uint8_t* q;       // next element, for wildcard levels
+    bool done;              // exact levels look only once
+    sqlite3_int64 plen;     // length of the concrete path above this level
+} _fan_level;
+
+typedef struct {
+    const char* seg[BSONEXT_FAN_MAX_SEGS];
+    int seglen[BSONEXT_FAN_MAX_SEGS];
+    int nseg;
+    _fan_level lv[BSONEXT_FAN_MAX_SEGS];
+    int depth;              // -1 when there is nothing more
+    bool err;               // malformed BSON met on the way
+    _buf_t path;            // concrete path of the current match
+
+    // The current match:  its container, element (0 for the whole
+    // document when the dotpath is empty) and value.
+    const uint8_t* cdoc;
+    uint32_t cdoc_len;
+    const uint8_t* elem;
+    _belem e;
+} _fan_t;
+
+static bool _is_wild(const char* seg, int n)
+{
+    return (n == 1 && seg[0] == '*') || (n == 3 && memcmp(seg, "$[]", 3) == 0);
+}
+
+static bool _has_wildcard(const char* dotpath)
+{
+    for(const char* seg = dotpath; seg != 0; ) {
+	const char* dot = strchr(seg, '.');
+	if(_is_wild(seg, dot ? dot - seg : strlen(seg))) return true;
+	seg = dot ? dot + 1 : 0;
+    }
+    return false;
+}
+
+// dotpath must outlive the walk; false if it has too many segments:
+static bool _fan_init(_fan_t* f, const char* dotpath, const uint8_t* doc, uint32_t len)
+{
+    memset(f, 0, sizeof(_fan_t));
+    if(*dotpath != '\0') {
+	for(const char* seg = dotpath; seg != 0; ) {
+	    if(f->nseg == BSONEXT_FAN_MAX_SEGS) return false;
+	    const char* dot = strchr(seg, '.');
+	    f->seg[f->nseg] = seg;
+	    f->seglen[f->nseg++] = dot ? dot - seg : strlen(seg);
+	    seg = dot ? dot + 1 : 0;
+	}
+    }
+    f->lv[0].doc = doc;
+    f->lv[0].len = len;
+    f->lv[0].q = doc + 4;
+    if(len < 5 || _rd_int32(doc) != len) f->depth = -1;
+    return true;
+}
+
+static bool _fan_next(_fan_t* f)
+{
+    if(f->nseg == 0) {
+	// Empty dotpath:  the document itself, once.
+	if(f->depth < 0) return false;
+	f->depth = -1;
+	f->cdoc = f->lv[0].doc;
+	f->cdoc_len = f->lv[0].len;
+	f->elem = 0;
+	f->e.t = BSON_TYPE_DOCUMENT;
+	f->e.v = f->lv[0].doc;
+	f->e.vlen = f->lv[0].len;
+	f->path.len = 0;
+	_buf_byte(&f->path, 0);
+	f->path.len--;
+	return true;
+    }
+
+    while(f->depth >= 0) {
+	int d = f->depth;
+	_fan_level* L = &f->lv[d];
+	const uint8_t* at;
+
+	if(_is_wild(f->seg[d], f->seglen[d])) {
+	    at = L->q;
+	    L->q = _next_elem(at, L->doc + L->len - 1, &f->e, &f->err);
+	    if(L->q == 0) {
+		if(f->err) return false;
+		f->depth--;
+		continue;
+	    }
+	} else {
+	    uint8_t t;
+	    const uint8_t* vp;
+	    uint32_t vlen;
+	    if(L->done || !_bson_find_key_raw(L->doc, L->len, f->seg[d], f->seglen[d], &t, &vp, &vlen)) {
+		f->depth--;
+		continue;
+	    }
+	    L->done = true;
+	    f->e.t = t;
+	    f->e.key = f->seg[d];
+	    f->e.klen = f->seglen[d];
+	    f->e.v = vp;
+	    f->e.vlen = vlen;
+	    at = vp - f->seglen[d] - 2;
+	}
+
+	f->path.len = L->plen;
+	if(d > 0) _buf_byte(&f->path, '.');
+	_buf_append(&f->path, f->e.key, f->e.klen);
+
+	if(d == f->nseg - 1) {
+	    f->cdoc = L->doc;
+	    f->cdoc_len = L->len;
+	    f->elem = at;
+	    _buf_byte(&f->path, 0);
+	    f->path.len--;     // keep the NUL out of the length
+	    return true;
+	}
+	if((f->e.t == BSON_TYPE_DOCUMENT || f->e.t == BSON_TYPE_ARRAY) && f->e.vlen >= 5) {
+	    _fan_level* N = &f->lv[d + 1];
+	    N->doc = f->e.v;
+	    N->len = f->e.vlen;
+	    N->q = f->e.v + 4;
+	    N->done = false;
+	    N->plen = f->path.len;
+	    f->depth++;
+	}
+    }
+    return false;
+}
+
+// Set the current match as bson_get would return it:
+static void _fan_result(sqlite3_context* context, _fan_t* f)
+{
+    if(f->elem == 0) {
+	bson_t b;
+	if(bson_init_static(&b, f->e.v, f->e.vlen)) _set_json(context, &b);
+	return;
+    }
+    bson_iter_t iter;
+    if(bson_iter_init_from_data_at_offset(&iter, f->cdoc, f->cdoc_len, f->elem - f->cdoc, f->e.klen)) {
+	extract_and_set_context(context, &iter);
+    }
+}
+
+
+/*
+  Key dictionaries for the compact storage format produced by bson_compact().
+
+  The compact format is the BSON byte layout with two changes:
+    1.  Document keys are replaced by a varint id from the bson_keydict table.
+    2.  Array keys ("0", "1", ...) are dropped entirely; position is implied.
+  Everything else (type bytes, int32 length prefixes, value bytes) is
+  identical so the normal BSON value length rules still apply.   The blob
+  is prefixed with the magic "BSKC" and a varint dict_id.  As a
+  little-endian int32, "BSKC" is > 1GB so it can never be mistaken for the
+  length prefix of a regular BSON blob in sqlite.
+
+  Dictionary rows are append-only; ids are assigned max+1 per dict_id and
+  triggers refuse UPDATE and DELETE.  So a given compact blob always reads
+  back the same, which is what lets bson_get etc. stay DETERMINISTIC while
+  they consult the table.  Each connection caches the dictionaries it
+  touches; only ids this connection added in a still-open write
+  transaction can be taken away (by a rollback), which is what dirty
+  tracks.
+*/
+#define BSONEXT_COMPACT_MAGIC "BSKC"
+
+typedef struct keydict {
+    sqlite3_int64 dict_id;
+
+    char** keys;      // keys[id], id 1..nkeys; keys[0] unused
+    int* klens;
+    uint32_t nkeys;
+    uint32_t kcap;
+
+    uint32_t* slots;  // open addressing key -> id;  0 means empty
+    uint32_t nslots;  // always a power of 2
+
+    int dirty;        // added keys not yet known committed; see _keydict_sync
+
+    struct keydict* next;
+} keydict;
+
+// Per-connection state handed to the functions as user data:
+typedef struct {
+    int refs;
+    keydict* dicts;
+} bsonext_conn;
+
+
+static uint32_t _key_hash(const char* key, int klen)
+{
+    uint32_t h = 2166136261u; // FNV-1a
+    for(int n = 0; n < klen; n++) {
+	h ^= (uint8_t)key[n];
+	h *= 16777619u;
+    }
+    return h;
+}
+
+static void _keydict_clear(keydict* d)
+{
+    for(uint32_t id = 1; id <= d->nkeys; id++) {
+	sqlite3_free(d->keys[id]);
+    }
+    sqlite3_free(d->keys);
+    sqlite3_free(d->klens);
+    sqlite3_free(d->slots);
+    d->keys = 0;
+    d->klens = 0;
+    d->slots = 0;
+    d->nkeys = d->kcap = d->nslots = 0;
+}
+
+static uint32_t _keydict_find(keydict* d, const char* key, int klen)
+{
+    if(d->nslots == 0) return 0;
+
+    uint32_t mask = d->nslots - 1;
+    for(uint32_t i = _key_hash(key, klen) & mask; d->slots[i] != 0; i = (i+1) & mask) {
+	uint32_t id = d->slots[i];
+	if(d->klens[id] == klen && memcmp(d->keys[id], key, klen) == 0) {
+	    return id;
+	}
+    }
+    return 0;
+}
+
+static int _keydict_add(keydict* d, uint32_t id, const char* key, int klen)
+{
+    if(id >= d->kcap) {
+	uint32_t ncap = d->kcap ? d->kcap : 64;
+	while(ncap <= id) ncap *= 2;
+	char** nk = sqlite3_realloc64(d->keys, ncap * sizeof(char*));
+	if(nk == 0) return SQLITE_NOMEM;
+	d->keys = nk;
+	int* nl = sqlite3_realloc64(d->klens, ncap * sizeof(int));
+	if(nl == 0) return SQLITE_NOMEM;
+	d->klens = nl;
+	memset(d->keys + d->kcap, 0, (ncap - d->kcap) * sizeof(char*));
+	memset(d->klens + d->kcap, 0, (ncap - d->kcap) * sizeof(int));
+	d->kcap = ncap;
+    }
+
+    // Keep the hash at most half full; rehash everything on growth:
+    if((id + 1) * 2 > d->nslots) {
+	uint32_t nslots = d->nslots ? d->nslots * 2 : 128;
+	while((id + 1) * 2 > nslots) nslots *= 2;
+	uint32_t* ns = sqlite3_malloc64(nslots * sizeof(uint32_t));
+	if(ns == 0) return SQLITE_NOMEM;
+	memset(ns, 0, nslots * sizeof(uint32_t));
+	for(uint32_t k = 1; k <= d->nkeys; k++) {
+	    if(d->keys[k] == 0) continue;
+	    uint32_t i = _key_hash(d->keys[k], d->klens[k]) & (nslots - 1);
+	    while(ns[i] != 0) i = (i+1) & (nslots - 1);
+	    ns[i] = k;
+	}
+	sqlite3_free(d->slots);
+	d->slots = ns;
+	d->nslots = nslots;
+    }
+
+    d->keys[id] = sqlite3_mprintf("%.*s", klen, key);
+    if(d->keys[id] == 0) return SQLITE_NOMEM;
+    d->klens[id] = klen;
+    if(id > d->nkeys) d->nkeys = id;
+
+    uint32_t i = _key_hash(key, klen) & (d->nslots - 1);
+    while(d->slots[i] != 0) i = (i+1) & (d->nslots - 1);
+    d->slots[i] = id;
+
+    return SQLITE_OK;
+}
+
+/*
+  Bring the cache up to date with bson_keydict.  The row for our highest
+  cached id is re-read along with anything newer; if it is gone or
+  different (our transaction that added it rolled back, and maybe another
+  connection reused the id) the cache is flushed and reloaded.  Outside a
+  write transaction whatever we see is committed, so dirty is cleared.
+*/
+static int _keydict_sync(sqlite3* db, keydict* d)
+{
+    sqlite3_stmt* stmt = 0;
+    int rc = sqlite3_prepare_v2(db, "SELECT key_id, key FROM bson_keydict WHERE dict_id = ?1 AND key_id >= ?2 ORDER BY key_id", -1, &stmt, 0);
+    if(rc != SQLITE_OK) return rc;
+
+    for(int pass = 0; pass < 2; pass++) {
+	bool stale = false;
+	uint32_t highest = d->nkeys;
+
+	sqlite3_bind_int64(stmt, 1, d->dict_id);
+	sqlite3_bind_int64(stmt, 2, highest);
+
+	rc = sqlite3_step(stmt);
+	if(highest > 0) {
+	    if(rc != SQLITE_ROW
+	       || sqlite3_column_int64(stmt, 0) != highest
+	       || sqlite3_column_bytes(stmt, 1) != d->klens[highest]
+	       || memcmp(sqlite3_column_text(stmt, 1), d->keys[highest], d->klens[highest]) != 0) {
+		stale = true;
+	    } else {
+		rc = sqlite3_step(stmt);
+	    }
+	}
+
+	for(; !stale && rc == SQLITE_ROW; rc = sqlite3_step(stmt)) {
+	    sqlite3_int64 id = sqlite3_column_int64(stmt, 0);
+	    const char* key = (const char*) sqlite3_column_text(stmt, 1);
+	    if(id <= 0 || id > UINT32_MAX/4 || key == 0) continue;
+	    if((rc = _keydict_add(d, (uint32_t)id, key, sqlite3_column_bytes(stmt, 1))) != SQLITE_OK) break;
+	}
+	sqlite3_reset(stmt);
+
+	if(!stale) break;
+	_keydict_clear(d);
+	d->dirty = 0;
+    }
+
+    sqlite3_finalize(stmt);
+    rc = (rc == SQLITE_DONE || rc == SQLITE_ROW) ? SQLITE_OK : rc;
+    if(rc == SQLITE_OK && sqlite3_txn_state(db, 0) != SQLITE_TXN_WRITE) d->dirty = 0;
+    return rc;
+}
+
+static keydict* _keydict_get(sqlite3* db, bsonext_conn* conn, sqlite3_int64 dict_id, int* rc)
+{
+    *rc = SQLITE_OK;
+    for(keydict* d = conn->dicts; d != 0; d = d->next) {
+	if(d->dict_id == dict_id) return d;
+    }
+
+    keydict* d = sqlite3_malloc(sizeof(keydict));
+    if(d == 0) {
+	*rc = SQLITE_NOMEM;
+	return 0;
+    }
+    memset(d, 0, sizeof(keydict));
+    d->dict_id = dict_id;
+    d->next = conn->dicts;
+    conn->dicts = d;
+
+    *rc = _keydict_sync(db, d);
+    return d;
+}
+
+// id for key, adding it to bson_keydict if need be; 0 on failure
+static uint32_t _keydict_id_for(sqlite3* db, keydict* d, const char* key, int klen)
+{
+    uint32_t id = _keydict_find(d, key, klen);
+    if(id != 0) return id;
+
+    sqlite3_stmt* stmt = 0;
+    int rc = sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO bson_keydict (dict_id, key_id, key) SELECT ?1, coalesce(max(key_id),0)+1, ?2 FROM bson_keydict WHERE dict_id = ?1", -1, &stmt, 0);
+    if(rc == SQLITE_OK) {
+	sqlite3_bind_int64(stmt, 1, d->dict_id);
+	sqlite3_bind_text(stmt, 2, key, klen, SQLITE_STATIC);
+	rc = sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+    }
+    if(rc != SQLITE_DONE) return 0;
+
+    d->dirty = 1;
+    if(_keydict_sync(db, d) != SQLITE_OK) return 0;
+
+    return _keydict_find(d, key, klen);
+}
+
+// key for id, rereading bson_keydict once if we don't know it
+static const char* _keydict_key(sqlite3* db, keydict* d, uint64_t id, int* klen)
+{
+    if(id == 0) return 0;
+    if(id > d->nkeys || d->keys[id] == 0) {
+	if(_keydict_sync(db, d) != SQLITE_OK) return 0;
+	if(id > d->nkeys || d->keys[id] == 0) return 0;
+    }
+    *klen = d->klens[id];
+    return d->keys[id];
+}
+
+static bsonext_conn* _conn_ref(bsonext_conn* conn)
+{
+    conn->refs++;
+    return conn;
+}
+
+// Registered as xDestroy for every function that holds a reference:
+static void _conn_release(void* p)
+{
+    bsonext_conn* conn = (bsonext_conn*)p;
+    if(--conn->refs > 0) return;
+
+    while(conn->dicts != 0) {
+	keydict* d = conn->dicts;
+	conn->dicts = d->next;
+	_keydict_clear(d);
+	sqlite3_free(d);
+    }
+    sqlite3_free(conn);
+}
+
+
+static bool _is_compact(const uint8_t* data, int len)
+{
+    return len >= 4 && memcmp(data, BSONEXT_COMPACT_MAGIC, 4) == 0;
+}
+
+/*
+  Regular BSON document (or array) at p -> compact form appended to out.
+  Returns an error message or 0 on success.
+*/
+static const char* _compact_doc(
+    sqlite3* db,
+    keydict* d,
+    const uint8_t* p,
+    uint32_t len,
+    bool is_array,
+    _buf_t* out)
+{
+    if(len < 5 || _rd_int32(p) != len || p[len-1] != 0) return "invalid BSON";
+
+    const uint8_t* end = p + len - 1; // the terminating NUL
+    sqlite3_int64 hdr = out->len;
+    _buf_int32(out, 0);
+
+    p += 4;
+    while(p < end) {
+	uint8_t t = *p++;
+	const uint8_t* key = p;
+	const uint8_t* nul = memchr(p, 0, end - p);
+	if(nul == 0) return "invalid BSON";
+	p = nul + 1;
+
+	int64_t vlen = _bson_value_len(t, p, end);
+	if(vlen < 0) return "invalid BSON";
+
+	_buf_byte(out, t);
+	if(!is_array) {
+	    uint32_t id = _keydict_id_for(db, d, (const char*)key, nul - key);
+	    if(id == 0) return "cannot update bson_keydict";
+	    _buf_varint(out, id);
+	}
+
+	if(t == BSON_TYPE_DOCUMENT || t == BSON_TYPE_ARRAY) {
+	    const char* err = _compact_doc(db, d, p, vlen, t == BSON_TYPE_ARRAY, out);
+	    if(err != 0) return err;
+	} else {
+	    _buf_append(out, p, vlen);
+	}
+	p += vlen;
+    }
+
+    _buf_byte(out, 0);
+    _buf_patch_len(out, hdr);
+
+    return out->oom ? "out of memory" : 0;
+}
+
+/*
+  Compact document (or array) at p -> regular BSON appended to out.
+  Returns an error message or 0 on success.
+*/
+static const char* _expand_doc(
+    sqlite3* db,
+    keydict* d,
+    const uint8_t* p,
+    uint32_t len,
+    bool is_array,
+    _buf_t* out)
+{
+    if(len < 5 || _rd_int32(p) != len || p[len-1] != 0) return "invalid compact BSON";
+
+    const uint8_t* end = p + len - 1;
+    sqlite3_int64 hdr = out->len;
+    _buf_int32(out, 0);
+
+    p += 4;
+    for(uint32_t idx = 0; p < end; idx++) {
+	uint8_t t = *p++;
+
+	_buf_byte(out, t);
+	if(is_array) {
+	    char ibuf[16];
+	    int ilen = sprintf(ibuf, "%u", idx);
+	    _buf_append(out, ibuf, ilen + 1); // incl. NUL
+	} else {
+	    uint64_t id;
+	    int klen;
+	    p = _get_varint(p, end, &id);
+	    if(p == 0) return "invalid compact BSON";
+	    const char* key = _keydict_key(db, d, id, &klen);
+	    if(key == 0) return "unknown key id in compact BSON";
+	    _buf_append(out, key, klen + 1);
+	}
+
+	int64_t vlen = _bson_value_len(t, p, end);
+	if(vlen < 0) return "invalid compact BSON";
+
+	if(t == BSON_TYPE_DOCUMENT || t == BSON_TYPE_ARRAY) {
+	    const char* err = _expand_doc(db, d, p, vlen, t == BSON_TYPE_ARRAY, out);
+	    if(err != 0) return err;
+	} else {
+	    _buf_append(out, p, vlen);
+	}
+	p += vlen;
+    }
+
+    _buf_byte(out, 0);
+    _buf_patch_len(out, hdr);
+
+    return out->oom ? "out of memory" : 0;
+}
+
+// Split a compact blob into its dictionary and top-level compact document:
+static const char* _compact_open(
+    sqlite3_context* context,
+    const uint8_t* data,
+    int len,
+    keydict** pd,
+    const uint8_t** doc,
+    uint32_t* doc_len)
+{
+    uint64_t dict_id;
+    const uint8_t* p = _get_varint(data + 4, data + len, &dict_id);
+    if(p == 0) return "invalid compact BSON";
+
+    int rc;
+    bsonext_conn* conn = (bsonext_conn*) sqlite3_user_data(context);
+    sqlite3* db = sqlite3_context_db_handle(context);
+    *pd = _keydict_get(db, conn, (sqlite3_int64)dict_id, &rc);
+
+    // Only keys we added in the open write transaction can be stale:
+    if(rc == SQLITE_OK && (*pd)->dirty) rc = _keydict_sync(db, *pd);
+    if(rc != SQLITE_OK) return "cannot read bson_keydict";
+
+    *doc = p;
+    *doc_len = (data + len) - p;
+    return 0;
+}
+
+/*
+  Same as _init_bson except that compact blobs are transparently expanded
+  into *owned, which the caller must sqlite3_free().   On failure the
+  error is already set on the context.
+*/
+static bool _init_bson_expanded(
+    sqlite3_context* context,
+    bson_t* b,
+    sqlite3_value **argv,
+    uint8_t** owned)
+{
+    *owned = 0;
+
+    const uint8_t* data = sqlite3_value_blob(argv[0]);
+    int len = sqlite3_value_bytes(argv[0]);
+
+    if(!_is_compact(data, len)) {
+	if(!_init_bson(b, argv)) {
+	    sqlite3_result_error(context, "invalid BSON", -1);
+	    return false;
+	}
+	return true;
+    }
+
+    keydict* d;
+    const uint8_t* doc;
+    uint32_t doc_len;
+    _buf_t out = {0};
+
+    const char* err = _compact_open(context, data, len, &d, &doc, &doc_len);
+    if(err == 0) {
+	err = _expand_doc(sqlite3_context_db_handle(context), d, doc, doc_len, false, &out);
+    }
+    if(err == 0 && !bson_init_static(b, out.data, out.len)) {
+	err = "invalid compact BSON";
+    }
+    if(err != 0) {
+	sqlite3_free(out.data);
+	sqlite3_result_error(context, err, -1);
+	return false;
+    }
+
+    *owned = out.data;
+    return true;
+}
+
+// Dotpath segments (by position) known not to be in a dictionary, kept
+// for one statement as auxdata on the dotpath argument:
+typedef struct {
+    sqlite3_int64 dict_id;
+    uint32_t nkeys;         // dictionary size when we looked
+    uint64_t segs;
+} _key_miss;
+
+/*
+  Follow the dotpath in argv[1] through the compact blob in argv[0].  The
+  descent compares integer key ids (each dotpath segment is looked up in
+  the dictionary once) and never expands anything.  Returns false with the
+  error set on the context; otherwise *found says whether the path exists
+  and pt, pv and pvlen describe the (still compact) value.
+*/
+static bool _compact_find(
+    sqlite3_context *context,
+    sqlite3_value **argv,
+    keydict** pd,
+    uint8_t* pt,
+    const uint8_t** pv,
+    int64_t* pvlen,
+    bool* found)
+{
+    sqlite3* db = sqlite3_context_db_handle(context);
+    const uint8_t* data = sqlite3_value_blob(argv[0]);
+    int len = sqlite3_value_bytes(argv[0]);
+    const char* dotpath = (const char*) sqlite3_value_text(argv[1]);
+    *found = false;
+    if(dotpath == 0) return true;
+
+    keydict* d;
+    const uint8_t* p;
+    uint32_t plen;
+    const char* err = _compact_open(context, data, len, &d, &p, &plen);
+    if(err != 0) {
+	sqlite3_result_error(context, err, -1);
+	return false;
+    }
+
+    // "Current value" starts as the whole top level document:
+    uint8_t t = BSON_TYPE_DOCUMENT;
+    int64_t vlen = plen;
+
+    const char* seg = dotpath;
+    for(int segno = 0; *dotpath != '\0' && seg != 0; segno++) {
+	const char* dot = strchr(seg, '.');
+	int seglen = dot ? dot - seg : strlen(seg);
+	bool is_array = (t == BSON_TYPE_ARRAY);
+
+	if(t != BSON_TYPE_DOCUMENT && t != BSON_TYPE_ARRAY) return true;
+	if(vlen < 5 || _rd_int32(p) != vlen) {
+	    sqlite3_result_error(context, "invalid compact BSON", -1);
+	    return false;
+	}
+
+	uint64_t want = 0;
+	if(is_array) {
+	    // Only canonical offsets match, same as BSON "0","1",... keys:
+	    if(seglen == 0 || seglen > 10 || (seglen > 1 && seg[0] == '0')) return true;
+	    for(int n = 0; n < seglen; n++) {
+		if(seg[n] < '0' || seg[n] > '9') return true;
+		want = want * 10 + (seg[n] - '0');
+	    }
+	} else {
+	    want = _keydict_find(d, seg, seglen);
+	    if(want == 0) {
+		// Maybe added by another connection since we cached.  A
+		// statement sees one snapshot, so once the table says no it
+		// says no for the rest of this statement:
+		_key_miss* m = sqlite3_get_auxdata(context, 1);
+		bool known = m != 0 && m->dict_id == d->dict_id && m->nkeys == d->nkeys
+		    && segno < 64 && (m->segs & ((uint64_t)1 << segno));
+		if(known) return true;
+
+		if(_keydict_sync(db, d) != SQLITE_OK) {
+		    sqlite3_result_error(context, "cannot read bson_keydict", -1);
+		    return false;
+		}
+		want = _keydict_find(d, seg, seglen);
+		if(want == 0) {
+		    // no doc anywhere has this key
+		    if(m == 0 || m->dict_id != d->dict_id || m->nkeys != d->nkeys) {
+			m = sqlite3_malloc(sizeof(_key_miss));
+			if(m != 0) {
+			    m->dict_id = d->dict_id;
+			    m->nkeys = d->nkeys;
+			    m->segs = 0;
+			    sqlite3_set_auxdata(context, 1, m, sqlite3_free);
+			    m = sqlite3_get_auxdata(context, 1);
+			}
+		    }
+		    if(m != 0 && segno < 64) m->segs |= (uint64_t)1 << segno;
+		    return true;
+		}
+	    }
+	}
+
+	const uint8_t* end = p + vlen - 1;
+	const uint8_t* q = p + 4;
+	bool hit = false;
+	for(uint64_t idx = 0; q < end; idx++) {
+	    uint8_t et = *q++;
+	    uint64_t id = idx;
+	    if(!is_array) {
+		q = _get_varint(q, end, &id);
+		if(q == 0) break;
+	    }
+	    int64_t elen = _bson_value_len(et, q, end);
+	    if(elen < 0) break;
+
+	    if(id == want) {
+		t = et;
+		p = q;
+		vlen = elen;
+		hit = true;
+		break;
+	    }
+	    q += elen;
+	}
+	if(!hit) return true;
+
+	seg = dot ? dot + 1 : 0;
+    }
+
+    *pd = d;
+    *pt = t;
+    *pv = p;
+    *pvlen = vlen;
+    *found = true;
+    return true;
+}
+
+/*
+  bson_get and bson_get_bson on compact blobs.  Only the target is
+  expanded back to regular BSON.
+*/
+static void _compact_get(
+    sqlite3_context *context,
+    sqlite3_value **argv,
+    bool want_bson)
+{
+    sqlite3* db = sqlite3_context_db_handle(context);
+    keydict* d;
+    uint8_t t;
+    const uint8_t* p;
+    int64_t vlen;
+    bool found;
+    if(!_compact_find(context, argv, &d, &t, &p, &vlen, &found) || !found) return;
+
+    const char* err = 0;
+    _buf_t out = {0};
+
+    if(t == BSON_TYPE_DOCUMENT || t == BSON_TYPE_ARRAY) {
+	err = _expand_doc(db, d, p, vlen, t == BSON_TYPE_ARRAY, &out);
+	if(err == 0) {
+	    if(want_bson) {
+		sqlite3_result_blob(context, out.data, out.len, sqlite3_free);
+		if(t == BSON_TYPE_ARRAY) sqlite3_result_subtype(context, BSONEXT_SUBTYPE_ARRAY);
+		return;
+	    }
+	    bson_t b;
+	    bson_init_static(&b, out.data, out.len);
+	    _set_json(context, &b);
+	}
+
+    } else if(!want_bson) {
+	// Scalars are byte-identical to regular BSON; wrap the value in a
+	// tiny { "": value } document so the regular extractor can be used:
+	_buf_int32(&out, 0);
+	_buf_byte(&out, t);
+	_buf_byte(&out, 0);
+	_buf_append(&out, p, vlen);
+	_buf_byte(&out, 0);
+	_buf_patch_len(&out, 0);
+
+	bson_iter_t iter;
+	if(out.oom) {
+	    err = "out of memory";
+	} else if(bson_iter_init_from_data(&iter, out.data, out.len) && bson_iter_next(&iter)) {
+	    extract_and_set_context(context, &iter);
+	}
+    }
+
+    if(err != 0) sqlite3_result_error(context, err, -1);
+    sqlite3_free(out.data);
+}
+
+
+/*
+  bson_get and bson_get_bson with a wildcard dotpath:  the matches, in
+  order, as a BSON array (bson_get gives that array as JSON).  NULL if
+  nothing matched.
+*/
+static void _fanout_doc(
+    sqlite3_context *context,
+    const uint8_t* data,
+    uint32_t len,
+    const char* dotpath,
+    bool want_bson)
+{
+    _fan_t f;
+    if(!_fan_init(&f, dotpath, data, len)) {
+	sqlite3_result_error(context, "dotpath has too many segments", -1);
+	return;
+    }
+
+    _buf_t out = {0};
+    char ibuf[16];
+    int n = 0;
+    _buf_int32(&out, 0);
+    while(_fan_next(&f)) {
+	int klen = sprintf(ibuf, "%d", n++);
+	_buf_elem(&out, f.e.t, ibuf, klen, f.e.v, f.e.vlen);
+    }
+    _buf_byte(&out, 0);
+    _buf_patch_len(&out, 0);
+
+    if(f.err) {
+	sqlite3_result_error(context, "invalid BSON", -1);
+    } else if(out.oom || f.path.oom) {
+	sqlite3_result_error_nomem(context);
+    } else if(n > 0) {
+	bson_t arr;
+	if(want_bson) {
+	    sqlite3_result_blob(context, out.data, out.len, SQLITE_TRANSIENT);
+	    sqlite3_result_subtype(context, BSONEXT_SUBTYPE_ARRAY);
+	} else if(bson_init_static(&arr, out.data, out.len)) {
+	    _set_json(context, &arr);
+	}
+    }
+    sqlite3_free(out.data);
+    sqlite3_free(f.path.data);
+}
+
+static void _get_fanout(
+    sqlite3_context *context,
+    sqlite3_value **argv,
+    const char* dotpath,
+    bool want_bson)
+{
+    bson_t b;
+    uint8_t* owned;
+    if(!_init_bson_expanded(context, &b, argv, &owned)) return;
+
+    _fanout_doc(context, bson_get_data(&b), b.len, dotpath, want_bson);
+    sqlite3_free(owned);
+}
+
+static void bson_get_bson_func(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+  assert( argc==2 );
+
+  // If not a BLOB (also picks up if NULL) then don't even try to init:
+  if( sqlite3_value_type(argv[0]) != SQLITE_BLOB) return;
+
+  const char* wpath = (const char*) sqlite3_value_text(argv[1]);
+  if(wpath != 0 && _has_wildcard(wpath)) {
+      _get_fanout(context, argv, wpath, true);
+      return;
+  }
+
+  if(_is_compact(sqlite3_value_blob(argv[0]), sqlite3_value_bytes(argv[0]))) {
+      _compact_get(context, argv, true);
+      return;
+  }
+
+  bson_t b; // on stack;
+  if(!_init_bson(&b, argv)) {
+      sqlite3_result_error(context, "invalid BSON", -1);
+  } else {
+      uint32_t subdoc_len;
+      const uint8_t* subdoc_data = 0;
+      uint8_t t = BSON_TYPE_DOCUMENT;
+
+      char* dotpath = (char*) sqlite3_value_text(argv[1]);
+
+      if(dotpath[0] == '\0') {
+	  subdoc_len = b.len;
+	  subdoc_data = bson_get_data(&b);
+
+      } else {
+	  const uint8_t* vp;
+	  uint32_t vlen;
+	  if(_bson_find_raw(bson_get_data(&b), b.len, dotpath, &t, &vp, &vlen)
+	     && (t == BSON_TYPE_DOCUMENT || t == BSON_TYPE_ARRAY)) {
+	      subdoc_len = vlen;
+	      subdoc_data = vp;
+	  }
+	  // ?  TBD How to "better" handle "object representation" of
+	  // noncomplex types
+      }
+
+      if(subdoc_data != 0) {
+	  // Everything up to this point was pointers to pointers to pointers
+	  // in the incoming sqlite3_value_bytes(argv[0]); no new mallocs
+	  // so nothing extra to free; let TRANSIENT copy it out and we're done
+	  sqlite3_result_blob(context, subdoc_data, subdoc_len, SQLITE_TRANSIENT);	  
+	  if(t == BSON_TYPE_ARRAY) sqlite3_result_subtype(context, BSONEXT_SUBTYPE_ARRAY);
+      }
+  }
+}
+
+
+
+
+static void extract_and_set_context(
+  sqlite3_context* context,
+  bson_iter_t* p_target
+){
+    bson_type_t ft = bson_iter_type(p_target);
+    switch(ft) {
+    case BSON_TYPE_UTF8: {
+	uint32_t len;		
+	const char* txt = bson_iter_utf8(p_target, &len); // NO NEED TO free()
+	// DEF need TRANSIENT here to copy that string...
+	sqlite3_result_text(context, txt, len, SQLITE_TRANSIENT);
+	break;
+    }
+    case BSON_TYPE_DOUBLE: {
+	double v = bson_iter_double(p_target);
+	sqlite3_result_double(context, v);	      
+	break;		
+    }
+    case BSON_TYPE_INT32: {
+	int32_t v = bson_iter_int32(p_target);
+	sqlite3_result_int(context, v);	      
+	break;		
+    }
+    case BSON_TYPE_BOOL: {
+	bool v = bson_iter_bool(p_target);
+	//  Convention for bools in sqlite3 is int 1 or 0:
+	sqlite3_result_int(context, v == true ? 1 : 0);
+	break;		
+    }	
+    case BSON_TYPE_INT64: {
+	int64_t v = bson_iter_int64(p_target);
+	sqlite3_result_int64(context, v);
+	break;		
+    }
+    case BSON_TYPE_DECIMAL128: {
+	bson_decimal128_t val;
+	if(bson_iter_decimal128(p_target, &val)) {
+	    // No decimal type in sqlite and it is dangerous to
+	    // use floating pt for penny-precise numbers so safest
+	    // to turn it into a string:
+	    char buf[43];  // from bson.h...  
+	    bson_decimal128_to_string(&val, buf);
+	    // -1 means let sqlite figure out length
+	    sqlite3_result_text(context, buf, -1, SQLITE_TRANSIENT);
+	}
+	break;		
+    }
+    case BSON_TYPE_DATE_TIME: {
+	int64_t millis_since_epoch = bson_iter_date_time (p_target);
+	
+	// No date/time/datetime in sqlite so make an ISO-8601 string.
+	// BSON datetime is always Z
+	// 2023-01-01T12:13:14.567Z  is 24 chars.
+	char buf[24+1];
+	_cvt_datetime_to_ts(buf, millis_since_epoch);
+	sqlite3_result_text(context, buf, 24, SQLITE_TRANSIENT);
+	break;		
+    }								
+	
+    case BSON_TYPE_DOCUMENT: 
+    case BSON_TYPE_ARRAY: {		
+	uint32_t subdoc_len;
+	const uint8_t* subdoc_data;
+	
+	if(ft == BSON_TYPE_DOCUMENT) {
+	    bson_iter_document(p_target, &subdoc_len, &subdoc_data);
+	} else {
+	    bson_iter_array(p_target, &subdoc_len, &subdoc_data);
+	}
+	
+	bson_t b; // on stack
+	bson_init_static(&b, subdoc_data, subdoc_len);
+
+	_set_json(context, &b);	
+
+	break;
+    }
+	
+    case BSON_TYPE_BINARY: {				
+	bson_subtype_t subtype;
+	uint32_t len;
+	const uint8_t* data;
+	
+	// What to do with subtype?  Dunno!
+	bson_iter_binary (p_target, &subtype, &len, &data);
+	
+	// sqlite likes binary hex input in this form ; here is [hello!]:
+	//    insert into zzz (f) values (x'68656c6c6f21');
+	// So given the convention that the output representation should
+	// be whatever goes between single quotes, our rep will be
+	//    68656c6c6f21 
+	// No need for space for NULL; we will build a buf and know the
+	// len to give to sqlite3_result_text:
+	
+	char* tmpp = sqlite3_malloc(len*2);
+	
+	int idx = 0;
+	for(int n = 0; n < len; n++) {
+	    // Love that pointer math....
+	    sprintf(tmpp+idx, "%02x", (uint8_t)data[n]);
+	    idx += 2;
+	}
+	
+	// Since we are using sqlite3_malloc to make the buffer, we can use
+	// sqlite_free as arg 4 to destroy tmpp:
+	sqlite3_result_text(context, tmpp, idx, sqlite3_free);	
+	break;
+    }
+	
+    default: {
+	break; // ?
+    }		
+    }
+}
+
+// bson_get of regular BSON b, dotpath without wildcards:
+static void _get_doc(sqlite3_context *context, bson_t* b, const char* dotpath)
+{
+    if(dotpath[0] == '\0') { // bson_get(bson,"") is basically to_json()
+	_set_json(context, b);
+	return;
+    }
+
+    // Descend on the raw bytes, then put an iterator on just the
+    // target element so the usual conversion applies:
+    uint8_t t;
+    const uint8_t* vp;
+    uint32_t vlen;
+    if(_bson_find_raw(bson_get_data(b), b->len, dotpath, &t, &vp, &vlen)) {
+	const char* last = strrchr(dotpath, '.');
+	uint32_t klen = last ? strlen(last + 1) : strlen(dotpath);
+	uint32_t off = (vp - bson_get_data(b)) - klen - 2;
+	bson_iter_t target;
+	if(bson_iter_init_from_data_at_offset(&target, bson_get_data(b), b->len, off, klen)) {
+	    extract_and_set_context(context, &target);
+	}
+    }
+}
+
+/*
+sqlite does not (by default) enforce column types.  The data declares its
+type, not the container.  This makes it vastly simpler to extract and
+return data because the function can call sqlite3_result_int or
+sqlite3_result_text or whatever else it wants.
+ */
+static void bson_get_func(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+    assert( argc==2 );
+
+    // If not a BLOB (also picks up if NULL) then don't even try to init:
+    if( sqlite3_value_type(argv[0]) != SQLITE_BLOB) return;
+
+    const char* wpath = (const char*) sqlite3_value_text(argv[1]);
+    if(wpath != 0 && _has_wildcard(wpath)) {
+	_get_fanout(context, argv, wpath, false);
+	return;
+    }
+
+    if(_is_compact(sqlite3_value_blob(argv[0]), sqlite3_value_bytes(argv[0]))) {
+	_compact_get(context, argv, false);
+	return;
+    }
+
+    bson_t b;
+    if(!_init_bson(&b, argv)) {
+	sqlite3_result_error(context, "invalid BSON", -1);
+    } else {
+	_get_doc(context, &b, (const char*) sqlite3_value_text(argv[1]));
+    }
+}
+
+/*
+  Incremental JSON rendering, for when the whole string would be too big
+  to hold.  The document is walked directly and the text handed out in
+  pieces; only the current token (a brace, a key, one scalar value) is
+  ever held, so memory is bounded by the largest single value.  Keys are
+  escaped and scalars formatted by libbson itself (each scalar is wrapped
+  in a one-element document), so the pieces put together are exactly
+  what bson_to_json(bdata) gives.
+*/
+typedef struct {
+    const uint8_t* q;       // next element
+    const uint8_t* end;     // the document's trailing NUL
+    bool is_array;
+    bool first;
+} _jframe;
+
+typedef struct {
+    _jframe* st;
+    int depth;
+    int cap;
+    bool done;
+    bool err;
+    _buf_t tok;             // current token; [off, tok.len) not yet handed out
+    sqlite3_int64 off;
+} _jwalk;
+
+static bool _jw_push(_jwalk* w, const uint8_t* doc, uint32_t len, bool is_array)
+{
+    if(len < 5 || _rd_int32(doc) != len || doc[len - 1] != 0) return false;
+    if(w->depth == w->cap) {
+	int ncap = w->cap ? w->cap * 2 : 16;
+	_jframe* st = sqlite3_realloc64(w->st, ncap * sizeof(_jframe));
+	if(st == 0) return false;
+	w->st = st;
+	w->cap = ncap;
+    }
+    _jframe* f = &w->st[w->depth++];
+    f->q = doc + 4;
+    f->end = doc + len - 1;
+    f->is_array = is_array;
+    f->first = true;
+    _buf_byte(&w->tok, is_array ? '[' : '{');
+    return true;
+}
+
+static void _jw_init(_jwalk* w, const uint8_t* doc, uint32_t len)
+{
+    memset(w, 0, sizeof(_jwalk));
+    if(!_jw_push(w, doc, len, false)) w->err = true;
+}
+
+static void _jw_free(_jwalk* w)
+{
+    sqlite3_free(w->st);
+    sqlite3_free(w->tok.data);
+}
+
+// Scalar value as libbson renders it:  { "" : VALUE } less the wrapping.
+static bool _jw_scalar(_jwalk* w, uint8_t t, const uint8_t* v, uint32_t vlen)
+{
+    _buf_t one = {0};
+    _buf_int32(&one, 0);
+    _buf_elem(&one, t, "", 0, v, vlen);
+    _buf_byte(&one, 0);
+    _buf_patch_len(&one, 0);
+    if(one.oom) return false;
+
+    bson_t b;
+    size_t jlen;
+    char* js = bson_init_static(&b, one.data, one.len) ? bson_as_relaxed_extended_json(&b, &jlen) : 0;
+    bool ok = (js != 0 && jlen >= 9);
+    if(ok) _buf_append(&w->tok, js + 7, jlen - 9);
+    bson_free(js);
+    sqlite3_free(one.data);
+    return ok;
+}
+
+// Put the next token in w->tok:
+static bool _jw_step(_jwalk* w)
+{
+    w->tok.len = 0;
+    w->off = 0;
+    _jframe* f = &w->st[w->depth - 1];
+
+    if(f->q >= f->end) {
+	_buf_append(&w->tok, f->is_array ? " ]" : " }", 2);
+	if(--w->depth == 0) w->done = true;
+	return true;
+    }
+
+    _belem e;
+    bool err;
+    const uint8_t* nq = _next_elem(f->q, f->end, &e, &err);
+    if(nq == 0) return false;
+    f->q = nq;
+
+    _buf_append(&w->tok, f->first ? " " : ", ", f->first ? 1 : 2);
+    f->first = false;
+    if(!f->is_array) {
+	char* k = bson_utf8_escape_for_json(e.key, e.klen);
+	if(k == 0) return false;
+	_buf_byte(&w->tok, '"');
+	_buf_append(&w->tok, k, strlen(k));
+	_buf_append(&w->tok, "\" : ", 4);
+	bson_free(k);
+    }
+
+    if(e.t == BSON_TYPE_DOCUMENT || e.t == BSON_TYPE_ARRAY) {
+	return _jw_push(w, e.v, e.vlen, e.t == BSON_TYPE_ARRAY);
+    }
+    return _jw_scalar(w, e.t, e.v, e.vlen);
+}
+
+/*
+  Append rendered text to out until it holds want bytes or the document
+  is done.  Never ends in the middle of a UTF-8 sequence, even if that
+  leaves out empty, so want should be at least 4 for it to make
+  progress.  False if the BSON is bad or memory ran out.
+*/
+static bool _jw_fill(_jwalk* w, _buf_t* out, sqlite3_int64 want)
+{
+    if(w->err) return false;
+    while(out->len < want) {
+	if(w->off == w->tok.len) {
+	    if(w->done) return true;
+	    if(!_jw_step(w) || w->tok.oom) {
+		w->err = true;
+		return false;
+	    }
+	    continue;
+	}
+	sqlite3_int64 n = w->tok.len - w->off;
+	if(n > want - out->len) n = want - out->len;
+	_buf_append(out, w->tok.data + w->off, n);
+	w->off += n;
+    }
+
+    // Tokens never split a character, so a partial one at the end came
+    // from the current token and can go back to it:
+    if(w->off < w->tok.len && out->len > 0) {
+	sqlite3_int64 k = out->len - 1;
+	while(k > 0 && (out->data[k] & 0xC0) == 0x80) k--;
+	uint8_t lead = out->data[k];
+	int need = (lead >= 0xF0) ? 4 : (lead >= 0xE0) ? 3 : (lead >= 0xC0) ? 2 : 1;
+	sqlite3_int64 have = out->len - k;
+	if(have < need && have <= w->off) {
+	    w->off -= have;
+	    out->len = k;
+	}
+    }
+    return !out->oom;
+}
+
+static bool _jw_more(_jwalk* w)
+{
+    return !w->done || w->off < w->tok.len;
+}
+
+/*
+  bson_to_json(bdata [, max_bytes]):  with max_bytes, at most that much of
+  the JSON followed by BSONEXT_JSON_TRUNCATED if there was more.  The
+  rendering stops there; the rest of the document is never looked at.
+*/
+#define BSONEXT_JSON_TRUNCATED "...(truncated)"
+
+static void bson_to_json_func(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+    assert( argc==1 || argc==2 );
+
+    // If not a BLOB (also picks up if NULL) then don't even try to init:
+    if( sqlite3_value_type(argv[0]) != SQLITE_BLOB) return;
+
+    sqlite3_int64 max_bytes = (argc > 1 && sqlite3_value_type(argv[1]) != SQLITE_NULL) ? sqlite3_value_int64(argv[1]) : -1;
+
+    bson_t b;
+    uint8_t* owned;
+    if(!_init_bson_expanded(context, &b, argv, &owned)) return;
+
+    if(max_bytes < 0) {
+	_set_json(context, &b);
+    } else {
+	_jwalk w;
+	_buf_t out = {0};
+	_jw_init(&w, bson_get_data(&b), b.len);
+	if(!_jw_fill(&w, &out, max_bytes)) {
+	    sqlite3_result_error(context, out.oom || w.tok.oom ? "out of memory" : "invalid BSON", -1);
+	} else {
+	    if(_jw_more(&w)) _buf_append(&out, BSONEXT_JSON_TRUNCATED, strlen(BSONEXT_JSON_TRUNCATED));
+	    if(out.oom) {
+		sqlite3_result_error_nomem(context);
+	    } else {
+		sqlite3_result_text64(context, (const char*)(out.data ? (char*)out.data : ""), out.len,
+				      SQLITE_TRANSIENT, SQLITE_UTF8);
+	    }
+	}
+	sqlite3_free(out.data);
+	_jw_free(&w);
+    }
+    sqlite3_free(owned);
+}
+
+
+/*
+  bson_compact(bdata, dict_id):  replace document keys with varint ids
+  from dictionary dict_id in table bson_keydict (created on demand).
+  Arrays lose their keys altogether.   See _compact_doc.
+*/
+static void bson_compact_func(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+    assert( argc==2 );
+
+    if( sqlite3_value_type(argv[0]) != SQLITE_BLOB) return;
+
+    if( sqlite3_value_type(argv[1]) != SQLITE_INTEGER) {
+	sqlite3_result_error(context, "dict_id must be an integer", -1);
+	return;
+    }
+    sqlite3_int64 dict_id = sqlite3_value_int64(argv[1]);
+
+    sqlite3* db = sqlite3_context_db_handle(context);
+    bsonext_conn* conn = (bsonext_conn*) sqlite3_user_data(context);
+
+    // Once per statement:  bson_keydict may never have been made, or may
+    // have gone with a rollback or DROP since the last statement, and so
+    // may ids we added (a rollback of a savepoint, or of an earlier failed
+    // statement).  Once checked they are good for the rest of the
+    // statement:
+    bool check = sqlite3_get_auxdata(context, 1) == 0;
+    if(check) {
+	int rc = sqlite3_exec(db,
+	    "CREATE TABLE IF NOT EXISTS bson_keydict (dict_id INTEGER NOT NULL, key_id INTEGER NOT NULL, key TEXT NOT NULL, PRIMARY KEY(dict_id, key_id), UNIQUE(dict_id, key));"
+	    "CREATE TRIGGER IF NOT EXISTS bson_keydict_no_update BEFORE UPDATE ON bson_keydict"
+	    "  BEGIN SELECT RAISE(ABORT, 'bson_keydict is append-only'); END;"
+	    "CREATE TRIGGER IF NOT EXISTS bson_keydict_no_delete BEFORE DELETE ON bson_keydict"
+	    "  BEGIN SELECT RAISE(ABORT, 'bson_keydict is append-only'); END;",
+	    0, 0, 0);
+	if(rc != SQLITE_OK) {
+	    sqlite3_result_error(context, "cannot create bson_keydict", -1);
+	    return;
+	}
+    }
+
+    // Already compact?  Go back to regular BSON first; this also lets
+    // a blob be moved from one dictionary to another.
+    bson_t b;
+    uint8_t* owned;
+    if(!_init_bson_expanded(context, &b, argv, &owned)) return;
+
+    int rc;
+    keydict* d = _keydict_get(db, conn, dict_id, &rc);
+    if(rc == SQLITE_OK && check) {
+	rc = _keydict_sync(db, d);
+	if(rc == SQLITE_OK) sqlite3_set_auxdata(context, 1, conn, 0);
+    }
+    if(rc != SQLITE_OK) {
+	sqlite3_free(owned);
+	sqlite3_result_error(context, "cannot read bson_keydict", -1);
+	return;
+    }
+
+    _buf_t out = {0};
+    _buf_append(&out, BSONEXT_COMPACT_MAGIC, 4);
+    _buf_varint(&out, (uint64_t)dict_id);
+
+    const char* err = _compact_doc(db, d, bson_get_data(&b), b.len, false, &out);
+    sqlite3_free(owned);
+
+    if(err != 0) {
+	sqlite3_free(out.data);
+	sqlite3_result_error(context, err, -1);
+    } else {
+	sqlite3_result_blob(context, out.data, out.len, sqlite3_free);
+    }
+}
+
+/*
+  bson_expand(bdata):  compact -> regular BSON.  Regular BSON is returned
+  as-is.
+*/
+static void bson_expand_func(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+    assert( argc==1 );
+
+    if( sqlite3_value_type(argv[0]) != SQLITE_BLOB) return;
+
+    bson_t b;
+    uint8_t* owned;
+    if(_init_bson_expanded(context, &b, argv, &owned)) {
+	if(owned != 0) {
+	    sqlite3_result_blob(context, owned, b.len, sqlite3_free);
+	} else {
+	    sqlite3_result_value(context, argv[0]);
+	}
+    }
+}
+
+
+static void bson_from_json_func(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+    assert( argc==1 );
+
+    // sqlite already knows the length; no strlen:
+    const char* jsons = (const char*) sqlite3_value_text(argv[0]);
+    if(jsons == 0) return;
+    int slen = sqlite3_value_bytes(argv[0]);
+
+    // Parse into a bson_t on the stack, then take its buffer away from it
+    // and give that to sqlite as is.  bson_free is the matching free.
+    // Small documents live inside the bson_t itself and are copied out
+    // by the steal; anything past ~120 bytes is handed over without a copy.
+    bson_error_t err; // on stack
+    bson_t b;
+    if(bson_init_from_json(&b, jsons, slen, &err)) {
+	uint32_t len;
+	uint8_t* data = bson_destroy_with_steal(&b, true, &len);
+	if(data == 0) {
+	    sqlite3_result_error_nomem(context);
+	} else {
+	    sqlite3_result_blob(context, data, len, bson_free);
+	}
+    } else {
+	sqlite3_result_error(context, "cannot parse EJSON", -1);	
+    }
+}
+
+
+/*
+  Key signatures:  a Bloom filter over every dotpath in a document
+  (intermediate ones too, so both "hdr" and "hdr.id"), intended for a
+  generated column:
+
+    alter table T add column bsig BLOB
+      as (bson_key_signature(bdata)) stored;
+    select ... where bson_sig_may_contain(bsig, 'optional.flag')
+      and bson_get(bdata, 'optional.flag') is not null;
+
+  False positives are possible, false negatives are not.  An all-digit
+  segment, array offset or not, goes in as "#" on both sides, so a 1000
+  element array adds one path and not 1000; "a.3.x" is tested as "a.#.x".
+  The filter starts at BSONEXT_SIG_BYTES and doubles until there are
+  BSONEXT_SIG_BITS_PER_PATH bits for each distinct path, so wide documents
+  don't saturate it.  Each path sets BSONEXT_SIG_PROBES bits derived from
+  one XXH64 by double hashing.
+*/
+#define BSONEXT_SIG_BYTES          64      // 512 bits, the smallest
+#define BSONEXT_SIG_MAX_BYTES      65536
+#define BSONEXT_SIG_BITS_PER_PATH  10      // ~1% false positives with 4 probes
+#define BSONEXT_SIG_PROBES         4
+
+static bool _sig_is_index(const char* seg, int len)
+{
+    if(len == 0) return false;
+    for(int i = 0; i < len; i++) {
+	if(seg[i] < '0' || seg[i] > '9') return false;
+    }
+    return true;
+}
+
+static void _sig_push_seg(_buf_t* path, const char* seg, int len)
+{
+    if(path->len > 0) _buf_byte(path, '.');
+    if(_sig_is_index(seg, len)) {
+	_buf_byte(path, '#');
+    } else {
+	_buf_append(path, seg, len);
+    }
+}
+
+static void _sig_add(uint8_t* sig, uint32_t nbits, uint64_t h)
+{
+    uint32_t h1 = (uint32_t)h;
+    uint32_t h2 = (uint32_t)(h >> 32) | 1;
+    for(int i = 0; i < BSONEXT_SIG_PROBES; i++) {
+	uint32_t bit = (h1 + i * h2) & (nbits - 1);
+	sig[bit >> 3] |= (uint8_t)(1 << (bit & 7));
+    }
+}
+
+static bool _sig_test(const uint8_t* sig, uint32_t nbits, uint64_t h)
+{
+    uint32_t h1 = (uint32_t)h;
+    uint32_t h2 = (uint32_t)(h >> 32) | 1;
+    for(int i = 0; i < BSONEXT_SIG_PROBES; i++) {
+	uint32_t bit = (h1 + i * h2) & (nbits - 1);
+	if((sig[bit >> 3] & (1 << (bit & 7))) == 0) return false;
+    }
+    return true;
+}
+
+// Hash of every (normalized) path onto hashes, duplicates and all:
+static void _sig_walk(bson_iter_t* iter, _buf_t* path, _buf_t* hashes)
+{
+    while(bson_iter_next(iter)) {
+	sqlite3_int64 mark = path->len;
+	_sig_push_seg(path, bson_iter_key(iter), bson_iter_key_len(iter));
+	if(path->oom) return;
+
+	uint64_t h = _xxh64(path->data, path->len, 0);
+	_buf_append(hashes, &h, sizeof(h));
+
+	bson_type_t ft = bson_iter_type(iter);
+	if(ft == BSON_TYPE_DOCUMENT || ft == BSON_TYPE_ARRAY) {
+	    bson_iter_t child;
+	    if(bson_iter_recurse(iter, &child)) {
+		_sig_walk(&child, path, hashes);
+	    }
+	}
+	path->len = mark;
+    }
+}
+
+static int _cmp_u64(const void* x, const void* y)
+{
+    uint64_t a = *(const uint64_t*)x, b = *(const uint64_t*)y;
+    return (a > b) - (a < b);
+}
+
+static bool _sig_size_ok(int n)
+{
+    // A power of 2 from BSONEXT_SIG_BYTES up:
+    return n >= BSONEXT_SIG_BYTES && n <= BSONEXT_SIG_MAX_BYTES && (n & (n - 1)) == 0;
+}
+
+static void bson_key_signature_func(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+    assert( argc==1 );
+
+    if( sqlite3_value_type(argv[0]) != SQLITE_BLOB) return;
+
+    bson_t b;
+    uint8_t* owned;
+    if(!_init_bson_expanded(context, &b, argv, &owned)) return;
+
+    _buf_t path = {0};
+    _buf_t hashes = {0};
+    bson_iter_t iter;
+    if(bson_iter_init(&iter, &b)) {
+	_sig_walk(&iter, &path, &hashes);
+    }
+
+    uint8_t* sig = 0;
+    sqlite3_int64 nbytes = BSONEXT_SIG_BYTES;
+    if(!path.oom && !hashes.oom) {
+	// Size for the distinct paths:
+	uint64_t* h = (uint64_t*)hashes.data;
+	sqlite3_int64 n = hashes.len / sizeof(uint64_t), nd = 0;
+	if(n > 0) qsort(h, n, sizeof(uint64_t), _cmp_u64);
+	for(sqlite3_int64 i = 0; i < n; i++) {
+	    if(i == 0 || h[i] != h[nd - 1]) h[nd++] = h[i];
+	}
+	while(nbytes * 8 < nd * BSONEXT_SIG_BITS_PER_PATH && nbytes < BSONEXT_SIG_MAX_BYTES) nbytes *= 2;
+
+	sig = sqlite3_malloc64(nbytes);
+	if(sig != 0) {
+	    memset(sig, 0, nbytes);
+	    for(sqlite3_int64 i = 0; i < nd; i++) _sig_add(sig, (uint32_t)(nbytes * 8), h[i]);
+	}
+    }
+
+    if(sig == 0) {
+	sqlite3_result_error_nomem(context);
+    } else {
+	sqlite3_result_blob(context, sig, nbytes, sqlite3_free);
+    }
+    sqlite3_free(hashes.data);
+    sqlite3_free(path.data);
+    sqlite3_free(owned);
+}
+
+static void bson_sig_may_contain_func(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+    assert( argc==2 );
+
+    if( sqlite3_value_type(argv[0]) != SQLITE_BLOB) return;
+
+    const uint8_t* sig = sqlite3_value_blob(argv[0]);
+    int nbytes = sqlite3_value_bytes(argv[0]);
+    if(!_sig_size_ok(nbytes)) {
+	sqlite3_result_error(context, "not a bson_key_signature", -1);
+	return;
+    }
+
+    const char* dotpath = (const char*) sqlite3_value_text(argv[1]);
+    if(dotpath == 0) return;
+
+    // The whole document is always "there":
+    if(*dotpath == '\0') {
+	sqlite3_result_int(context, 1);
+	return;
+    }
+
+    _buf_t path = {0};
+    for(const char* seg = dotpath; seg != 0; ) {
+	const char* dot = strchr(seg, '.');
+	_sig_push_seg(&path, seg, dot ? dot - seg : (int)strlen(seg));
+	seg = dot ? dot + 1 : 0;
+    }
+    if(path.oom) {
+	sqlite3_result_error_nomem(context);
+    } else {
+	sqlite3_result_int(context, _sig_test(sig, (uint32_t)nbytes * 8, _xxh64(path.data, path.len, 0)) ? 1 : 0);
+    }
+    sqlite3_free(path.data);
+}
+
+
+/*
+  bson_hash(bdata [, dotpath [, unordered]]):  stable 64-bit XXH64 of a
+  subtree, returned as a (signed) sqlite integer so it can be indexed.
+
+  By default this is the hash of the canonical bytes: the value bytes as
+  they sit in the BSON, seeded with the BSON type so e.g. int32 7 and a
+  4 byte string don't collide trivially.  With unordered = 1, documents at
+  every level are hashed as a commutative sum of their (key, value) hashes
+  so { a:1, b:2 } and { b:2, a:1 } hash the same.  Arrays stay ordered.
+*/
+static uint64_t _hash_unordered(uint8_t t, const uint8_t* p, uint32_t len)
+{
+    if(t != BSON_TYPE_DOCUMENT && t != BSON_TYPE_ARRAY) {
+	return _xxh64(p, len, t);
+    }
+
+    const uint8_t* end = p + len - 1;
+    const uint8_t* q = p + 4;
+    uint64_t sum = 0;
+    uint64_t chain = 0;
+    uint64_t count = 0;
+
+    while(q < end) {
+	uint8_t et = *q++;
+	const uint8_t* key = q;
+	const uint8_t* nul = memchr(q, 0, end - q);
+	if(nul == 0) break;
+	q = nul + 1;
+
+	int64_t n = _bson_value_len(et, q, end);
+	if(n < 0) break;
+
+	uint64_t vh = _hash_unordered(et, q, (uint32_t)n);
+	if(t == BSON_TYPE_DOCUMENT) {
+	    sum += _xxh64(key, nul - key, vh);
+	} else {
+	    chain = _xxh64(&vh, sizeof(vh), chain);
+	}
+	count++;
+	q += n;
+    }
+
+    uint64_t fin[2] = { t == BSON_TYPE_DOCUMENT ? sum : chain, count };
+    return _xxh64(fin, sizeof(fin), t);
+}
+
+static void bson_hash_func(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+    assert( argc>=1 && argc<=3 );
+
+    if( sqlite3_value_type(argv[0]) != SQLITE_BLOB) return;
+
+    const char* dotpath = "";
+    if(argc > 1) {
+	dotpath = (const char*) sqlite3_value_text(argv[1]);
+	if(dotpath == 0) return;
+    }
+    bool unordered = (argc > 2 && sqlite3_value_int(argv[2]) != 0);
+
+    bson_t b;
+    uint8_t* owned;
+    if(!_init_bson_expanded(context, &b, argv, &owned)) return;
+
+    uint8_t t;
+    const uint8_t* vp;
+    uint32_t vlen;
+    if(_bson_find_raw(bson_get_data(&b), b.len, dotpath, &t, &vp, &vlen)) {
+	uint64_t h = unordered ? _hash_unordered(t, vp, vlen) : _xxh64(vp, vlen, t);
+	sqlite3_result_int64(context, (sqlite3_int64)h);
+    }
+
+    sqlite3_free(owned);
+}
+
+/*
+  MongoDB's total ordering of BSON values, computed directly on the bytes.
+  Types compare by canonical rank first; all numeric types share a rank and
+  compare by value, as do string and symbol.  Documents compare element by
+  element on (type rank, field name, value) and a shorter document that is
+  a prefix of a longer one is less.  Arrays are the same without the names.
+
+  decimal128 is compared via its double value; exact for everyday money
+  amounts, approximate past 15-16 significant digits.
+*/
+static int _type_rank(uint8_t t)
+{
+    switch(t) {
+    case BSON_TYPE_MINKEY:      return 1;
+    case BSON_TYPE_UNDEFINED:
+    case BSON_TYPE_NULL:        return 2;
+    case BSON_TYPE_DOUBLE:
+    case BSON_TYPE_INT32:
+    case BSON_TYPE_INT64:
+    case BSON_TYPE_DECIMAL128:  return 3;
+    case BSON_TYPE_SYMBOL:
+    case BSON_TYPE_UTF8:        return 4;
+    case BSON_TYPE_DOCUMENT:    return 5;
+    case BSON_TYPE_ARRAY:       return 6;
+    case BSON_TYPE_BINARY:      return 7;
+    case BSON_TYPE_OID:         return 8;
+    case BSON_TYPE_BOOL:        return 9;
+    case BSON_TYPE_DATE_TIME:   return 10;
+    case BSON_TYPE_TIMESTAMP:   return 11;
+    case BSON_TYPE_REGEX:       return 12;
+    case BSON_TYPE_DBPOINTER:   return 13;
+    case BSON_TYPE_CODE:        return 14;
+    case BSON_TYPE_CODEWSCOPE:  return 15;
+    case BSON_TYPE_MAXKEY:      return 16;
+    default:                    return 17;  // unknown; after everything
+    }
+}
+
+#define _CMP(a,b) ((a) < (b) ? -1 : ((a) > (b) ? 1 : 0))
+
+// Number as either an exact int64 or a double:
+typedef struct {
+    bool is_int;
+    int64_t i;
+    double d;
+} _bson_num;
+
+static _bson_num _get_num(uint8_t t, const uint8_t* p)
+{
+    _bson_num n = { false, 0, 0.0 };
+    switch(t) {
+    case BSON_TYPE_INT32:
+	n.is_int = true;
+	n.i = (int32_t)_rd_int32(p);
+	break;
+    case BSON_TYPE_INT64:
+	n.is_int = true;
+	n.i = (int64_t)_rd_u64(p);
+	break;
+    case BSON_TYPE_DOUBLE: {
+	uint64_t bits = _rd_u64(p);
+	memcpy(&n.d, &bits, sizeof(double));
+	break;
+    }
+    case BSON_TYPE_DECIMAL128: {
+	bson_decimal128_t dec;
+	dec.low = _rd_u64(p);
+	dec.high = _rd_u64(p + 8);
+	char buf[BSON_DECIMAL128_STRING];
+	bson_decimal128_to_string(&dec, buf);
+	n.d = strtod(buf, 0);  // "NaN", "Infinity" and "-Infinity" all parse
+	break;
+    }
+    }
+    return n;
+}
+
+// int64 vs double without losing precision on either side:
+static int _cmp_int_double(int64_t i, double d)
+{
+    if(d != d) return 1;                      // NaN sorts below all numbers
+    if(d >= 9223372036854775808.0) return -1;
+    if(d < -9223372036854775808.0) return 1;
+
+    // floor(d) without libm:  the cast truncates toward zero
+    int64_t di = (int64_t)d;
+    double frac = d - (double)di;
+    if(frac < 0) {
+	di -= 1;
+	frac += 1.0;
+    }
+    if(i != di) return _CMP(i, di);
+    return (frac > 0) ? -1 : 0;               // i == floor(d); any fraction makes d bigger
+}
+
+static int _cmp_num(uint8_t ta, const uint8_t* pa, uint8_t tb, const uint8_t* pb)
+{
+    _bson_num a = _get_num(ta, pa);
+    _bson_num b = _get_num(tb, pb);
+
+    if(a.is_int && b.is_int) return _CMP(a.i, b.i);
+    if(a.is_int) return _cmp_int_double(a.i, b.d);
+    if(b.is_int) return -_cmp_int_double(b.i, a.d);
+
+    bool na = (a.d != a.d), nb = (b.d != b.d);
+    if(na || nb) return _CMP(nb, na);        // NaN is the smallest number
+    return _CMP(a.d, b.d);
+}
+
+// memcmp then length, i.e. binary string order:
+static int _cmp_bytes(const uint8_t* a, uint32_t la, const uint8_t* b, uint32_t lb)
+{
+    int c = memcmp(a, b, la < lb ? la : lb);
+    if(c != 0) return c < 0 ? -1 : 1;
+    return _CMP(la, lb);
+}
+
+static int _bson_cmp_doc(const uint8_t* a, uint32_t la, const uint8_t* b, uint32_t lb, bool is_array);
+
+/*
+  la and lb must come from _bson_value_len, which guarantees the minimum
+  length of each type; the subtractions below rely on it.
+*/
+static int _bson_cmp_value(
+    uint8_t ta, const uint8_t* pa, uint32_t la,
+    uint8_t tb, const uint8_t* pb, uint32_t lb)
+{
+    int c = _CMP(_type_rank(ta), _type_rank(tb));
+    if(c != 0) return c;
+
+    switch(ta) {
+    case BSON_TYPE_MINKEY:
+    case BSON_TYPE_MAXKEY:
+    case BSON_TYPE_NULL:
+    case BSON_TYPE_UNDEFINED:
+	return 0;
+
+    case BSON_TYPE_DOUBLE:
+    case BSON_TYPE_INT32:
+    case BSON_TYPE_INT64:
+    case BSON_TYPE_DECIMAL128:
+	return _cmp_num(ta, pa, tb, pb);
+
+    case BSON_TYPE_UTF8:
+    case BSON_TYPE_SYMBOL:
+    case BSON_TYPE_CODE:
+	// int32 length (incl. NUL) then the bytes:
+	return _cmp_bytes(pa + 4, la - 5, pb + 4, lb - 5);
+
+    case BSON_TYPE_DOCUMENT:
+    case BSON_TYPE_ARRAY:
+	return _bson_cmp_doc(pa, la, pb, lb, ta == BSON_TYPE_ARRAY);
+
+    case BSON_TYPE_BINARY:
+	// Length first, then subtype, then bytes:
+	c = _CMP(la, lb);
+	if(c == 0) c = _CMP(pa[4], pb[4]);
+	if(c == 0) c = _cmp_bytes(pa + 5, la - 5, pb + 5, lb - 5);
+	return c;
+
+    case BSON_TYPE_OID:
+	return _cmp_bytes(pa, 12, pb, 12);
+
+    case BSON_TYPE_BOOL:
+	return _CMP(pa[0] != 0, pb[0] != 0);
+
+    case BSON_TYPE_DATE_TIME:
+	return _CMP((int64_t)_rd_u64(pa), (int64_t)_rd_u64(pb));
+
+    case BSON_TYPE_TIMESTAMP:
+	// uint64 with the seconds in the high half, so plain unsigned compare:
+	return _CMP(_rd_u64(pa), _rd_u64(pb));
+
+    case BSON_TYPE_REGEX: {
+	// pattern, then options
+	size_t pla = strlen((const char*)pa), plb = strlen((const char*)pb);
+	c = _cmp_bytes(pa, pla, pb, plb);
+	if(c == 0) c = strcmp((const char*)pa + pla + 1, (const char*)pb + plb + 1);
+	return _CMP(c, 0);
+    }
+
+    case BSON_TYPE_DBPOINTER:
+	// namespace string, then the oid
+	c = _cmp_bytes(pa + 4, la - 4 - 12 - 1, pb + 4, lb - 4 - 12 - 1);
+	if(c == 0) c = _cmp_bytes(pa + la - 12, 12, pb + lb - 12, 12);
+	return c;
+
+    case BSON_TYPE_CODEWSCOPE: {
+	// int32 total, code string, scope document
+	uint64_t ca = _rd_int32(pa + 4), cb = _rd_int32(pb + 4);
+	if(ca < 1 || 8 + ca + 5 > la || cb < 1 || 8 + cb + 5 > lb) return _cmp_bytes(pa, la, pb, lb);
+	c = _cmp_bytes(pa + 8, ca, pb + 8, cb);
+	if(c == 0) c = _bson_cmp_doc(pa + 8 + ca, la - 8 - ca, pb + 8 + cb, lb - 8 - cb, false);
+	return c;
+    }
+
+    default:
+	return _cmp_bytes(pa, la, pb, lb);
+    }
+}
+
+static int _bson_cmp_doc(const uint8_t* a, uint32_t la, const uint8_t* b, uint32_t lb, bool is_array)
+{
+    const uint8_t* ea = a + la - 1;
+    const uint8_t* eb = b + lb - 1;
+    a += 4;
+    b += 4;
+
+    for(;;) {
+	bool more_a = a < ea, more_b = b < eb;
+	if(!more_a || !more_b) return _CMP(more_a, more_b);
+
+	uint8_t ta = *a++, tb = *b++;
+	const uint8_t* ka = a;
+	const uint8_t* kb = b;
+	const uint8_t* na = memchr(a, 0, ea - a);
+	const uint8_t* nb = memchr(b, 0, eb - b);
+	if(na == 0 || nb == 0) return _CMP(na != 0, nb != 0);
+	a = na + 1;
+	b = nb + 1;
+
+	int64_t va = _bson_value_len(ta, a, ea);
+	int64_t vb = _bson_value_len(tb, b, eb);
+	if(va < 0 || vb < 0) return _CMP(va >= 0, vb >= 0);
+
+	int c = _CMP(_type_rank(ta), _type_rank(tb));
+	if(c == 0 && !is_array) c = _cmp_bytes(ka, na - ka, kb, nb - kb);
+	if(c == 0) c = _bson_cmp_value(ta, a, (uint32_t)va, tb, b, (uint32_t)vb);
+	if(c != 0) return c;
+
+	a += va;
+	b += vb;
+    }
+}
+
+static bool _looks_like_bson(const void* p, int n)
+{
+    return n >= 5 && _rd_int32(p) == (uint32_t)n && ((const uint8_t*)p)[n-1] == 0;
+}
+
+/*
+  The BSON collation.   sqlite only applies collations to TEXT so the
+  blob has to be cast; the bytes are passed through untouched:
+
+    select ... order by cast(bson_get_bson(bdata,'hdr') as text) collate BSON;
+
+  Anything that is not a regular BSON document (including compact blobs)
+  sorts after all documents, in byte order.
+*/
+static int bson_collation_cmp(void* arg, int n1, const void* p1, int n2, const void* p2)
+{
+    (void)arg;
+    bool v1 = _looks_like_bson(p1, n1);
+    bool v2 = _looks_like_bson(p2, n2);
+
+    if(v1 && v2) return _bson_cmp_doc(p1, n1, p2, n2, false);
+    if(v1 != v2) return v1 ? -1 : 1;
+    return _cmp_bytes(p1, n1, p2, n2);
+}
+
+static void bson_compare_func(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+    assert( argc==2 );
+
+    if( sqlite3_value_type(argv[0]) != SQLITE_BLOB) return;
+    if( sqlite3_value_type(argv[1]) != SQLITE_BLOB) return;
+
+    bson_t a, b;
+    uint8_t* owned_a;
+    uint8_t* owned_b;
+    if(!_init_bson_expanded(context, &a, argv, &owned_a)) return;
+    if(!_init_bson_expanded(context, &b, argv + 1, &owned_b)) {
+	sqlite3_free(owned_a);
+	return;
+    }
+
+    sqlite3_result_int(context, _bson_cmp_doc(bson_get_data(&a), a.len, bson_get_data(&b), b.len, false));
+
+    sqlite3_free(owned_a);
+    sqlite3_free(owned_b);
+}
+
+
+
+/*
+  bson_diff(old, new) and bson_patch(doc, delta).
+
+  A delta is itself BSON with up to three sections keyed by dotpath:
+
+    { "$set":    { "hdr.ts": <new value>, "tags.2": "x", ... },
+      "$unset":  { "hdr.tmp": true, ... },
+      "$splice": { "payments": [ start, deleteCount, [ new items ] ], ... },
+      "$before": { "hdr.ver": "ts", "tmp": null, ... } }
+
+  bson_diff recurses into documents that exist on both sides.  Arrays of
+  equal length are diffed element by element (recursing into documents);
+  otherwise the common head and tail are trimmed and the middle becomes
+  one $splice.  Element paths inside an array always refer to the
+  offsets *before* any $splice on that array.
+
+  $before places a document field, new or existing, just ahead of the
+  named sibling (null: at the end).  bson_diff keeps the longest run of
+  fields whose order didn't change where they are and gives every other
+  field that is new or moved a $before, unless they are all new fields at
+  the end, which bson_patch appends anyway.
+
+  bson_patch rebuilds the document in a single pass, copying untouched
+  elements byte for byte.  $set on a path whose parents don't exist
+  creates them as documents.  Field names containing '.' can't be
+  addressed, same as with dotpaths everywhere else.
+*/
+typedef struct {
+    _buf_t set;
+    _buf_t unset;
+    _buf_t splice;
+    _buf_t before;
+    _buf_t path;
+} _delta_t;
+
+static const char* _diff_doc(const uint8_t* a, uint32_t la, const uint8_t* b, uint32_t lb, _delta_t* d);
+
+// Append "<current path>.<key>" or "<key>" to d->path; returns the mark to restore:
+static sqlite3_int64 _path_push(_buf_t* path, const char* key, int klen)
+{
+    sqlite3_int64 mark = path->len;
+    if(mark > 0) _buf_byte(path, '.');
+    _buf_append(path, key, klen);
+    return mark;
+}
+
+static bool _same_value(const _belem* x, const _belem* y)
+{
+    return x->t == y->t && x->vlen == y->vlen && memcmp(x->v, y->v, x->vlen) == 0;
+}
+
+// Both sides exist at the current path; record what it takes to turn x into y:
+static const char* _diff_value(const _belem* x, const _belem* y, _delta_t* d);
+
+static int _array_elems(const uint8_t* p, uint32_t len, _belem** out)
+{
+    const uint8_t* end = p + len - 1;
+    int n = 0, cap = 0;
+    bool err;
+    _belem e;
+    *out = 0;
+    for(const uint8_t* q = p + 4; (q = _next_elem(q, end, &e, &err)) != 0; ) {
+	if(n == cap) {
+	    cap = cap ? cap * 2 : 16;
+	    _belem* nv = sqlite3_realloc64(*out, cap * sizeof(_belem));
+	    if(nv == 0) {
+		sqlite3_free(*out);
+		*out = 0;
+		return -1;
+	    }
+	    *out = nv;
+	}
+	(*out)[n++] = e;
+    }
+    if(err) {
+	sqlite3_free(*out);
+	*out = 0;
+	return -1;
+    }
+    return n;
+}
+
+static const char* _diff_array(const _belem* x, const _belem* y, _delta_t* d)
+{
+    _belem* ea;
+    _belem* eb;
+    int na = _array_elems(x->v, x->vlen, &ea);
+    int nb = _array_elems(y->v, y->vlen, &eb);
+    const char* err = 0;
+
+    if(na < 0 || nb < 0) {
+	err = "invalid BSON";
+
+    } else if(na == nb) {
+	for(int i = 0; i < na && err == 0; i++) {
+	    if(_same_value(&ea[i], &eb[i])) continue;
+	    char ibuf[16];
+	    sqlite3_int64 mark = _path_push(&d->path, ibuf, sprintf(ibuf, "%d", i));
+	    err = _diff_value(&ea[i], &eb[i], d);
+	    d->path.len = mark;
+	}
+
+    } else {
+	int head = 0, tail = 0;
+	while(head < na && head < nb && _same_value(&ea[head], &eb[head])) head++;
+	while(tail < na - head && tail < nb - head && _same_value(&ea[na-1-tail], &eb[nb-1-tail])) tail++;
+
+	// [ start, deleteCount, [ items ] ]
+	_buf_t* s = &d->splice;
+	_buf_byte(s, BSON_TYPE_ARRAY);
+	_buf_append(s, d->path.data, d->path.len);
+	_buf_byte(s, 0);
+	sqlite3_int64 hdr = s->len;
+	_buf_int32(s, 0);
+
+	_buf_byte(s, BSON_TYPE_INT32);
+	_buf_append(s, "0", 2);
+	_buf_int32(s, head);
+	_buf_byte(s, BSON_TYPE_INT32);
+	_buf_append(s, "1", 2);
+	_buf_int32(s, na - head - tail);
+
+	_buf_byte(s, BSON_TYPE_ARRAY);
+	_buf_append(s, "2", 2);
+	sqlite3_int64 items = s->len;
+	_buf_int32(s, 0);
+	for(int i = head; i < nb - tail; i++) {
+	    char ibuf[16];
+	    _buf_elem(s, eb[i].t, ibuf, sprintf(ibuf, "%d", i - head), eb[i].v, eb[i].vlen);
+	}
+	_buf_byte(s, 0);
+	_buf_patch_len(s, items);
+
+	_buf_byte(s, 0);
+	_buf_patch_len(s, hdr);
+    }
+
+    sqlite3_free(ea);
+    sqlite3_free(eb);
+    return err;
+}
+
+static const char* _diff_value(const _belem* x, const _belem* y, _delta_t* d)
+{
+    if(x->t == BSON_TYPE_DOCUMENT && y->t == BSON_TYPE_DOCUMENT) {
+	return _diff_doc(x->v, x->vlen, y->v, y->vlen, d);
+    }
+    if(x->t == BSON_TYPE_ARRAY && y->t == BSON_TYPE_ARRAY) {
+	return _diff_array(x, y, d);
+    }
+    _buf_elem(&d->set, y->t, (const char*)d->path.data, d->path.len, y->v, y->vlen);
+    return 0;
+}
+
+/*
+  Find key in the document at doc.  *hint is where the search starts and
+  is left just past the match, so walking two documents with the same
+  field order costs one comparison per field.
+*/
+static bool _find_hinted(const uint8_t* doc, uint32_t len, const uint8_t** hint, const char* key, int klen, _belem* found)
+{
+    const uint8_t* end = doc + len - 1;
+    bool err;
+    _belem e;
+
+    for(int pass = 0; pass < 2; pass++) {
+	const uint8_t* q = (pass == 0) ? *hint : doc + 4;
+	const uint8_t* stop = (pass == 0) ? end : *hint;
+	while(q < stop) {
+	    const uint8_t* next = _next_elem(q, end, &e, &err);
+	    if(next == 0) return false;
+	    if(e.klen == klen && memcmp(e.key, key, klen) == 0) {
+		*found = e;
+		*hint = next;
+		return true;
+	    }
+	    q = next;
+	}
+    }
+    return false;
+}
+
+static const char* _diff_doc(const uint8_t* a, uint32_t la, const uint8_t* b, uint32_t lb, _delta_t* d)
+{
+    const uint8_t* ea = a + la - 1;
+    const uint8_t* hint;
+    const uint8_t* q;
+    bool err;
+    _belem x, y;
+
+    // b's fields, and for each where it was in a (-1: new):
+    _belem* fb;
+    int nb = _array_elems(b, lb, &fb);
+    if(nb < 0) return "invalid BSON";
+    int* pos = sqlite3_malloc64((nb > 0 ? nb : 1) * 3 * sizeof(int));
+    if(pos == 0) {
+	sqlite3_free(fb);
+	return "out of memory";
+    }
+    int* tails = pos + nb;   // longest increasing run of pos, by length
+    int* prev = tails + nb;  // back links through that run
+
+    // Fields that are new or changed:
+    const char* derr = 0;
+    int nlis = 0;
+    hint = a + 4;
+    for(int i = 0; i < nb && derr == 0; i++) {
+	sqlite3_int64 mark = _path_push(&d->path, fb[i].key, fb[i].klen);
+	pos[i] = -1;
+	if(!_find_hinted(a, la, &hint, fb[i].key, fb[i].klen, &x)) {
+	    _buf_elem(&d->set, fb[i].t, (const char*)d->path.data, d->path.len, fb[i].v, fb[i].vlen);
+	} else {
+	    pos[i] = (const uint8_t*)x.key - a;
+	    if(!_same_value(&x, &fb[i])) derr = _diff_value(&x, &fb[i], d);
+
+	    // Patience-style LIS so the fields that stay put are the most:
+	    int lo = 0, hi = nlis;
+	    while(lo < hi) {
+		int mid = (lo + hi) / 2;
+		if(pos[tails[mid]] < pos[i]) lo = mid + 1;
+		else hi = mid;
+	    }
+	    prev[i] = lo > 0 ? tails[lo - 1] : -1;
+	    tails[lo] = i;
+	    if(lo == nlis) nlis++;
+	}
+	d->path.len = mark;
+    }
+
+    if(derr == 0) {
+	// Mark the fields that stay put (pos >= 0 and in the run) with -2:
+	for(int i = nlis > 0 ? tails[nlis - 1] : -1; i >= 0; i = prev[i]) pos[i] = -2;
+
+	// Everything else gets a $before the next field that stays put.
+	// Past the last one, only a move needs it (and then so does every
+	// field there, to keep their order); new fields go there anyway:
+	int anchor = -1;
+	bool moved = false;
+	for(int i = nb - 1; i >= 0; i--) {
+	    tails[i] = anchor;
+	    if(pos[i] == -2) anchor = i;
+	    else if(anchor < 0 && pos[i] >= 0) moved = true;
+	}
+	for(int i = 0; i < nb; i++) {
+	    if(pos[i] == -2 || (tails[i] < 0 && !moved)) continue;
+
+	    const _belem* at = tails[i] >= 0 ? &fb[tails[i]] : 0;
+	    sqlite3_int64 mark = _path_push(&d->path, fb[i].key, fb[i].klen);
+	    _buf_byte(&d->before, at ? BSON_TYPE_UTF8 : BSON_TYPE_NULL);
+	    _buf_append(&d->before, d->path.data, d->path.len);
+	    _buf_byte(&d->before, 0);
+	    if(at) {
+		_buf_int32(&d->before, at->klen + 1);
+		_buf_append(&d->before, at->key, at->klen);
+		_buf_byte(&d->before, 0);
+	    }
+	    d->path.len = mark;
+	}
+    }
+    sqlite3_free(pos);
+    sqlite3_free(fb);
+    if(derr != 0) return derr;
+
+    // Fields that went away:
+    hint = b + 4;
+    for(q = a + 4; (q = _next_elem(q, ea, &x, &err)) != 0; ) {
+	if(!_find_hinted(b, lb, &hint, x.key, x.klen, &y)) {
+	    sqlite3_int64 mark = _path_push(&d->path, x.key, x.klen);
+	    static const uint8_t yes = 1;
+	    _buf_elem(&d->unset, BSON_TYPE_BOOL, (const char*)d->path.data, d->path.len, &yes, 1);
+	    d->path.len = mark;
+	}
+    }
+    if(err) return "invalid BSON";
+
+    return 0;
+}
+
+static void bson_diff_func(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+    assert( argc==2 );
+
+    if( sqlite3_value_type(argv[0]) != SQLITE_BLOB) return;
+    if( sqlite3_value_type(argv[1]) != SQLITE_BLOB) return;
+
+    bson_t a, b;
+    uint8_t* owned_a;
+    uint8_t* owned_b;
+    if(!_init_bson_expanded(context, &a, argv, &owned_a)) return;
+    if(!_init_bson_expanded(context, &b, argv + 1, &owned_b)) {
+	sqlite3_free(owned_a);
+	return;
+    }
+
+    _delta_t d;
+    memset(&d, 0, sizeof(d));
+    _buf_int32(&d.set, 0);
+    _buf_int32(&d.unset, 0);
+    _buf_int32(&d.splice, 0);
+    _buf_int32(&d.before, 0);
+
+    const char* err = _diff_doc(bson_get_data(&a), a.len, bson_get_data(&b), b.len, &d);
+
+    _buf_t out = {0};
+    if(err == 0) {
+	struct { const char* name; _buf_t* sect; } sects[] = {
+	    { "$set", &d.set }, { "$unset", &d.unset }, { "$splice", &d.splice }, { "$before", &d.before }
+	};
+	_buf_int32(&out, 0);
+	for(int n = 0; n < 4; n++) {
+	    _buf_t* sect = sects[n].sect;
+	    if(sect->len == 4) continue;  // nothing in it
+	    _buf_byte(sect, 0);
+	    _buf_patch_len(sect, 0);
+	    _buf_elem(&out, BSON_TYPE_DOCUMENT, sects[n].name, strlen(sects[n].name), sect->data, sect->len);
+	}
+	_buf_byte(&out, 0);
+	_buf_patch_len(&out, 0);
+
+	if(out.oom || d.set.oom || d.unset.oom || d.splice.oom || d.before.oom || d.path.oom) err = "out of memory";
+    }
+
+    if(err != 0) {
+	sqlite3_free(out.data);
+	sqlite3_result_error(context, err, -1);
+    } else {
+	sqlite3_result_blob(context, out.data, out.len, sqlite3_free);
+    }
+
+    sqlite3_free(d.set.data);
+    sqlite3_free(d.unset.data);
+    sqlite3_free(d.splice.data);
+    sqlite3_free(d.before.data);
+    sqlite3_free(d.path.data);
+    sqlite3_free(owned_a);
+    sqlite3_free(owned_b);
+}
+
+
+#define BSON_PATCH_SET    1
+#define BSON_PATCH_UNSET  2
+#define BSON_PATCH_SPLICE 3
+#define BSON_PATCH_BEFORE 4
+
+typedef struct {
+    const char* path;
+    int plen;
+    int kind;
+    int seq;        // position in the delta
+    _belem val;     // new value for $set, [start, n, items] for $splice,
+                    // sibling key (or null) for $before
+} _patch_op;
+
+static int _cmp_path(const char* a, int la, const char* b, int lb)
+{
+    int c = memcmp(a, b, la < lb ? la : lb);
+    return c != 0 ? c : la - lb;
+}
+
+static int _cmp_op(const void* x, const void* y)
+{
+    const _patch_op* a = x;
+    const _patch_op* b = y;
+    int c = _cmp_path(a->path, a->plen, b->path, b->plen);
+
+    // qsort is not stable; the same path twice (e.g. in $set and $unset)
+    // must still resolve the same way every time, first in the delta wins:
+    return c != 0 ? c : a->seq - b->seq;
+}
+
+static int _cmp_op_seq(const void* x, const void* y)
+{
+    const _patch_op* a = *(const _patch_op* const*)x;
+    const _patch_op* b = *(const _patch_op* const*)y;
+    return a->seq - b->seq;
+}
+
+// First op in [lo,hi) whose path is >= (path, plen):
+static int _ops_lower(const _patch_op* ops, int lo, int hi, const char* path, int plen)
+{
+    while(lo < hi) {
+	int mid = (lo + hi) / 2;
+	if(_cmp_path(ops[mid].path, ops[mid].plen, path, plen) < 0) lo = mid + 1;
+	else hi = mid;
+    }
+    return lo;
+}
+
+// Range [*lo,*hi) of ops whose path starts with prefix (sorted => contiguous):
+static void _ops_prefixed(const _patch_op* ops, int n, const char* prefix, int plen, int* lo, int* hi)
+{
+    int i = _ops_lower(ops, 0, n, prefix, plen);
+    int j = i;
+    while(j < n && ops[j].plen >= plen && memcmp(ops[j].path, prefix, plen) == 0) j++;
+    *lo = i;
+    *hi = j;
+}
+
+// First op of the given kind at exactly path; kind 0 is any but $before,
+// which only says where a field goes and not what is in it:
+static const _patch_op* _ops_exact_kind(const _patch_op* ops, int lo, int hi, const char* path, int plen, int kind)
+{
+    for(int i = _ops_lower(ops, lo, hi, path, plen);
+	i < hi && ops[i].plen == plen && memcmp(ops[i].path, path, plen) == 0; i++) {
+	if(kind == 0 ? ops[i].kind != BSON_PATCH_BEFORE : ops[i].kind == kind) return &ops[i];
+    }
+    return 0;
+}
+
+static const _patch_op* _ops_exact(const _patch_op* ops, int lo, int hi, const char* path, int plen)
+{
+    return _ops_exact_kind(ops, lo, hi, path, plen, 0);
+}
+
+static const char* _patch_doc(
+    const uint8_t* src, uint32_t slen, bool is_array, const _patch_op* splice,
+    const _patch_op* ops, int nops, _buf_t* path, _buf_t* out);
+
+// Write one (possibly rebuilt) element whose path is already on path:
+static const char* _patch_elem(
+    const _belem* e, const char* okey, int oklen,
+    const _patch_op* ops, int nops, _buf_t* path, _buf_t* out)
+{
+    int lo, hi;
+    _ops_prefixed(ops, nops, (const char*)path->data, path->len, &lo, &hi);
+    const _patch_op* op = _ops_exact(ops, lo, hi, (const char*)path->data, path->len);
+
+    if(op != 0 && op->kind == BSON_PATCH_UNSET) return 0;
+
+    if(op != 0 && op->kind == BSON_PATCH_SET) {
+	_buf_elem(out, op->val.t, okey, oklen, op->val.v, op->val.vlen);
+	return 0;
+    }
+
+    bool is_doc = (e->t == BSON_TYPE_DOCUMENT || e->t == BSON_TYPE_ARRAY);
+    const _patch_op* splice = (op != 0 && e->t == BSON_TYPE_ARRAY) ? op : 0;
+
+    // Anything below us?  Ops on exactly this path sort first in the range.
+    int nexact = 0;
+    while(lo + nexact < hi && ops[lo + nexact].plen == path->len) nexact++;
+    bool below = (hi - lo) > nexact;
+
+    if(!is_doc || (!below && splice == 0)) {
+	_buf_elem(out, e->t, okey, oklen, e->v, e->vlen);
+	return 0;
+    }
+
+    _buf_byte(out, e->t);
+    _buf_append(out, okey, oklen);
+    _buf_byte(out, 0);
+    return _patch_doc(e->v, e->vlen, e->t == BSON_TYPE_ARRAY, splice, ops, nops, path, out);
+}
+
+// $before ops by sibling (null first), then delta order:
+static int _cmp_op_sibling(const void* x, const void* y)
+{
+    const _patch_op* a = *(const _patch_op* const*)x;
+    const _patch_op* b = *(const _patch_op* const*)y;
+    int c = (a->val.t == BSON_TYPE_UTF8) - (b->val.t == BSON_TYPE_UTF8);
+    if(c == 0 && a->val.t == BSON_TYPE_UTF8) {
+	c = _cmp_path((const char*)a->val.v + 4, _rd_int32(a->val.v) - 1,
+		      (const char*)b->val.v + 4, _rd_int32(b->val.v) - 1);
+    }
+    return c != 0 ? c : a->seq - b->seq;
+}
+
+// First of moves (sorted by _cmp_op_sibling) placed before key:
+static int _moves_lower(const _patch_op** moves, int n, const char* key, int klen)
+{
+    int lo = 0, hi = n;
+    while(lo < hi) {
+	int mid = (lo + hi) / 2;
+	const _belem* v = &moves[mid]->val;
+	if(v->t != BSON_TYPE_UTF8 || _cmp_path((const char*)v->v + 4, _rd_int32(v->v) - 1, key, klen) < 0) lo = mid + 1;
+	else hi = mid;
+    }
+    return lo;
+}
+
+/*
+  Write field seg of the document src where a $before put it:  rebuilt
+  from src if it is there, otherwise made the way $set makes a new field.
+  path is the document's own; ops [lo,hi) are the ones below it.
+*/
+static const char* _patch_field(
+    const uint8_t* src, uint32_t slen, const char* seg, int seglen,
+    const _patch_op* ops, int nops, int lo, int hi, _buf_t* path, _buf_t* out)
+{
+    uint8_t t;
+    const uint8_t* vp;
+    uint32_t vlen;
+    const char* perr = 0;
+    sqlite3_int64 mark = _path_push(path, seg, seglen);
+
+    if(_bson_find_key_raw(src, slen, seg, seglen, &t, &vp, &vlen)) {
+	_belem e = { t, seg, seglen, vp, vlen };
+	perr = _patch_elem(&e, seg, seglen, ops, nops, path, out);
+    } else {
+	const _patch_op* op = _ops_exact(ops, lo, hi, (const char*)path->data, path->len);
+	bool below = false;
+	for(int i = lo; i < hi && !below; i++) {
+	    below = ops[i].kind == BSON_PATCH_SET && ops[i].plen > path->len + 1
+		&& memcmp(ops[i].path, path->data, path->len) == 0 && ops[i].path[path->len] == '.';
+	}
+	if(op != 0 && op->kind == BSON_PATCH_SET) {
+	    _buf_elem(out, op->val.t, seg, seglen, op->val.v, op->val.vlen);
+	} else if(below) {
+	    _buf_byte(out, BSON_TYPE_DOCUMENT);
+	    _buf_append(out, seg, seglen);
+	    _buf_byte(out, 0);
+	    perr = _patch_doc(0, 0, false, 0, ops, nops, path, out);
+	}
+    }
+    path->len = mark;
+    return perr;
+}
+
+static const char* _patch_doc(
+    const uint8_t* src, uint32_t slen, bool is_array, const _patch_op* splice,
+    const _patch_op* ops, int nops, _buf_t* path, _buf_t* out)
+{
+    // An absent src (new parent created by $set) is an empty document:
+    static const uint8_t empty[5] = { 5, 0, 0, 0, 0 };
+    if(src == 0) {
+	src = empty;
+	slen = sizeof(empty);
+    }
+    if(slen < 5 || _rd_int32(src) != slen) return "invalid BSON";
+
+    int64_t sp_start = -1, sp_del = 0;
+    _belem sp_items = { 0 };
+    if(splice != 0) {
+	_belem e;
+	bool err;
+	const uint8_t* send = splice->val.v + splice->val.vlen - 1;
+	const uint8_t* q = splice->val.v + 4;
+	for(int n = 0; n < 3; n++) {
+	    q = _next_elem(q, send, &e, &err);
+	    if(q == 0) return "invalid $splice";
+	    if(n < 2 && e.t != BSON_TYPE_INT32 && e.t != BSON_TYPE_INT64) return "invalid $splice";
+	    if(n == 0) sp_start = (e.t == BSON_TYPE_INT32) ? (int32_t)_rd_int32(e.v) : (int64_t)_rd_u64(e.v);
+	    if(n == 1) sp_del = (e.t == BSON_TYPE_INT32) ? (int32_t)_rd_int32(e.v) : (int64_t)_rd_u64(e.v);
+	    if(n == 2) {
+		if(e.t != BSON_TYPE_ARRAY) return "invalid $splice";
+		sp_items = e;
+	    }
+	}
+	if(sp_start < 0 || sp_del < 0) return "invalid $splice";
+    }
+
+    // The ops below us; plen is our path and the '.':
+    sqlite3_int64 base = path->len;
+    if(base > 0) _buf_byte(path, '.');
+    int lo, hi;
+    _ops_prefixed(ops, nops, (const char*)path->data, path->len, &lo, &hi);
+    int plen = path->len;
+    path->len = base;
+
+    // $before on our own fields, each written just ahead of its sibling:
+    const _patch_op** moves = 0;
+    bool* done = 0;
+    int nmoves = 0;
+    for(int i = lo; i < hi && !is_array; i++) {
+	if(ops[i].kind != BSON_PATCH_BEFORE || ops[i].plen == plen
+	   || memchr(ops[i].path + plen, '.', ops[i].plen - plen) != 0) continue;
+	if(moves == 0) {
+	    moves = sqlite3_malloc64((hi - lo) * (sizeof(_patch_op*) + sizeof(bool)));
+	    if(moves == 0) return "out of memory";
+	    done = (bool*)(moves + (hi - lo));
+	}
+	done[nmoves] = false;
+	moves[nmoves++] = &ops[i];
+    }
+    if(nmoves > 1) qsort(moves, nmoves, sizeof(_patch_op*), _cmp_op_sibling);
+
+    sqlite3_int64 hdr = out->len;
+    _buf_int32(out, 0);
+
+    const uint8_t* end = src + slen - 1;
+    const uint8_t* q = src + 4;
+    uint32_t outidx = 0;
+    int64_t srcidx = 0;
+    bool err = false;
+    _belem e;
+    char ibuf[16];
+    const char* perr = 0;
+
+    for(;; srcidx++) {
+	if(srcidx == sp_start) {
+	    // Drop in the new items, then skip the deleted ones:
+	    const uint8_t* iend = sp_items.v + sp_items.vlen - 1;
+	    _belem it;
+	    bool ierr;
+	    for(const uint8_t* iq = sp_items.v + 4; (iq = _next_elem(iq, iend, &it, &ierr)) != 0; ) {
+		_buf_elem(out, it.t, ibuf, sprintf(ibuf, "%u", outidx++), it.v, it.vlen);
+	    }
+	    if(ierr) {
+		perr = "invalid $splice";
+		break;
+	    }
+	    for(int64_t n = 0; n < sp_del && q != 0; n++, srcidx++) {
+		q = _next_elem(q, end, &e, &err);
+	    }
+	    if(q == 0) break;
+	}
+
+	q = _next_elem(q, end, &e, &err);
+	if(q == 0) break;
+
+	for(int m = _moves_lower(moves, nmoves, e.key, e.klen); m < nmoves && perr == 0; m++) {
+	    const _belem* v = &moves[m]->val;
+	    if(_cmp_path((const char*)v->v + 4, _rd_int32(v->v) - 1, e.key, e.klen) != 0) break;
+	    perr = _patch_field(src, slen, moves[m]->path + plen, moves[m]->plen - plen, ops, nops, lo, hi, path, out);
+	    done[m] = true;
+	}
+	if(perr != 0) break;
+
+	sqlite3_int64 mark = _path_push(path, e.key, e.klen);
+	if(nmoves > 0 && _ops_exact_kind(ops, lo, hi, (const char*)path->data, path->len, BSON_PATCH_BEFORE)) {
+	    // Written, or to be written, next to its new sibling.
+	} else if(is_array) {
+	    sqlite3_int64 before = out->len;
+	    perr = _patch_elem(&e, ibuf, sprintf(ibuf, "%u", outidx), ops, nops, path, out);
+	    if(out->len != before) outidx++;   // not $unset
+	} else {
+	    perr = _patch_elem(&e, e.key, e.klen, ops, nops, path, out);
+	}
+	path->len = mark;
+	if(perr != 0) break;
+    }
+    if(perr == 0 && err) perr = "invalid BSON";
+
+    // A splice starting past the end just appends:
+    if(perr == 0 && sp_start > srcidx) {
+	const uint8_t* iend = sp_items.v + sp_items.vlen - 1;
+	_belem it;
+	bool ierr;
+	for(const uint8_t* iq = sp_items.v + 4; (iq = _next_elem(iq, iend, &it, &ierr)) != 0; ) {
+	    _buf_elem(out, it.t, ibuf, sprintf(ibuf, "%u", outidx++), it.v, it.vlen);
+	}
+    }
+
+    // $before null, or a sibling that isn't there:  at the end, in delta order:
+    int nleft = 0;
+    for(int m = 0; m < nmoves; m++) {
+	if(!done[m]) moves[nleft++] = moves[m];
+    }
+    if(nleft > 1) qsort(moves, nleft, sizeof(_patch_op*), _cmp_op_seq);
+    for(int m = 0; m < nleft && perr == 0; m++) {
+	perr = _patch_field(src, slen, moves[m]->path + plen, moves[m]->plen - plen, ops, nops, lo, hi, path, out);
+    }
+    sqlite3_free(moves);
+    if(perr != 0) return perr;
+
+    // $set ops below us whose next path segment doesn't exist in src, added
+    // in the order they appear in the delta:
+    const _patch_op** miss = 0;
+    int nmiss = 0;
+    for(int i = lo; i < hi; i++) {
+	const char* seg = ops[i].path + plen;
+	int rest = ops[i].plen - plen;
+	const char* dot = memchr(seg, '.', rest);
+	int seglen = dot ? dot - seg : rest;
+
+	uint8_t t;
+	const uint8_t* vp;
+	uint32_t vlen;
+	if(ops[i].kind != BSON_PATCH_SET || seglen == 0) continue;
+	if(_bson_find_key_raw(src, slen, seg, seglen, &t, &vp, &vlen)) continue;
+	if(nmoves > 0) {
+	    // Already written by its $before?
+	    sqlite3_int64 mark = _path_push(path, seg, seglen);
+	    bool moved = _ops_exact_kind(ops, lo, hi, (const char*)path->data, path->len, BSON_PATCH_BEFORE) != 0;
+	    path->len = mark;
+	    if(moved) continue;
+	}
+
+	if(miss == 0) {
+	    miss = sqlite3_malloc64((hi - lo) * sizeof(_patch_op*));
+	    if(miss == 0) return "out of memory";
+	}
+	miss[nmiss++] = &ops[i];
+    }
+    if(nmiss > 1) qsort(miss, nmiss, sizeof(_patch_op*), _cmp_op_seq);
+
+    for(int m = 0; m < nmiss && perr == 0; m++) {
+	const char* seg = miss[m]->path + plen;
+	const char* dot = memchr(seg, '.', miss[m]->plen - plen);
+	int seglen = dot ? dot - seg : miss[m]->plen - plen;
+
+	// Only the first op under each new segment does anything:
+	bool seen = false;
+	for(int k = 0; k < m && !seen; k++) {
+	    const char* kseg = miss[k]->path + plen;
+	    int krest = miss[k]->plen - plen;
+	    seen = krest >= seglen && memcmp(kseg, seg, seglen) == 0
+		&& (krest == seglen || kseg[seglen] == '.');
+	}
+	if(seen) continue;
+
+	const char* okey = seg;
+	int oklen = seglen;
+	if(is_array) {
+	    okey = ibuf;
+	    oklen = sprintf(ibuf, "%u", outidx++);
+	}
+
+	sqlite3_int64 mark = _path_push(path, seg, seglen);
+	const _patch_op* op = _ops_exact(ops, lo, hi, (const char*)path->data, path->len);
+	if(op != 0 && op->kind == BSON_PATCH_SET) {
+	    _buf_elem(out, op->val.t, okey, oklen, op->val.v, op->val.vlen);
+	} else {
+	    _buf_byte(out, BSON_TYPE_DOCUMENT);
+	    _buf_append(out, okey, oklen);
+	    _buf_byte(out, 0);
+	    perr = _patch_doc(0, 0, false, 0, ops, nops, path, out);
+	}
+	path->len = mark;
+    }
+    sqlite3_free(miss);
+    if(perr != 0) return perr;
+
+    _buf_byte(out, 0);
+    _buf_patch_len(out, hdr);
+    return out->oom || path->oom ? "out of memory" : 0;
+}
+
+static void bson_patch_func(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+    assert( argc==2 );
+
+    if( sqlite3_value_type(argv[0]) != SQLITE_BLOB) return;
+    if( sqlite3_value_type(argv[1]) != SQLITE_BLOB) {
+	// No delta, no change:
+	sqlite3_result_value(context, argv[0]);
+	return;
+    }
+
+    const uint8_t* delta = sqlite3_value_blob(argv[1]);
+    int dlen = sqlite3_value_bytes(argv[1]);
+    if(!_looks_like_bson(delta, dlen)) {
+	sqlite3_result_error(context, "invalid delta", -1);
+	return;
+    }
+
+    // Collect the ops, one per element of each of $set, $unset, $splice
+    // and $before, numbered in delta order; values point into the delta blob:
+    int nops = 0, cap = 0;
+    _patch_op* ops = 0;
+    const char* err = 0;
+    bool berr;
+    _belem sect;
+    for(const uint8_t* q = delta + 4; err == 0 && (q = _next_elem(q, delta + dlen - 1, &sect, &berr)) != 0; ) {
+	int kind = 0;
+	if(sect.klen == 4 && memcmp(sect.key, "$set", 4) == 0) kind = BSON_PATCH_SET;
+	if(sect.klen == 6 && memcmp(sect.key, "$unset", 6) == 0) kind = BSON_PATCH_UNSET;
+	if(sect.klen == 7 && memcmp(sect.key, "$splice", 7) == 0) kind = BSON_PATCH_SPLICE;
+	if(sect.klen == 7 && memcmp(sect.key, "$before", 7) == 0) kind = BSON_PATCH_BEFORE;
+	if(kind == 0 || sect.t != BSON_TYPE_DOCUMENT) {
+	    err = "invalid delta";
+	    break;
+	}
+
+	_belem e;
+	bool eerr;
+	for(const uint8_t* eq = sect.v + 4; (eq = _next_elem(eq, sect.v + sect.vlen - 1, &e, &eerr)) != 0; ) {
+	    if(kind == BSON_PATCH_SPLICE && e.t != BSON_TYPE_ARRAY) {
+		err = "invalid $splice";
+		break;
+	    }
+	    if(kind == BSON_PATCH_BEFORE && e.t != BSON_TYPE_NULL
+	       && (e.t != BSON_TYPE_UTF8 || e.vlen < 5 || e.v[e.vlen - 1] != 0)) {
+		err = "invalid $before";
+		break;
+	    }
+	    if(nops == cap) {
+		cap = cap ? cap * 2 : 16;
+		_patch_op* nv = sqlite3_realloc64(ops, cap * sizeof(_patch_op));
+		if(nv == 0) {
+		    err = "out of memory";
+		    break;
+		}
+		ops = nv;
+	    }
+	    ops[nops].path = e.key;
+	    ops[nops].plen = e.klen;
+	    ops[nops].kind = kind;
+	    ops[nops].seq = nops;
+	    ops[nops].val = e;
+	    nops++;
+	}
+	if(err == 0 && eerr) err = "invalid delta";
+    }
+    if(err == 0 && berr) err = "invalid delta";
+
+    if(err != 0) {
+	sqlite3_free(ops);
+	sqlite3_result_error(context, err, -1);
+	return;
+    }
+
+    qsort(ops, nops, sizeof(_patch_op), _cmp_op);
+
+    // $set of the empty path (sorts first) replaces the whole document:
+    if(nops > 0 && ops[0].plen == 0 && ops[0].kind == BSON_PATCH_SET) {
+	if(ops[0].val.t != BSON_TYPE_DOCUMENT) {
+	    sqlite3_result_error(context, "invalid delta", -1);
+	} else {
+	    sqlite3_result_blob(context, ops[0].val.v, ops[0].val.vlen, SQLITE_TRANSIENT);
+	}
+	sqlite3_free(ops);
+	return;
+    }
+
+    bson_t b;
+    uint8_t* owned;
+    if(!_init_bson_expanded(context, &b, argv, &owned)) {
+	sqlite3_free(ops);
+	return;
+    }
+
+    _buf_t path = {0};
+    _buf_t out = {0};
+    err = _patch_doc(bson_get_data(&b), b.len, false, 0, ops, nops, &path, &out);
+
+    if(err != 0) {
+	sqlite3_free(out.data);
+	sqlite3_result_error(context, err, -1);
+    } else {
+	sqlite3_result_blob(context, out.data, out.len, sqlite3_free);
+    }
+
+    sqlite3_free(path.data);
+    sqlite3_free(ops);
+    sqlite3_free(owned);
+}
+
+
+
+/*
+  bson_path_stats(bdata) aggregate and bson_index_advice().
+
+  One walk per document feeds a per-path record of how often the path
+  appears, which BSON types it holds, a HyperLogLog estimate of distinct
+  values and the total size of its values.  Paths descend into documents
+  only; an array is a value like any other, since there is nothing sensible
+  to index below it with bson_get.  Run it over a sample:
+
+    select bson_path_stats(bdata) from (select bdata from T where random() % 100 = 0);
+*/
+#define BSONEXT_STATS_MAX_PATHS  4096
+#define BSONEXT_HLL_BITS         10      // 1024 registers, ~3% error
+#define BSONEXT_HLL_REGS         (1 << BSONEXT_HLL_BITS)
+#define BSONEXT_TYPE_SLOTS       22      // 0x01-0x13, maxKey, minKey
+
+// The names MongoDB uses for $type:
+static const char* _type_name(uint8_t t)
+{
+    switch(t) {
+    case BSON_TYPE_DOUBLE:    return "double";
+    case BSON_TYPE_UTF8:      return "string";
+    case BSON_TYPE_DOCUMENT:  return "object";
+    case BSON_TYPE_ARRAY:     return "array";
+    case BSON_TYPE_BINARY:    return "binData";
+    case BSON_TYPE_UNDEFINED: return "undefined";
+    case BSON_TYPE_OID:       return "objectId";
+    case BSON_TYPE_BOOL:      return "bool";
+    case BSON_TYPE_DATE_TIME: return "date";
+    case BSON_TYPE_NULL:      return "null";
+    case BSON_TYPE_REGEX:     return "regex";
+    case BSON_TYPE_DBPOINTER: return "dbPointer";
+    case BSON_TYPE_CODE:      return "javascript";
+    case BSON_TYPE_SYMBOL:    return "symbol";
+    case BSON_TYPE_CODEWSCOPE: return "javascriptWithScope";
+    case BSON_TYPE_INT32:     return "int";
+    case BSON_TYPE_TIMESTAMP: return "timestamp";
+    case BSON_TYPE_INT64:     return "long";
+    case BSON_TYPE_DECIMAL128: return "decimal";
+    case BSON_TYPE_MAXKEY:    return "maxKey";
+    case BSON_TYPE_MINKEY:    return "minKey";
+    default:                  return 0;
+    }
+}
+
+static int _type_slot(uint8_t t)
+{
+    if(t == BSON_TYPE_MAXKEY) return 20;
+    if(t == BSON_TYPE_MINKEY) return 21;
+    return (t >= 1 && t <= 0x13) ? t - 1 : -1;
+}
+
+static const uint8_t _slot_type[BSONEXT_TYPE_SLOTS] = {
+    1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19,
+    BSON_TYPE_MAXKEY, BSON_TYPE_MINKEY
+};
+
+typedef struct {
+    char* path;
+    int plen;
+    sqlite3_int64 count;
+    sqlite3_int64 bytes;
+    uint32_t types[BSONEXT_TYPE_SLOTS];
+    uint8_t hll[BSONEXT_HLL_REGS];
+} _pstat;
+
+typedef struct {
+    sqlite3_int64 rows;
+    _pstat** p;
+    int n;
+    int cap;
+    int* slots;     // open addressing on the path hash, index + 1
+    int nslots;
+    bool truncated;
+    bool oom;
+} _pstats;
+
+static void _hll_add(uint8_t* regs, uint64_t h)
+{
+    uint32_t j = h >> (64 - BSONEXT_HLL_BITS);
+    uint64_t w = h << BSONEXT_HLL_BITS;
+    uint8_t rank = 1;
+    while(rank <= 64 - BSONEXT_HLL_BITS && (w & 0x8000000000000000ULL) == 0) {
+	rank++;
+	w <<= 1;
+    }
+    if(rank > regs[j]) regs[j] = rank;
+}
+
+static double _hll_estimate(const uint8_t* regs)
+{
+    double m = BSONEXT_HLL_REGS;
+    double sum = 0;
+    int zeros = 0;
+    for(int j = 0; j < BSONEXT_HLL_REGS; j++) {
+	sum += 1.0 / (double)(1ULL << regs[j]);
+	if(regs[j] == 0) zeros++;
+    }
+    double est = (0.7213 / (1 + 1.079 / m)) * m * m / sum;
+    if(est <= 2.5 * m && zeros > 0) est = m * log(m / zeros);   // small range correction
+    return est;
+}
+
+static _pstat* _pstats_get(_pstats* s, const char* path, int plen)
+{
+    if(s->n * 2 >= s->nslots) {
+	int nslots = s->nslots ? s->nslots * 2 : 64;
+	int* slots = sqlite3_malloc64(nslots * sizeof(int));
+	if(slots == 0) {
+	    s->oom = true;
+	    return 0;
+	}
+	memset(slots, 0, nslots * sizeof(int));
+	for(int i = 0; i < s->n; i++) {
+	    uint32_t h = _key_hash(s->p[i]->path, s->p[i]->plen) & (nslots - 1);
+	    while(slots[h] != 0) h = (h + 1) & (nslots - 1);
+	    slots[h] = i + 1;
+	}
+	sqlite3_free(s->slots);
+	s->slots = slots;
+	s->nslots = nslots;
+    }
+
+    uint32_t h = _key_hash(path, plen) & (s->nslots - 1);
+    for(; s->slots[h] != 0; h = (h + 1) & (s->nslots - 1)) {
+	_pstat* p = s->p[s->slots[h] - 1];
+	if(p->plen == plen && memcmp(p->path, path, plen) == 0) return p;
+    }
+
+    if(s->n == BSONEXT_STATS_MAX_PATHS) {
+	s->truncated = true;
+	return 0;
+    }
+    if(s->n == s->cap) {
+	int cap = s->cap ? s->cap * 2 : 32;
+	_pstat** np = sqlite3_realloc64(s->p, cap * sizeof(_pstat*));
+	if(np == 0) {
+	    s->oom = true;
+	    return 0;
+	}
+	s->p = np;
+	s->cap = cap;
+    }
+    _pstat* p = sqlite3_malloc64(sizeof(_pstat) + plen + 1);
+    if(p == 0) {
+	s->oom = true;
+	return 0;
+    }
+    memset(p, 0, sizeof(_pstat));
+    p->path = (char*)(p + 1);
+    memcpy(p->path, path, plen);
+    p->path[plen] = 0;
+    p->plen = plen;
+    s->p[s->n++] = p;
+    s->slots[h] = s->n;
+    return p;
+}
+
+static bool _pstats_walk(_pstats* s, const uint8_t* doc, uint32_t len, _buf_t* path)
+{
+    const uint8_t* end = doc + len - 1;
+    bool err;
+    _belem e;
+    for(const uint8_t* q = doc + 4; (q = _next_elem(q, end, &e, &err)) != 0; ) {
+	sqlite3_int64 mark = _path_push(path, e.key, e.klen);
+	_pstat* p = path->oom ? 0 : _pstats_get(s, (const char*)path->data, path->len);
+	if(p != 0) {
+	    int slot = _type_slot(e.t);
+	    p->count++;
+	    p->bytes += e.vlen;
+	    if(slot >= 0) p->types[slot]++;
+	    _hll_add(p->hll, _xxh64(e.v, e.vlen, e.t));
+	}
+	if(e.t == BSON_TYPE_DOCUMENT && !_pstats_walk(s, e.v, e.vlen, path)) return false;
+	path->len = mark;
+    }
+    return !err;
+}
+
+static void bson_path_stats_step(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+    assert( argc==1 );
+
+    if( sqlite3_value_type(argv[0]) != SQLITE_BLOB) return;
+
+    _pstats** ps = sqlite3_aggregate_context(context, sizeof(_pstats*));
+    if(ps == 0) {
+	sqlite3_result_error_nomem(context);
+	return;
+    }
+    if(*ps == 0) {
+	*ps = sqlite3_malloc64(sizeof(_pstats));
+	if(*ps == 0) {
+	    sqlite3_result_error_nomem(context);
+	    return;
+	}
+	memset(*ps, 0, sizeof(_pstats));
+    }
+    _pstats* s = *ps;
+
+    bson_t b;
+    uint8_t* owned;
+    if(!_init_bson_expanded(context, &b, argv, &owned)) return;
+
+    _buf_t path = {0};
+    s->rows++;
+    if(!_pstats_walk(s, bson_get_data(&b), b.len, &path)) {
+	sqlite3_result_error(context, "invalid BSON", -1);
+    } else if(s->oom || path.oom) {
+	sqlite3_result_error_nomem(context);
+    }
+    sqlite3_free(path.data);
+    sqlite3_free(owned);
+}
+
+static void _json_str(sqlite3_str* out, const char* s, int n)
+{
+    sqlite3_str_appendchar(out, 1, '"');
+    for(int i = 0; i < n; i++) {
+	unsigned char c = s[i];
+	if(c == '"' || c == '\\') {
+	    sqlite3_str_appendchar(out, 1, '\\');
+	    sqlite3_str_appendchar(out, 1, c);
+	} else if(c < 0x20) {
+	    sqlite3_str_appendf(out, "\\u%04x", c);
+	} else {
+	    sqlite3_str_appendchar(out, 1, c);
+	}
+    }
+    sqlite3_str_appendchar(out, 1, '"');
+}
+
+static int _cmp_pstat(const void* x, const void* y)
+{
+    const _pstat* a = *(const _pstat* const*)x;
+    const _pstat* b = *(const _pstat* const*)y;
+    return _cmp_path(a->path, a->plen, b->path, b->plen);
+}
+
+static void bson_path_stats_final(sqlite3_context *context)
+{
+    _pstats** ps = sqlite3_aggregate_context(context, 0);
+    _pstats* s = ps ? *ps : 0;
+    _pstats none = {0};
+    if(s == 0) s = &none;
+
+    if(s->n > 1) qsort(s->p, s->n, sizeof(_pstat*), _cmp_pstat);
+
+    sqlite3_str* out = sqlite3_str_new(sqlite3_context_db_handle(context));
+    sqlite3_str_appendf(out, "{\"rows\":%lld,", s->rows);
+    if(s->truncated) sqlite3_str_appendf(out, "\"truncated\":true,");
+    sqlite3_str_appendf(out, "\"paths\":{");
+    for(int i = 0; i < s->n; i++) {
+	_pstat* p = s->p[i];
+	if(i > 0) sqlite3_str_appendchar(out, 1, ',');
+	_json_str(out, p->path, p->plen);
+	sqlite3_str_appendf(out, ":{\"count\":%lld,\"freq\":%.4f,\"types\":{",
+			    p->count, (double)p->count / s->rows);
+	int nt = 0;
+	for(int slot = 0; slot < BSONEXT_TYPE_SLOTS; slot++) {
+	    if(p->types[slot] == 0) continue;
+	    sqlite3_str_appendf(out, "%s\"%s\":%u", nt++ ? "," : "", _type_name(_slot_type[slot]), p->types[slot]);
+	}
+	double ndv = _hll_estimate(p->hll);
+	if(ndv > p->count) ndv = p->count;
+	sqlite3_str_appendf(out, "},\"ndv\":%lld,\"avg_size\":%.1f}",
+			    (sqlite3_int64)(ndv + 0.5), (double)p->bytes / p->count);
+    }
+    sqlite3_str_appendf(out, "}}");
+
+    int n = sqlite3_str_length(out);
+    char* json = sqlite3_str_finish(out);
+    if(json == 0) {
+	sqlite3_result_error_nomem(context);
+    } else {
+	sqlite3_result_text(context, json, n, sqlite3_free);
+    }
+
+    if(s != &none) {
+	for(int i = 0; i < s->n; i++) sqlite3_free(s->p[i]);
+	sqlite3_free(s->p);
+	sqlite3_free(s->slots);
+	sqlite3_free(s);
+	*ps = 0;
+    }
+}
+
+
+/*
+  bson_index_advice(stats, table, column [, query])
+
+  Turns bson_path_stats output into CREATE INDEX statements.  Table size
+  comes from sqlite_stat1 when ANALYZE has been run, else from the stats
+  themselves.  A path is worth indexing if it mostly holds scalars and a
+  lookup on it would return under 5% of the table.  Paths already named in
+  an index on the table are skipped.  With a query, only paths quoted in it
+  are considered, and only if EXPLAIN QUERY PLAN shows a full scan.
+  Index names are table_path with anything not alphanumeric made '_';
+  if that is already taken (a.b and a_b, or another index of that name)
+  _2, _3, ... is added.
+
+  Returns the statements, each preceded by a comment with the numbers
+  behind it, or NULL if there is nothing to suggest.
+*/
+static void bson_index_advice_func(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+    assert( argc==3 || argc==4 );
+
+    for(int i = 0; i < argc; i++) {
+	if( sqlite3_value_type(argv[i]) != SQLITE_TEXT) return;
+    }
+    const char* table = (const char*)sqlite3_value_text(argv[1]);
+    const char* column = (const char*)sqlite3_value_text(argv[2]);
+    const char* query = argc == 4 ? (const char*)sqlite3_value_text(argv[3]) : 0;
+
+    sqlite3* db = sqlite3_context_db_handle(context);
+    sqlite3_stmt* stmt = 0;
+    sqlite3_str* out = sqlite3_str_new(db);
+    int rc;
+
+    // Does the query already get by without scanning?
+    if(query != 0) {
+	char* sql = sqlite3_mprintf("EXPLAIN QUERY PLAN %s", query);
+	rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+	sqlite3_free(sql);
+	if(rc != SQLITE_OK) {
+	    sqlite3_result_error(context, sqlite3_errmsg(db), -1);
+	    sqlite3_free(sqlite3_str_finish(out));
+	    return;
+	}
+	bool scans = false;
+	while(sqlite3_step(stmt) == SQLITE_ROW) {
+	    const char* detail = (const char*)sqlite3_column_text(stmt, 3);
+	    if(detail != 0 && strncmp(detail, "SCAN ", 5) == 0 && strstr(detail, "INDEX") == 0) scans = true;
+	}
+	sqlite3_finalize(stmt);
+	stmt = 0;
+	if(!scans) {
+	    sqlite3_free(sqlite3_str_finish(out));
+	    return;
+	}
+    }
+
+    // Rows in the table, if ANALYZE has told us:
+    sqlite3_int64 nrows = 0;
+    rc = sqlite3_prepare_v2(db, "SELECT stat FROM sqlite_stat1 WHERE tbl = ?1 LIMIT 1", -1, &stmt, 0);
+    if(rc == SQLITE_OK) {
+	sqlite3_bind_text(stmt, 1, table, -1, SQLITE_STATIC);
+	if(sqlite3_step(stmt) == SQLITE_ROW) {
+	    const char* stat = (const char*)sqlite3_column_text(stmt, 0);
+	    if(stat != 0) nrows = strtoll(stat, 0, 10);
+	}
+    }
+    sqlite3_finalize(stmt);
+
+    rc = sqlite3_prepare_v2(db,
+	"SELECT p.key, json_extract(p.value, '$.count'), json_extract(p.value, '$.ndv'),"
+	"  coalesce(json_extract(p.value, '$.types.object'), 0) + coalesce(json_extract(p.value, '$.types.array'), 0),"
+	"  json_extract(?1, '$.rows'),"
+	"  EXISTS (SELECT 1 FROM sqlite_master WHERE type = 'index' AND tbl_name = ?2"
+	"          AND instr(sql, '''' || replace(p.key, '''', '''''') || ''''))"
+	" FROM json_each(?1, '$.paths') p"
+	" WHERE ?3 IS NULL OR instr(?3, '''' || replace(p.key, '''', '''''') || '''')"
+	" ORDER BY json_extract(p.value, '$.ndv') * 1.0 / json_extract(p.value, '$.count') DESC, p.key",
+	-1, &stmt, 0);
+    if(rc != SQLITE_OK) {
+	sqlite3_result_error(context, sqlite3_errmsg(db), -1);
+	sqlite3_free(sqlite3_str_finish(out));
+	return;
+    }
+    sqlite3_bind_value(stmt, 1, argv[0]);
+    sqlite3_bind_text(stmt, 2, table, -1, SQLITE_STATIC);
+    if(query != 0) sqlite3_bind_text(stmt, 3, query, -1, SQLITE_STATIC);
+
+    // Names handed out so far, and a lookup for ones already in the schema:
+    char** names = 0;
+    int nnames = 0;
+    sqlite3_stmt* exists = 0;
+    rc = sqlite3_prepare_v2(db, "SELECT 1 FROM sqlite_master WHERE name = ?1 COLLATE NOCASE", -1, &exists, 0);
+    if(rc != SQLITE_OK) {
+	sqlite3_finalize(stmt);
+	sqlite3_result_error(context, sqlite3_errmsg(db), -1);
+	sqlite3_free(sqlite3_str_finish(out));
+	return;
+    }
+
+    while((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+	const char* path = (const char*)sqlite3_column_text(stmt, 0);
+	double count = sqlite3_column_double(stmt, 1);
+	double ndv = sqlite3_column_double(stmt, 2);
+	double nested = sqlite3_column_double(stmt, 3);
+	double sampled = sqlite3_column_double(stmt, 4);
+	bool indexed = sqlite3_column_int(stmt, 5);
+
+	if(indexed || count <= 0 || sampled <= 0 || ndv < 2) continue;
+	if(nested * 2 > count) continue;   // mostly objects and arrays
+
+	// A sample that was all distinct values says the table is too:
+	double total = nrows > 0 ? (double)nrows : sampled;
+	double freq = count / sampled;
+	double ndv_all = (ndv >= 0.9 * count) ? ndv * total / sampled : ndv;
+	double per_value = total * freq / ndv_all;
+	if(per_value > total * 0.05 && per_value > 1) continue;
+
+	char* base = sqlite3_mprintf("%s_%s", table, path);
+	char** more = sqlite3_realloc64(names, (nnames + 1) * sizeof(char*));
+	if(base == 0 || more == 0) {
+	    sqlite3_free(base);
+	    rc = SQLITE_NOMEM;
+	    break;
+	}
+	names = more;
+	for(char* c = base; *c; c++) {
+	    if(!((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9'))) *c = '_';
+	}
+
+	char* name = base;
+	for(int k = 2; name != 0; k++) {
+	    bool taken = false;
+	    for(int i = 0; i < nnames && !taken; i++) taken = sqlite3_stricmp(name, names[i]) == 0;
+	    if(!taken) {
+		sqlite3_bind_text(exists, 1, name, -1, SQLITE_STATIC);
+		taken = sqlite3_step(exists) == SQLITE_ROW;
+		sqlite3_reset(exists);
+	    }
+	    if(!taken) break;
+	    if(name != base) sqlite3_free(name);
+	    name = sqlite3_mprintf("%s_%d", base, k);
+	}
+	if(name != base) sqlite3_free(base);
+	if(name == 0) {
+	    rc = SQLITE_NOMEM;
+	    break;
+	}
+	names[nnames++] = name;
+
+	sqlite3_str_appendf(out, "-- %s: in %.0f%% of rows, ~%.0f distinct values, ~%.0f rows per value\n",
+			    path, freq * 100, ndv_all, per_value < 1 ? 1.0 : per_value);
+	sqlite3_str_appendf(out, "CREATE INDEX IF NOT EXISTS \"%w\" ON \"%w\"(bson_get(\"%w\", %Q));\n",
+			    name, table, column, path);
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_finalize(exists);
+    for(int i = 0; i < nnames; i++) sqlite3_free(names[i]);
+    sqlite3_free(names);
+
+    if(rc == SQLITE_NOMEM) {
+	sqlite3_result_error_nomem(context);
+	sqlite3_free(sqlite3_str_finish(out));
+	return;
+    }
+
+    if(rc != SQLITE_DONE) {
+	sqlite3_result_error(context, sqlite3_errmsg(db), -1);
+	sqlite3_free(sqlite3_str_finish(out));
+	return;
+    }
+
+    int n = sqlite3_str_length(out);
+    char* text = sqlite3_str_finish(out);
+    if(n > 0) {
+	sqlite3_result_text(context, text, n, sqlite3_free);
+    } else {
+	sqlite3_free(text);
+    }
+}
+
+
+
+/*
+  bson_group_array(value) and bson_group_object(key, value) aggregates.
+
+  Values go straight into one growing BSON buffer:  BSON blobs (regular or
+  compacted) become embedded documents, or arrays if they carry
+  BSONEXT_SUBTYPE_ARRAY, as when nesting bson_group_array.  Integers
+  become int32 when they fit and int64 otherwise, REAL becomes double,
+  TEXT becomes string, NULL becomes null and any other blob becomes
+  binary (subtype 0).
+*/
+typedef struct {
+    _buf_t buf;     // int32 length placeholder, then the elements
+    uint32_t n;
+} _group_t;
+
+// Append value as an element named key; false (error already set) on bad BSON:
+static bool _group_append(sqlite3_context* context, _buf_t* b, const char* key, int klen, sqlite3_value** value)
+{
+    switch(sqlite3_value_type(value[0])) {
+    case SQLITE_INTEGER: {
+	sqlite3_int64 v = sqlite3_value_int64(value[0]);
+	if(v >= INT32_MIN && v <= INT32_MAX) {
+	    _buf_byte(b, BSON_TYPE_INT32);
+	    _buf_append(b, key, klen);
+	    _buf_byte(b, 0);
+	    _buf_int32(b, (uint32_t)v);
+	} else {
+	    _buf_byte(b, BSON_TYPE_INT64);
+	    _buf_append(b, key, klen);
+	    _buf_byte(b, 0);
+	    _buf_int32(b, (uint32_t)((uint64_t)v & 0xffffffff));
+	    _buf_int32(b, (uint32_t)((uint64_t)v >> 32));
+	}
+	break;
+    }
+    case SQLITE_FLOAT: {
+	double d = sqlite3_value_double(value[0]);
+	uint64_t bits;
+	memcpy(&bits, &d, 8);
+	_buf_byte(b, BSON_TYPE_DOUBLE);
+	_buf_append(b, key, klen);
+	_buf_byte(b, 0);
+	_buf_int32(b, (uint32_t)(bits & 0xffffffff));
+	_buf_int32(b, (uint32_t)(bits >> 32));
+	break;
+    }
+    case SQLITE_TEXT: {
+	const unsigned char* s = sqlite3_value_text(value[0]);
+	int n = sqlite3_value_bytes(value[0]);
+	_buf_byte(b, BSON_TYPE_UTF8);
+	_buf_append(b, key, klen);
+	_buf_byte(b, 0);
+	_buf_int32(b, n + 1);
+	_buf_append(b, s, n);
+	_buf_byte(b, 0);
+	break;
+    }
+    case SQLITE_BLOB: {
+	const uint8_t* data = sqlite3_value_blob(value[0]);
+	int len = sqlite3_value_bytes(value[0]);
+	if(_looks_like_bson(data, len) || _is_compact(data, len)) {
+	    bson_t doc;
+	    uint8_t* owned;
+	    if(!_init_bson_expanded(context, &doc, value, &owned)) return false;
+	    const uint8_t* p = bson_get_data(&doc);
+	    uint8_t t = (sqlite3_value_subtype(value[0]) == BSONEXT_SUBTYPE_ARRAY) ? BSON_TYPE_ARRAY : BSON_TYPE_DOCUMENT;
+	    _buf_elem(b, t, key, klen, p, doc.len);
+	    sqlite3_free(owned);
+	} else {
+	    _buf_byte(b, BSON_TYPE_BINARY);
+	    _buf_append(b, key, klen);
+	    _buf_byte(b, 0);
+	    _buf_int32(b, len);
+	    _buf_byte(b, BSON_SUBTYPE_BINARY);
+	    _buf_append(b, data, len);
+	}
+	break;
+    }
+    default:
+	_buf_byte(b, BSON_TYPE_NULL);
+	_buf_append(b, key, klen);
+	_buf_byte(b, 0);
+	break;
+    }
+    return true;
+}
+
+static _group_t* _group_ctx(sqlite3_context* context)
+{
+    _group_t* g = sqlite3_aggregate_context(context, sizeof(_group_t));
+    if(g == 0) {
+	sqlite3_result_error_nomem(context);
+	return 0;
+    }
+    if(g->buf.len == 0) _buf_int32(&g->buf, 0);
+    return g;
+}
+
+static void bson_group_array_step(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+    assert( argc==1 );
+
+    _group_t* g = _group_ctx(context);
+    if(g == 0) return;
+
+    char ibuf[16];
+    if(_group_append(context, &g->buf, ibuf, sprintf(ibuf, "%u", g->n), argv)) g->n++;
+}
+
+static void bson_group_object_step(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+    assert( argc==2 );
+
+    if( sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+	sqlite3_result_error(context, "bson_group_object: key must not be NULL", -1);
+	return;
+    }
+
+    _group_t* g = _group_ctx(context);
+    if(g == 0) return;
+
+    // Keys are C strings in BSON so stop at any embedded NUL:
+    const char* key = (const char*)sqlite3_value_text(argv[0]);
+    if(_group_append(context, &g->buf, key, strlen(key), argv + 1)) g->n++;
+}
+
+static void _group_final(sqlite3_context *context, bool is_array)
+{
+    _group_t* g = sqlite3_aggregate_context(context, 0);
+
+    if(g == 0 || g->buf.len == 0) {
+	// No rows:  an empty document (or array, when nested)
+	static const uint8_t empty[5] = { 5, 0, 0, 0, 0 };
+	sqlite3_result_blob(context, empty, sizeof(empty), SQLITE_STATIC);
+    } else {
+	_buf_byte(&g->buf, 0);
+	_buf_patch_len(&g->buf, 0);
+	if(g->buf.oom) {
+	    sqlite3_free(g->buf.data);
+	    sqlite3_result_error_nomem(context);
+	    memset(g, 0, sizeof(_group_t));
+	    return;
+	}
+	sqlite3_result_blob(context, g->buf.data, g->buf.len, sqlite3_free);
+	memset(g, 0, sizeof(_group_t));
+    }
+    if(is_array) sqlite3_result_subtype(context, BSONEXT_SUBTYPE_ARRAY);
+}
+
+static void bson_group_array_final(sqlite3_context *context)
+{
+    _group_final(context, true);
+}
+
+static void bson_group_object_final(sqlite3_context *context)
+{
+    _group_final(context, false);
+}
+
+// bson_as_array(bdata):  the same blob, marked as an array for nesting.
+// Needed when it comes from a subquery or a table, which drop the mark:
+static void bson_as_array_func(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+    assert( argc==1 );
+
+    if( sqlite3_value_type(argv[0]) != SQLITE_BLOB) return;
+    const uint8_t* data = sqlite3_value_blob(argv[0]);
+    int len = sqlite3_value_bytes(argv[0]);
+    if(!_looks_like_bson(data, len) && !_is_compact(data, len)) {
+	sqlite3_result_error(context, "bson_as_array: not BSON", -1);
+	return;
+    }
+    sqlite3_result_value(context, argv[0]);
+    sqlite3_result_subtype(context, BSONEXT_SUBTYPE_ARRAY);
+}
+
+
+
+/*
+  Structural probes:  bson_type, bson_exists, bson_size and bson_keys look
+  only at element headers along the dotpath and never convert a value.
+  Compacted blobs are walked by key id like bson_get does; nothing is
+  expanded, keys come from the dictionary and sizes are what the value
+  would take in regular BSON.
+*/
+typedef struct {
+    bool found;
+    uint8_t t;
+    const uint8_t* vp;
+    int64_t vlen;
+    keydict* d;     // non-0 if vp is compact
+} _probe_t;
+
+// false if there is nothing to answer (not a blob, NULL path, or bad BSON):
+static bool _probe(sqlite3_context* context, sqlite3_value** argv, _probe_t* p)
+{
+    p->found = false;
+    p->d = 0;
+
+    if( sqlite3_value_type(argv[0]) != SQLITE_BLOB) return false;
+
+    const char* dotpath = (const char*) sqlite3_value_text(argv[1]);
+    if(dotpath == 0) return false;
+
+    if(_is_compact(sqlite3_value_blob(argv[0]), sqlite3_value_bytes(argv[0]))) {
+	return _compact_find(context, argv, &p->d, &p->t, &p->vp, &p->vlen, &p->found);
+    }
+
+    bson_t b;
+    if(!_init_bson(&b, argv)) {
+	sqlite3_result_error(context, "invalid BSON", -1);
+	return false;
+    }
+
+    uint32_t vlen;
+    p->found = _bson_find_raw(bson_get_data(&b), b.len, dotpath, &p->t, &p->vp, &vlen);
+    p->vlen = vlen;
+    return true;
+}
+
+/*
+  Walk the elements of a compact document or array, calling fn with the
+  regular BSON key of each.  The key comes from the dictionary (or is
+  the offset, for arrays) and is not NUL-terminated.
+*/
+static const char* _compact_each(
+    sqlite3* db,
+    keydict* d,
+    const uint8_t* p,
+    int64_t len,
+    bool is_array,
+    const char* (*fn)(void* arg, uint8_t t, const char* key, int klen, const uint8_t* v, int64_t vlen),
+    void* arg)
+{
+    if(len < 5 || _rd_int32(p) != len || p[len-1] != 0) return "invalid compact BSON";
+
+    const uint8_t* end = p + len - 1;
+    p += 4;
+    for(uint32_t idx = 0; p < end; idx++) {
+	uint8_t t = *p++;
+	char ibuf[16];
+	const char* key = ibuf;
+	int klen;
+	if(is_array) {
+	    klen = sprintf(ibuf, "%u", idx);
+	} else {
+	    uint64_t id;
+	    p = _get_varint(p, end, &id);
+	    if(p == 0) return "invalid compact BSON";
+	    key = _keydict_key(db, d, id, &klen);
+	    if(key == 0) return "unknown key id in compact BSON";
+	}
+
+	int64_t vlen = _bson_value_len(t, p, end);
+	if(vlen < 0) return "invalid compact BSON";
+
+	const char* err = fn(arg, t, key, klen, p, vlen);
+	if(err != 0) return err;
+	p += vlen;
+    }
+    return 0;
+}
+
+typedef struct { sqlite3* db; keydict* d; int64_t n; } _xsize_t;
+
+// Bytes of the expanded document:  length, elements, terminator.
+static const char* _xsize_elem(void* arg, uint8_t t, const char* key, int klen, const uint8_t* v, int64_t vlen)
+{
+    _xsize_t* x = arg;
+    x->n += 1 + klen + 1;
+    if(t != BSON_TYPE_DOCUMENT && t != BSON_TYPE_ARRAY) {
+	x->n += vlen;
+	return 0;
+    }
+    x->n += 5;
+    return _compact_each(x->db, x->d, v, vlen, t == BSON_TYPE_ARRAY, _xsize_elem, x);
+}
+
+static const char* _keys_elem(void* arg, uint8_t t, const char* key, int klen, const uint8_t* v, int64_t vlen)
+{
+    sqlite3_str* out = arg;
+    if(sqlite3_str_length(out) > 1) sqlite3_str_appendchar(out, 1, ',');
+    _json_str(out, key, klen);
+    return 0;
+}
+
+static void bson_type_func(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+    assert( argc==2 );
+
+    _probe_t p;
+    if(_probe(context, argv, &p) && p.found) {
+	const char* name = _type_name(p.t);
+	if(name != 0) sqlite3_result_text(context, name, -1, SQLITE_STATIC);
+    }
+}
+
+static void bson_exists_func(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+    assert( argc==2 );
+
+    _probe_t p;
+    if(_probe(context, argv, &p)) {
+	sqlite3_result_int(context, p.found);
+    }
+}
+
+// Bytes taken by the value itself, e.g. the whole length-prefixed
+// document for an object or 8 for a double:
+static void bson_size_func(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+    assert( argc==2 );
+
+    _probe_t p;
+    if(!_probe(context, argv, &p) || !p.found) return;
+
+    if(p.d != 0 && (p.t == BSON_TYPE_DOCUMENT || p.t == BSON_TYPE_ARRAY)) {
+	_xsize_t x = { sqlite3_context_db_handle(context), p.d, 5 };
+	const char* err = _compact_each(x.db, p.d, p.vp, p.vlen, p.t == BSON_TYPE_ARRAY, _xsize_elem, &x);
+	if(err != 0) {
+	    sqlite3_result_error(context, err, -1);
+	    return;
+	}
+	p.vlen = x.n;
+    }
+    sqlite3_result_int64(context, p.vlen);
+}
+
+// Field names of a document (or the offsets of an array) as a JSON array:
+static void bson_keys_func(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+    assert( argc==2 );
+
+    _probe_t p;
+    if(_probe(context, argv, &p) && p.found
+       && (p.t == BSON_TYPE_DOCUMENT || p.t == BSON_TYPE_ARRAY)) {
+	sqlite3* db = sqlite3_context_db_handle(context);
+	sqlite3_str* out = sqlite3_str_new(db);
+	const char* err = 0;
+
+	sqlite3_str_appendchar(out, 1, '[');
+	if(p.d != 0) {
+	    err = _compact_each(db, p.d, p.vp, p.vlen, p.t == BSON_TYPE_ARRAY, _keys_elem, out);
+	} else {
+	    const uint8_t* end = p.vp + p.vlen - 1;
+	    bool bad;
+	    _belem e;
+	    for(const uint8_t* q = p.vp + 4; (q = _next_elem(q, end, &e, &bad)) != 0; ) {
+		_keys_elem(out, e.t, e.key, e.klen, e.v, e.vlen);
+	    }
+	    if(bad) err = "invalid BSON";
+	}
+	sqlite3_str_appendchar(out, 1, ']');
+
+	int len = sqlite3_str_length(out);
+	char* json = sqlite3_str_finish(out);
+	if(err != 0) {
+	    sqlite3_free(json);
+	    sqlite3_result_error(context, err, -1);
+	} else if(json == 0) {
+	    sqlite3_result_error_nomem(context);
+	} else {
+	    sqlite3_result_text(context, json, len, sqlite3_free);
+	}
+    }
+}
+
+
+
+/*
+  FTS5 tokenizer "bson".  Given a BSON blob it walks the document and hands
+  only string values to a parent tokenizer (unicode61 unless another is
+  named), so keys, numbers and punctuation never reach the index.
+  Anything that isn't BSON, including all query text, goes to the parent
+  untouched.  Options, before the parent tokenizer and its arguments:
+
+    include 'p1,p2'   only strings at or below these dotpaths
+    exclude 'p1,p2'   skip strings at or below these dotpaths
+    paths 1           also index every token as "path:token" in the same
+		      position, so MATCH '"hdr.title: big dog"' only hits
+		      that path
+
+  Array offsets are left out of paths:  the strings in items[*].name are
+  all "items.name".  Compacted blobs need their dictionary, which a
+  tokenizer can't reach; index bson_expand(col) instead.
+*/
+typedef struct {
+    fts5_tokenizer parent;
+    Fts5Tokenizer* pParent;
+    char* include;      // comma separated, NUL at each comma; 0 for all
+    char* exclude;
+    bool paths;
+} _bson_tok;
+
+typedef struct {
+    void* pCtx;
+    int (*xToken)(void*, int, const char*, int, int, int);
+    int base;           // offset of the string being tokenized in the input
+    const char* path;
+    int plen;
+    bool plain;         // emit the token itself
+    _buf_t tok;         // scratch for "path:token"
+} _bson_tok_cb;
+
+static int _bson_tok_emit(void* p, int tflags, const char* token, int ntoken, int start, int end)
+{
+    _bson_tok_cb* cb = p;
+    int rc = SQLITE_OK;
+
+    if(cb->plain) {
+	rc = cb->xToken(cb->pCtx, tflags, token, ntoken, cb->base + start, cb->base + end);
+	if(rc != SQLITE_OK || cb->path == 0) return rc;
+	tflags = FTS5_TOKEN_COLOCATED;
+    }
+    cb->tok.len = 0;
+    _buf_append(&cb->tok, cb->path, cb->plen);
+    _buf_byte(&cb->tok, ':');
+    _buf_append(&cb->tok, token, ntoken);
+    if(cb->tok.oom) return SQLITE_NOMEM;
+    return cb->xToken(cb->pCtx, tflags, (const char*)cb->tok.data, cb->tok.len, cb->base + start, cb->base + end);
+}
+
+// Is path at or below any of the NUL separated entries in list?
+static bool _path_listed(const char* list, const char* path, int plen)
+{
+    for(const char* e = list; *e != 0; e += strlen(e) + 1) {
+	int n = strlen(e);
+	if(n <= plen && memcmp(e, path, n) == 0 && (n == plen || path[n] == '.')) return true;
+    }
+    return false;
+}
+
+static int _bson_tok_walk(
+    _bson_tok* t, const uint8_t* input, const uint8_t* doc, uint32_t len,
+    bool is_array, _buf_t* path, _bson_tok_cb* cb, int flags)
+{
+    const uint8_t* end = doc + len - 1;
+    bool err;
+    _belem e;
+    int rc = SQLITE_OK;
+
+    for(const uint8_t* q = doc + 4; rc == SQLITE_OK && (q = _next_elem(q, end, &e, &err)) != 0; ) {
+	sqlite3_int64 mark = path->len;
+	if(!is_array) _path_push(path, e.key, e.klen);
+	if(path->oom) return SQLITE_NOMEM;
+
+	if(e.t == BSON_TYPE_DOCUMENT || e.t == BSON_TYPE_ARRAY) {
+	    rc = _bson_tok_walk(t, input, e.v, e.vlen, e.t == BSON_TYPE_ARRAY, path, cb, flags);
+
+	} else if(e.t == BSON_TYPE_UTF8 && e.vlen > 5) {
+	    const char* p = (const char*)path->data;
+	    int plen = path->len;
+	    if((t->include == 0 || _path_listed(t->include, p, plen))
+	       && (t->exclude == 0 || !_path_listed(t->exclude, p, plen))) {
+		cb->base = (e.v + 4) - input;
+		cb->path = t->paths ? p : 0;
+		cb->plen = plen;
+		rc = t->parent.xTokenize(t->pParent, cb, flags, (const char*)e.v + 4, e.vlen - 5, _bson_tok_emit);
+	    }
+	}
+	path->len = mark;
+    }
+    if(rc == SQLITE_OK && err) rc = SQLITE_ERROR;
+    return rc;
+}
+
+// Query text of the form "path: terms"?  Query text isn't NUL terminated.
+static bool _query_path(const char* text, int ntext, int* plen)
+{
+    int n = 0;
+    while(n < ntext && text[n] != ':' && text[n] != ' ' && text[n] != '\t') n++;
+    *plen = n;
+    return n > 0 && n < ntext && text[n] == ':';
+}
+
+static int _bson_tok_tokenize(
+    Fts5Tokenizer* pTok, void* pCtx, int flags, const char* text, int ntext,
+    int (*xToken)(void*, int, const char*, int, int, int))
+{
+    _bson_tok* t = (_bson_tok*)pTok;
+    _bson_tok_cb cb = { pCtx, xToken, 0, 0, 0, true, {0} };
+    int rc;
+
+    if((flags & FTS5_TOKENIZE_QUERY) == 0 && _looks_like_bson(text, ntext)) {
+	_buf_t path = {0};
+	rc = _bson_tok_walk(t, (const uint8_t*)text, (const uint8_t*)text, ntext, false, &path, &cb, flags);
+	sqlite3_free(path.data);
+
+    } else if((flags & FTS5_TOKENIZE_QUERY) && t->paths && _query_path(text, ntext, &cb.plen)) {
+	// "path: terms" becomes path:term for each term
+	cb.path = text;
+	cb.plain = false;
+	cb.base = cb.plen + 1;
+	rc = t->parent.xTokenize(t->pParent, &cb, flags, text + cb.base, ntext - cb.base, _bson_tok_emit);
+
+    } else {
+	rc = t->parent.xTokenize(t->pParent, pCtx, flags, text, ntext, xToken);
+    }
+
+    sqlite3_free(cb.tok.data);
+    return rc;
+}
+
+static void _bson_tok_delete(Fts5Tokenizer* pTok)
+{
+    _bson_tok* t = (_bson_tok*)pTok;
+    if(t == 0) return;
+    if(t->pParent != 0) t->parent.xDelete(t->pParent);
+    sqlite3_free(t->include);
+    sqlite3_free(t->exclude);
+    sqlite3_free(t);
+}
+
+// 'a.b, c' => "a.b\0c\0\0"
+static char* _split_paths(const char* arg)
+{
+    int n = strlen(arg);
+    char* list = sqlite3_malloc(n + 2);
+    if(list == 0) return 0;
+    char* o = list;
+    for(const char* p = arg; *p != 0; ) {
+	while(*p == ',' || *p == ' ') p++;
+	int len = strcspn(p, ", ");
+	if(len == 0) break;
+	memcpy(o, p, len);
+	o += len;
+	*o++ = 0;
+	p += len;
+    }
+    *o = 0;
+    return list;
+}
+
+static int _bson_tok_create(void* pCtx, const char** azArg, int nArg, Fts5Tokenizer** ppOut)
+{
+    fts5_api* api = pCtx;
+    _bson_tok* t = sqlite3_malloc(sizeof(_bson_tok));
+    *ppOut = 0;
+    if(t == 0) return SQLITE_NOMEM;
+    memset(t, 0, sizeof(_bson_tok));
+
+    int i = 0;
+    int rc = SQLITE_OK;
+    while(rc == SQLITE_OK && i + 1 < nArg) {
+	if(sqlite3_stricmp(azArg[i], "include") == 0) {
+	    sqlite3_free(t->include);
+	    if((t->include = _split_paths(azArg[i+1])) == 0) rc = SQLITE_NOMEM;
+	} else if(sqlite3_stricmp(azArg[i], "exclude") == 0) {
+	    sqlite3_free(t->exclude);
+	    if((t->exclude = _split_paths(azArg[i+1])) == 0) rc = SQLITE_NOMEM;
+	} else if(sqlite3_stricmp(azArg[i], "paths") == 0) {
+	    t->paths = (atoi(azArg[i+1]) != 0);
+	} else {
+	    break;  // the parent tokenizer
+	}
+	i += 2;
+    }
+
+    const char* name = (i < nArg) ? azArg[i++] : "unicode61";
+    void* pUser = 0;
+    if(rc == SQLITE_OK) rc = api->xFindTokenizer(api, name, &pUser, &t->parent);
+    if(rc == SQLITE_OK) rc = t->parent.xCreate(pUser, azArg + i, nArg - i, &t->pParent);
+
+    if(rc != SQLITE_OK) {
+	_bson_tok_delete((Fts5Tokenizer*)t);
+	return rc;
+    }
+    *ppOut = (Fts5Tokenizer*)t;
+    return SQLITE_OK;
+}
+
+// The fts5_api for db, or 0 if sqlite was built without FTS5:
+static fts5_api* _fts5_api(sqlite3* db)
+{
+    fts5_api* api = 0;
+    sqlite3_stmt* stmt = 0;
+    if(sqlite3_prepare_v2(db, "SELECT fts5(?1)", -1, &stmt, 0) == SQLITE_OK) {
+	sqlite3_bind_pointer(stmt, 1, (void*)&api, "fts5_api_ptr", 0);
+	sqlite3_step(stmt);
+    }
+    sqlite3_finalize(stmt);
+    return (api != 0 && api->iVersion >= 2) ? api : 0;
+}
+
+
+
+/*
+  GeoJSON bounding boxes and an R*Tree kept in step with a BSON column.
+
+  bson_geo_bbox(bdata, path) returns [minx, miny, maxx, maxy] as JSON for
+  the GeoJSON object at path:  any of the seven geometry types, or a
+  Feature (its geometry is used).  Positions are [x, y, ...] with x the
+  longitude; anything past y is ignored.  bson_geo_bbox(bdata, path, i)
+  returns just element i (0-3) as a REAL.  The triggers call the 2-arg
+  form once per row and take it apart with json_extract.  NULL if path is
+  not GeoJSON or has no positions.
+*/
+#define BSONEXT_GEO_MAX_DEPTH 8
+
+static bool _geo_is_num(uint8_t t)
+{
+    return t == BSON_TYPE_DOUBLE || t == BSON_TYPE_INT32 || t == BSON_TYPE_INT64 || t == BSON_TYPE_DECIMAL128;
+}
+
+static double _geo_num(const _belem* e)
+{
+    _bson_num n = _get_num(e->t, e->v);
+    return n.is_int ? (double)n.i : n.d;
+}
+
+// Fold every position in a (possibly nested) coordinates array into bb:
+static bool _geo_coords(const uint8_t* arr, uint32_t len, int depth, double* bb, int* npos)
+{
+    const uint8_t* end = arr + len - 1;
+    bool err;
+    _belem e, y;
+
+    const uint8_t* q = _next_elem(arr + 4, end, &e, &err);
+    if(q == 0) return !err;
+
+    if(_geo_is_num(e.t)) {
+	// A position:
+	if(_next_elem(q, end, &y, &err) == 0 || !_geo_is_num(y.t)) return false;
+	double px = _geo_num(&e), py = _geo_num(&y);
+	if(*npos == 0 || px < bb[0]) bb[0] = px;
+	if(*npos == 0 || py < bb[1]) bb[1] = py;
+	if(*npos == 0 || px > bb[2]) bb[2] = px;
+	if(*npos == 0 || py > bb[3]) bb[3] = py;
+	(*npos)++;
+	return true;
+    }
+
+    if(depth >= BSONEXT_GEO_MAX_DEPTH) return false;
+    for(q = arr + 4; (q = _next_elem(q, end, &e, &err)) != 0; ) {
+	if(e.t != BSON_TYPE_ARRAY || !_geo_coords(e.v, e.vlen, depth + 1, bb, npos)) return false;
+    }
+    return !err;
+}
+
+static bool _geo_object(const uint8_t* doc, uint32_t len, int depth, double* bb, int* npos)
+{
+    uint8_t t;
+    const uint8_t* vp;
+    uint32_t vlen;
+
+    if(depth >= BSONEXT_GEO_MAX_DEPTH) return false;
+    if(!_bson_find_key_raw(doc, len, "type", 4, &t, &vp, &vlen) || t != BSON_TYPE_UTF8) return false;
+    const char* type = (const char*)vp + 4;
+
+    if(strcmp(type, "Feature") == 0) {
+	if(!_bson_find_key_raw(doc, len, "geometry", 8, &t, &vp, &vlen)) return false;
+	if(t == BSON_TYPE_NULL) return true;   // unlocated feature
+	return t == BSON_TYPE_DOCUMENT && _geo_object(vp, vlen, depth + 1, bb, npos);
+    }
+
+    if(strcmp(type, "GeometryCollection") == 0) {
+	if(!_bson_find_key_raw(doc, len, "geometries", 10, &t, &vp, &vlen) || t != BSON_TYPE_ARRAY) return false;
+	const uint8_t* end = vp + vlen - 1;
+	bool err;
+	_belem e;
+	for(const uint8_t* q = vp + 4; (q = _next_elem(q, end, &e, &err)) != 0; ) {
+	    if(e.t != BSON_TYPE_DOCUMENT || !_geo_object(e.v, e.vlen, depth + 1, bb, npos)) return false;
+	}
+	return !err;
+    }
+
+    static const char* geoms[] = {
+	"Point", "MultiPoint", "LineString", "MultiLineString", "Polygon", "MultiPolygon", 0
+    };
+    int g = 0;
+    while(geoms[g] != 0 && strcmp(type, geoms[g]) != 0) g++;
+    if(geoms[g] == 0) return false;
+
+    if(!_bson_find_key_raw(doc, len, "coordinates", 11, &t, &vp, &vlen) || t != BSON_TYPE_ARRAY) return false;
+    return _geo_coords(vp, vlen, depth, bb, npos);
+}
+
+static void bson_geo_bbox_func(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+    assert( argc==2 || argc==3 );
+
+    int which = -1;
+    if(argc == 3) {
+	if( sqlite3_value_type(argv[2]) == SQLITE_NULL) return;
+	which = sqlite3_value_int(argv[2]);
+	if(which < 0 || which > 3) {
+	    sqlite3_result_error(context, "bson_geo_bbox: element must be 0-3", -1);
+	    return;
+	}
+    }
+
+    _probe_t p;
+    _buf_t owned = {0};
+    if(_probe(context, argv, &p) && p.found && p.t == BSON_TYPE_DOCUMENT) {
+	if(p.d != 0) {
+	    // only the geometry itself is expanded:
+	    const char* err = _expand_doc(sqlite3_context_db_handle(context), p.d, p.vp, p.vlen, false, &owned);
+	    if(err != 0) {
+		sqlite3_free(owned.data);
+		sqlite3_result_error(context, err, -1);
+		return;
+	    }
+	    p.vp = owned.data;
+	    p.vlen = owned.len;
+	}
+	double bb[4];
+	int npos = 0;
+	if(_geo_object(p.vp, p.vlen, 0, bb, &npos) && npos > 0) {
+	    if(which >= 0) {
+		sqlite3_result_double(context, bb[which]);
+	    } else {
+		char* json = sqlite3_mprintf("[%!.15g,%!.15g,%!.15g,%!.15g]", bb[0], bb[1], bb[2], bb[3]);
+		if(json == 0) {
+		    sqlite3_result_error_nomem(context);
+		} else {
+		    sqlite3_result_text(context, json, -1, sqlite3_free);
+		}
+	    }
+	}
+    }
+    sqlite3_free(owned.data);
+}
+
+
+/*
+  bson_geo_rtree_create(table, column, path [, rtree])
+
+  Creates an R*Tree (id, minx, maxx, miny, maxy) keyed on the rowid of
+  table, triggers that keep it current as column changes, and fills it
+  from the rows already there.  Rows without GeoJSON at path are simply
+  not in it.  rtree defaults to <table>_<path>_rtree; its name is
+  returned.  Safe to call again.
+*/
+static void bson_geo_rtree_create_func(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+    assert( argc==3 || argc==4 );
+
+    for(int i = 0; i < argc; i++) {
+	if( sqlite3_value_type(argv[i]) != SQLITE_TEXT) {
+	    sqlite3_result_error(context, "bson_geo_rtree_create: arguments must be text", -1);
+	    return;
+	}
+    }
+    const char* table = (const char*)sqlite3_value_text(argv[0]);
+    const char* column = (const char*)sqlite3_value_text(argv[1]);
+    const char* path = (const char*)sqlite3_value_text(argv[2]);
+
+    char* rtree;
+    if(argc == 4) {
+	rtree = sqlite3_mprintf("%s", sqlite3_value_text(argv[3]));
+    } else {
+	rtree = sqlite3_mprintf("%s_%s_rtree", table, path);
+	for(char* c = rtree; c && *c; c++) {
+	    if(!((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9'))) *c = '_';
+	}
+    }
+    if(rtree == 0) {
+	sqlite3_result_error_nomem(context);
+	return;
+    }
+
+    // bson_geo_bbox is called once per row and its [minx,miny,maxx,maxy]
+    // unpacked into id, minx, maxx, miny, maxy.  The LIMIT keeps sqlite
+    // from flattening the subquery, which would copy the call into every
+    // column that uses bb:
+    const char* unpack = "SELECT id, json_extract(bb, '$[0]'), json_extract(bb, '$[2]'),"
+	" json_extract(bb, '$[1]'), json_extract(bb, '$[3]') FROM (%s LIMIT %d) WHERE bb IS NOT NULL";
+    char* q_new = sqlite3_mprintf("SELECT new.rowid id, bson_geo_bbox(new.\"%w\", %Q) bb", column, path);
+    char* q_all = sqlite3_mprintf("SELECT t.rowid id, bson_geo_bbox(t.\"%w\", %Q) bb FROM \"%w\" t",
+				  column, path, table);
+    char* newrow = (q_new == 0) ? 0 : sqlite3_mprintf(unpack, q_new, 1);
+    char* anyrow = (q_all == 0) ? 0 : sqlite3_mprintf(unpack, q_all, -1);
+    sqlite3_free(q_new);
+    sqlite3_free(q_all);
+
+    char* sql = (newrow == 0 || anyrow == 0) ? 0 : sqlite3_mprintf(
+	"CREATE VIRTUAL TABLE IF NOT EXISTS \"%w\" USING rtree(id, minx, maxx, miny, maxy);"
+	"CREATE TRIGGER IF NOT EXISTS \"%w_ins\" AFTER INSERT ON \"%w\" BEGIN"
+	"  INSERT INTO \"%w\" %s;"
+	" END;"
+	"CREATE TRIGGER IF NOT EXISTS \"%w_upd\" AFTER UPDATE OF \"%w\" ON \"%w\" BEGIN"
+	"  DELETE FROM \"%w\" WHERE id = old.rowid;"
+	"  INSERT INTO \"%w\" %s;"
+	" END;"
+	"CREATE TRIGGER IF NOT EXISTS \"%w_del\" AFTER DELETE ON \"%w\" BEGIN"
+	"  DELETE FROM \"%w\" WHERE id = old.rowid;"
+	" END;"
+	"INSERT OR REPLACE INTO \"%w\" %s;",
+	rtree,
+	rtree, table, rtree, newrow,
+	rtree, column, table, rtree, rtree, newrow,
+	rtree, table, rtree,
+	rtree, anyrow);
+    sqlite3_free(newrow);
+    sqlite3_free(anyrow);
+
+    char* err = 0;
+    if(sql == 0 || sqlite3_exec(sqlite3_context_db_handle(context), sql, 0, 0, &err) != SQLITE_OK) {
+	sqlite3_result_error(context, err ? err : "out of memory", -1);
+	sqlite3_free(rtree);
+    } else {
+	sqlite3_result_text(context, rtree, -1, sqlite3_free);
+    }
+    sqlite3_free(err);
+    sqlite3_free(sql);
+}
+
+
+
+/*
+  BSON sequences:  many documents in one blob, for append-only data such
+  as telemetry where a row (and index entries) per document costs too much.
+
+    "BSQ1"  header  doc  doc  doc ...
+
+  The header is itself BSON:
+
+    { n: <count>, paths: [ "ts", ... ], min: { "ts": <v>, ... }, max: { "ts": <v>, ... } }
+
+  min and max are kept for the tracked paths with the bson_compare
+  ordering, so a bucket can be skipped by looking at the header alone.
+  Members are stored as regular BSON; compacted input is expanded.
+*/
+#define BSONEXT_SEQ_MAGIC "BSQ1"
+
+typedef struct {
+    char* path;         // NUL terminated copy
+    bool have;
+    uint8_t lo_t, hi_t;
+    _buf_t lo, hi;      // value bytes of the current min and max
+} _seq_track;
+
+typedef struct {
+    const uint8_t* hdr;
+    uint32_t hdr_len;
+    const uint8_t* members;
+    sqlite3_int64 members_len;
+    sqlite3_int64 n;
+} _seq_t;
+
+static const char* _seq_open(const uint8_t* data, sqlite3_int64 len, _seq_t* s)
+{
+    if(len < 4 || memcmp(data, BSONEXT_SEQ_MAGIC, 4) != 0) return "not a BSON sequence";
+    if(len < 9) return "invalid BSON sequence";
+    s->hdr = data + 4;
+    s->hdr_len = _rd_int32(s->hdr);
+    if(s->hdr_len < 5 || s->hdr_len > len - 4 || s->hdr[s->hdr_len - 1] != 0) return "invalid BSON sequence";
+    s->members = s->hdr + s->hdr_len;
+    s->members_len = len - 4 - s->hdr_len;
+
+    uint8_t t;
+    const uint8_t* vp;
+    uint32_t vlen;
+    s->n = 0;
+    if(_bson_find_key_raw(s->hdr, s->hdr_len, "n", 1, &t, &vp, &vlen)) {
+	_bson_num n = _get_num(t, vp);
+	s->n = n.is_int ? n.i : (sqlite3_int64)n.d;
+    }
+    return 0;
+}
+
+// Next member at *p; 0 at the end, *err set if the bytes are bad:
+static const uint8_t* _seq_next(const _seq_t* s, const uint8_t** p, uint32_t* len, bool* err)
+{
+    const uint8_t* end = s->members + s->members_len;
+    *err = false;
+    if(*p >= end) return 0;
+    if(end - *p < 5 || (*len = _rd_int32(*p)) < 5 || *len > end - *p || (*p)[*len - 1] != 0) {
+	*err = true;
+	return 0;
+    }
+    const uint8_t* doc = *p;
+    *p += *len;
+    return doc;
+}
+
+static void _seq_track_value(_seq_track* tr, const uint8_t* doc, uint32_t len)
+{
+    uint8_t t;
+    const uint8_t* vp;
+    uint32_t vlen;
+    if(!_bson_find_raw(doc, len, tr->path, &t, &vp, &vlen)) return;
+
+    if(!tr->have || _bson_cmp_value(t, vp, vlen, tr->lo_t, tr->lo.data, tr->lo.len) < 0) {
+	tr->lo_t = t;
+	tr->lo.len = 0;
+	_buf_append(&tr->lo, vp, vlen);
+    }
+    if(!tr->have || _bson_cmp_value(t, vp, vlen, tr->hi_t, tr->hi.data, tr->hi.len) > 0) {
+	tr->hi_t = t;
+	tr->hi.len = 0;
+	_buf_append(&tr->hi, vp, vlen);
+    }
+    tr->have = true;
+}
+
+static void _seq_track_free(_seq_track* tr, int ntr)
+{
+    for(int i = 0; i < ntr; i++) {
+	sqlite3_free(tr[i].path);
+	sqlite3_free(tr[i].lo.data);
+	sqlite3_free(tr[i].hi.data);
+    }
+    sqlite3_free(tr);
+}
+
+// Add path to the tracked set unless it's there; false on OOM:
+static bool _seq_track_add(_seq_track** tr, int* ntr, const char* path, int plen)
+{
+    for(int i = 0; i < *ntr; i++) {
+	if(strlen((*tr)[i].path) == plen && memcmp((*tr)[i].path, path, plen) == 0) return true;
+    }
+    _seq_track* nt = sqlite3_realloc64(*tr, (*ntr + 1) * sizeof(_seq_track));
+    if(nt == 0) return false;
+    *tr = nt;
+    memset(&nt[*ntr], 0, sizeof(_seq_track));
+    if((nt[*ntr].path = sqlite3_malloc(plen + 1)) == 0) return false;
+    memcpy(nt[*ntr].path, path, plen);
+    nt[*ntr].path[plen] = 0;
+    (*ntr)++;
+    return true;
+}
+
+// Magic and header; the members follow:
+static void _seq_write_header(_buf_t* out, sqlite3_int64 n, _seq_track* tr, int ntr)
+{
+    char ibuf[16];
+
+    _buf_append(out, BSONEXT_SEQ_MAGIC, 4);
+    sqlite3_int64 hdr = out->len;
+    _buf_int32(out, 0);
+
+    _buf_byte(out, BSON_TYPE_INT64);
+    _buf_append(out, "n", 2);
+    _buf_int32(out, (uint32_t)((uint64_t)n & 0xffffffff));
+    _buf_int32(out, (uint32_t)((uint64_t)n >> 32));
+
+    _buf_byte(out, BSON_TYPE_ARRAY);
+    _buf_append(out, "paths", 6);
+    sqlite3_int64 arr = out->len;
+    _buf_int32(out, 0);
+    for(int i = 0; i < ntr; i++) {
+	int plen = strlen(tr[i].path);
+	_buf_byte(out, BSON_TYPE_UTF8);
+	_buf_append(out, ibuf, sprintf(ibuf, "%d", i) + 1);
+	_buf_int32(out, plen + 1);
+	_buf_append(out, tr[i].path, plen + 1);
+    }
+    _buf_byte(out, 0);
+    _buf_patch_len(out, arr);
+
+    for(int side = 0; side < 2; side++) {
+	_buf_byte(out, BSON_TYPE_DOCUMENT);
+	_buf_append(out, side == 0 ? "min" : "max", 4);
+	sqlite3_int64 sub = out->len;
+	_buf_int32(out, 0);
+	for(int i = 0; i < ntr; i++) {
+	    if(!tr[i].have) continue;
+	    _buf_t* v = side == 0 ? &tr[i].lo : &tr[i].hi;
+	    _buf_elem(out, side == 0 ? tr[i].lo_t : tr[i].hi_t, tr[i].path, strlen(tr[i].path), v->data, v->len);
+	}
+	_buf_byte(out, 0);
+	_buf_patch_len(out, sub);
+    }
+
+    _buf_byte(out, 0);
+    _buf_patch_len(out, hdr);
+}
+
+// Tracked paths and their min/max as recorded in an existing header:
+static bool _seq_read_tracks(const _seq_t* s, _seq_track** tr, int* ntr)
+{
+    uint8_t t, mt;
+    const uint8_t* vp;
+    const uint8_t* mp;
+    uint32_t vlen, mlen;
+    if(!_bson_find_key_raw(s->hdr, s->hdr_len, "paths", 5, &t, &vp, &vlen) || t != BSON_TYPE_ARRAY) return true;
+
+    const uint8_t* end = vp + vlen - 1;
+    bool err;
+    _belem e;
+    for(const uint8_t* q = vp + 4; (q = _next_elem(q, end, &e, &err)) != 0; ) {
+	if(e.t != BSON_TYPE_UTF8 || e.vlen < 5) continue;
+	if(!_seq_track_add(tr, ntr, (const char*)e.v + 4, e.vlen - 5)) return false;
+	_seq_track* k = &(*tr)[*ntr - 1];
+	int plen = e.vlen - 5;
+
+	if(_bson_find_key_raw(s->hdr, s->hdr_len, "min", 3, &t, &mp, &mlen) && t == BSON_TYPE_DOCUMENT
+	   && _bson_find_key_raw(mp, mlen, k->path, plen, &mt, &vp, &vlen)) {
+	    k->lo_t = mt;
+	    _buf_append(&k->lo, vp, vlen);
+	    k->have = true;
+	}
+	if(_bson_find_key_raw(s->hdr, s->hdr_len, "max", 3, &t, &mp, &mlen) && t == BSON_TYPE_DOCUMENT
+	   && _bson_find_key_raw(mp, mlen, k->path, plen, &mt, &vp, &vlen)) {
+	    k->hi_t = mt;
+	    _buf_append(&k->hi, vp, vlen);
+	}
+    }
+    return true;
+}
+
+/*
+  bson_seq_append(seq, doc [, path ...])
+
+  Returns seq with doc added; seq NULL starts a new sequence.  Paths
+  named are tracked from then on; a path new to an existing sequence gets
+  its min/max from the members already there.
+*/
+static void bson_seq_append_func(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+    if(argc < 2) {
+	sqlite3_result_error(context, "bson_seq_append(seq, doc [, path ...])", -1);
+	return;
+    }
+    if( sqlite3_value_type(argv[1]) != SQLITE_BLOB) {
+	sqlite3_result_value(context, argv[0]);
+	return;
+    }
+
+    _seq_t s = { 0 };
+    const char* err = 0;
+    if( sqlite3_value_type(argv[0]) == SQLITE_BLOB) {
+	err = _seq_open(sqlite3_value_blob(argv[0]), sqlite3_value_bytes(argv[0]), &s);
+    } else if( sqlite3_value_type(argv[0]) != SQLITE_NULL) {
+	err = "not a BSON sequence";
+    }
+    if(err != 0) {
+	sqlite3_result_error(context, err, -1);
+	return;
+    }
+
+    bson_t b;
+    uint8_t* owned;
+    if(!_init_bson_expanded(context, &b, argv + 1, &owned)) return;
+
+    _seq_track* tr = 0;
+    int ntr = 0;
+    bool oom = (s.hdr != 0 && !_seq_read_tracks(&s, &tr, &ntr));
+
+    int known = ntr;
+    for(int i = 2; i < argc && !oom; i++) {
+	const char* path = (const char*)sqlite3_value_text(argv[i]);
+	if(path != 0) oom = !_seq_track_add(&tr, &ntr, path, strlen(path));
+    }
+
+    // Paths new to a non-empty sequence: catch up on the existing members.
+    if(ntr > known && s.n > 0 && !oom) {
+	const uint8_t* p = s.members;
+	const uint8_t* doc;
+	uint32_t dlen;
+	bool berr;
+	while((doc = _seq_next(&s, &p, &dlen, &berr)) != 0) {
+	    for(int i = known; i < ntr; i++) _seq_track_value(&tr[i], doc, dlen);
+	}
+	if(berr) err = "invalid BSON sequence";
+    }
+
+    for(int i = 0; i < ntr; i++) _seq_track_value(&tr[i], bson_get_data(&b), b.len);
+
+    _buf_t out = {0};
+    if(err == 0) {
+	_seq_write_header(&out, s.n + 1, tr, ntr);
+	if(s.members_len > 0) _buf_append(&out, s.members, s.members_len);
+	_buf_append(&out, bson_get_data(&b), b.len);
+	for(int i = 0; i < ntr; i++) oom = oom || tr[i].lo.oom || tr[i].hi.oom;
+    }
+
+    if(err != 0) {
+	sqlite3_result_error(context, err, -1);
+	sqlite3_free(out.data);
+    } else if(oom || out.oom) {
+	sqlite3_result_error_nomem(context);
+	sqlite3_free(out.data);
+    } else {
+	sqlite3_result_blob64(context, out.data, out.len, sqlite3_free);
+    }
+
+    _seq_track_free(tr, ntr);
+    sqlite3_free(owned);
+}
+
+/*
+  bson_seq_group(doc [, path ...]) aggregate:  the same result as
+  appending every doc in turn, built in one pass.  This is the fast way
+  to load buckets:
+
+    insert into BUCKETS select ts / 3600, bson_seq_group(doc, 'ts') from STAGING group by 1;
+*/
+typedef struct {
+    _buf_t members;
+    sqlite3_int64 n;
+    _seq_track* tr;
+    int ntr;
+    bool started;
+    bool oom;
+} _seq_group_t;
+
+static void bson_seq_group_step(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+    if(argc < 1) {
+	sqlite3_result_error(context, "bson_seq_group(doc [, path ...])", -1);
+	return;
+    }
+    if( sqlite3_value_type(argv[0]) != SQLITE_BLOB) return;
+
+    _seq_group_t* g = sqlite3_aggregate_context(context, sizeof(_seq_group_t));
+    if(g == 0) {
+	sqlite3_result_error_nomem(context);
+	return;
+    }
+    if(!g->started) {
+	g->started = true;
+	for(int i = 1; i < argc && !g->oom; i++) {
+	    const char* path = (const char*)sqlite3_value_text(argv[i]);
+	    if(path != 0) g->oom = !_seq_track_add(&g->tr, &g->ntr, path, strlen(path));
+	}
+    }
+
+    bson_t b;
+    uint8_t* owned;
+    if(!_init_bson_expanded(context, &b, argv, &owned)) return;
+
+    for(int i = 0; i < g->ntr; i++) _seq_track_value(&g->tr[i], bson_get_data(&b), b.len);
+    _buf_append(&g->members, bson_get_data(&b), b.len);
+    g->n++;
+    sqlite3_free(owned);
+}
+
+static void bson_seq_group_final(sqlite3_context *context)
+{
+    _seq_group_t* g = sqlite3_aggregate_context(context, 0);
+    if(g == 0 || g->n == 0) {
+	if(g != 0) _seq_track_free(g->tr, g->ntr);
+	return;  // NULL, like appending to nothing
+    }
+
+    _buf_t out = {0};
+    _seq_write_header(&out, g->n, g->tr, g->ntr);
+    _buf_append(&out, g->members.data, g->members.len);
+
+    bool oom = g->oom || g->members.oom || out.oom;
+    for(int i = 0; i < g->ntr; i++) oom = oom || g->tr[i].lo.oom || g->tr[i].hi.oom;
+    if(oom) {
+	sqlite3_free(out.data);
+	sqlite3_result_error_nomem(context);
+    } else {
+	sqlite3_result_blob64(context, out.data, out.len, sqlite3_free);
+    }
+
+    sqlite3_free(g->members.data);
+    _seq_track_free(g->tr, g->ntr);
+    memset(g, 0, sizeof(_seq_group_t));
+}
+
+static void bson_seq_count_func(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+    assert( argc==1 );
+
+    if( sqlite3_value_type(argv[0]) != SQLITE_BLOB) return;
+
+    _seq_t s;
+    const char* err = _seq_open(sqlite3_value_blob(argv[0]), sqlite3_value_bytes(argv[0]), &s);
+    if(err != 0) {
+	sqlite3_result_error(context, err, -1);
+    } else {
+	sqlite3_result_int64(context, s.n);
+    }
+}
+
+// bson_seq_min(seq, path) and bson_seq_max(seq, path), as bson_get would return them:
+static void bson_seq_minmax_func(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+    assert( argc==2 );
+
+    if( sqlite3_value_type(argv[0]) != SQLITE_BLOB) return;
+    const char* path = (const char*)sqlite3_value_text(argv[1]);
+    if(path == 0) return;
+
+    _seq_t s;
+    const char* err = _seq_open(sqlite3_value_blob(argv[0]), sqlite3_value_bytes(argv[0]), &s);
+    if(err != 0) {
+	sqlite3_result_error(context, err, -1);
+	return;
+    }
+
+    const char* side = sqlite3_user_data(context);
+    uint8_t t;
+    const uint8_t* mp;
+    uint32_t mlen;
+    if(!_bson_find_key_raw(s.hdr, s.hdr_len, side, 3, &t, &mp, &mlen) || t != BSON_TYPE_DOCUMENT) return;
+
+    // Position an iterator on the element so the usual conversion applies:
+    int plen = strlen(path);
+    const uint8_t* end = mp + mlen - 1;
+    bool berr;
+    _belem e;
+    for(const uint8_t* q = mp + 4, *at = q; (q = _next_elem(q, end, &e, &berr)) != 0; at = q) {
+	if(e.klen == plen && memcmp(e.key, path, plen) == 0) {
+	    bson_iter_t iter;
+	    if(bson_iter_init_from_data_at_offset(&iter, mp, mlen, at - mp, plen)) {
+		extract_and_set_context(context, &iter);
+	    }
+	    return;
+	}
+    }
+}
+
+
+/*
+  bson_seq_each(seq [, path]) table-valued function:  one row per member,
+
+    i      0, 1, 2 ...
+    doc    the member as a BSON blob
+    value  bson_get(doc, path) if a path was given
+*/
+typedef struct {
+    sqlite3_vtab_cursor base;
+    uint8_t* data;          // our own copy of seq
+    _seq_t s;
+    const uint8_t* next;    // next member
+    const uint8_t* doc;     // current member
+    uint32_t doc_len;
+    sqlite3_int64 i;
+    char* path;
+} _seq_cursor;
+
+#define BSON_SEQ_EACH_I      0
+#define BSON_SEQ_EACH_DOC    1
+#define BSON_SEQ_EACH_VALUE  2
+#define BSON_SEQ_EACH_SEQ    3
+#define BSON_SEQ_EACH_PATH   4
+
+static int bson_seq_each_connect(sqlite3* db, void* pAux, int argc, const char* const* argv,
+				 sqlite3_vtab** ppVtab, char** pzErr)
+{
+    int rc = sqlite3_declare_vtab(db, "CREATE TABLE x(i INTEGER, doc BLOB, value, seq HIDDEN, path HIDDEN)");
+    if(rc != SQLITE_OK) return rc;
+    sqlite3_vtab_config(db, SQLITE_VTAB_INNOCUOUS);
+
+    *ppVtab = sqlite3_malloc(sizeof(sqlite3_vtab));
+    if(*ppVtab == 0) return SQLITE_NOMEM;
+    memset(*ppVtab, 0, sizeof(sqlite3_vtab));
+    return SQLITE_OK;
+}
+
+static int bson_seq_each_disconnect(sqlite3_vtab* pVtab)
+{
+    sqlite3_free(pVtab);
+    return SQLITE_OK;
+}
+
+// seq must be given; path may be:
+static int bson_seq_each_best_index(sqlite3_vtab* pVtab, sqlite3_index_info* info)
+{
+    int seq_at = -1, path_at = -1;
+    for(int i = 0; i < info->nConstraint; i++) {
+	const struct sqlite3_index_constraint* c = &info->aConstraint[i];
+	if(c->op != SQLITE_INDEX_CONSTRAINT_EQ) continue;
+	if(c->iColumn == BSON_SEQ_EACH_SEQ) {
+	    if(!c->usable) return SQLITE_CONSTRAINT;
+	    seq_at = i;
+	}
+	if(c->iColumn == BSON_SEQ_EACH_PATH && c->usable) path_at = i;
+    }
+    if(seq_at < 0) return SQLITE_CONSTRAINT;
+
+    info->aConstraintUsage[seq_at].argvIndex = 1;
+    info->aConstraintUsage[seq_at].omit = 1;
+    info->idxNum = 0;
+    if(path_at >= 0) {
+	info->aConstraintUsage[path_at].argvIndex = 2;
+	info->aConstraintUsage[path_at].omit = 1;
+	info->idxNum = 1;
+    }
+    info->estimatedCost = 1000;
+    info->estimatedRows = 1000;
+    return SQLITE_OK;
+}
+
+static int bson_seq_each_open(sqlite3_vtab* pVtab, sqlite3_vtab_cursor** ppCursor)
+{
+    _seq_cursor* c = sqlite3_malloc(sizeof(_seq_cursor));
+    if(c == 0) return SQLITE_NOMEM;
+    memset(c, 0, sizeof(_seq_cursor));
+    *ppCursor = &c->base;
+    return SQLITE_OK;
+}
+
+static int bson_seq_each_close(sqlite3_vtab_cursor* cur)
+{
+    _seq_cursor* c = (_seq_cursor*)cur;
+    sqlite3_free(c->data);
+    sqlite3_free(c->path);
+    sqlite3_free(c);
+    return SQLITE_OK;
+}
+
+static int bson_seq_each_next(sqlite3_vtab_cursor* cur)
+{
+    _seq_cursor* c = (_seq_cursor*)cur;
+    bool err;
+    if(c->doc != 0) c->i++;
+    c->doc = _seq_next(&c->s, &c->next, &c->doc_len, &err);
+    if(err) {
+	sqlite3_free(cur->pVtab->zErrMsg);
+	cur->pVtab->zErrMsg = sqlite3_mprintf("invalid BSON sequence");
+	return SQLITE_ERROR;
+    }
+    return SQLITE_OK;
+}
+
+static int bson_seq_each_filter(sqlite3_vtab_cursor* cur, int idxNum, const char* idxStr,
+				int argc, sqlite3_value** argv)
+{
+    _seq_cursor* c = (_seq_cursor*)cur;
+    sqlite3_free(c->data);
+    sqlite3_free(c->path);
+    c->data = 0;
+    c->path = 0;
+    c->doc = 0;
+    c->next = 0;
+    c->i = 0;
+    memset(&c->s, 0, sizeof(_seq_t));
+
+    if( sqlite3_value_type(argv[0]) != SQLITE_BLOB) return SQLITE_OK;  // no rows
+
+    // The argument is only good until we return, so keep a copy:
+    int len = sqlite3_value_bytes(argv[0]);
+    c->data = sqlite3_malloc64(len > 0 ? len : 1);
+    if(c->data == 0) return SQLITE_NOMEM;
+    memcpy(c->data, sqlite3_value_blob(argv[0]), len);
+
+    const char* err = _seq_open(c->data, len, &c->s);
+    if(err != 0) {
+	sqlite3_free(cur->pVtab->zErrMsg);
+	cur->pVtab->zErrMsg = sqlite3_mprintf("%s", err);
+	return SQLITE_ERROR;
+    }
+
+    if((idxNum & 1) && sqlite3_value_type(argv[1]) != SQLITE_NULL) {
+	c->path = sqlite3_mprintf("%s", sqlite3_value_text(argv[1]));
+	if(c->path == 0) return SQLITE_NOMEM;
+    }
+
+    c->next = c->s.members;
+    return bson_seq_each_next(cur);
+}
+
+static int bson_seq_each_eof(sqlite3_vtab_cursor* cur)
+{
+    return ((_seq_cursor*)cur)->doc == 0;
+}
+
+static int bson_seq_each_column(sqlite3_vtab_cursor* cur, sqlite3_context* context, int col)
+{
+    _seq_cursor* c = (_seq_cursor*)cur;
+    switch(col) {
+    case BSON_SEQ_EACH_I:
+	sqlite3_result_int64(context, c->i);
+	break;
+    case BSON_SEQ_EACH_DOC:
+	sqlite3_result_blob(context, c->doc, c->doc_len, SQLITE_TRANSIENT);
+	break;
+    case BSON_SEQ_EACH_VALUE: {
+	// Same as bson_get(doc, path), wildcards included:
+	bson_t b;
+	if(c->path == 0) break;
+	if(_has_wildcard(c->path)) {
+	    _fanout_doc(context, c->doc, c->doc_len, c->path, false);
+	} else if(bson_init_static(&b, c->doc, c->doc_len)) {
+	    _get_doc(context, &b, c->path);
+	}
+	break;
+    }
+    case BSON_SEQ_EACH_SEQ:
+	sqlite3_result_blob64(context, c->data, c->s.members - c->data + c->s.members_len, SQLITE_TRANSIENT);
+	break;
+    case BSON_SEQ_EACH_PATH:
+	if(c->path != 0) sqlite3_result_text(context, c->path, -1, SQLITE_TRANSIENT);
+	break;
+    }
+    return SQLITE_OK;
+}
+
+static int bson_seq_each_rowid(sqlite3_vtab_cursor* cur, sqlite3_int64* pRowid)
+{
+    *pRowid = ((_seq_cursor*)cur)->i;
+    return SQLITE_OK;
+}
+
+static sqlite3_module bson_seq_each_module = {
+    0,                          // iVersion
+    0,                          // xCreate:  eponymous only
+    bson_seq_each_connect,
+    bson_seq_each_best_index,
+    bson_seq_each_disconnect,
+    0,                          // xDestroy
+    bson_seq_each_open,
+    bson_seq_each_close,
+    bson_seq_each_filter,
+    bson_seq_each_next,
+    bson_seq_each_eof,
+    bson_seq_each_column,
+    bson_seq_each_rowid,        // the rest are read-only/unused
+};
+
+
+
+/*
+  bson_project(bdata, path1, path2, ...) pulls any number of dotpaths out
+  in one walk of the document and returns them as a BSON array in the same
+  order, null for the ones that aren't there.  Each can then be had
+  cheaply with bson_get(p, '0'), bson_get(p, '1') ...
+*/
+#define BSONEXT_PROJECT_MAX 64
+
+typedef struct {
+    const char* path;
+    bool found;
+    uint8_t t;
+    const uint8_t* vp;
+    uint32_t vlen;
+} _proj_t;
+
+// which/offs:  the paths still wanted below this level and how much of each is consumed
+static void _project_walk(const uint8_t* doc, uint32_t len, _proj_t* p, const int* which, const int* offs, int n, int* left)
+{
+    const uint8_t* end = doc + len - 1;
+    bool err;
+    _belem e;
+
+    for(const uint8_t* q = doc + 4; *left > 0 && (q = _next_elem(q, end, &e, &err)) != 0; ) {
+	int sub[BSONEXT_PROJECT_MAX], suboffs[BSONEXT_PROJECT_MAX], nsub = 0;
+	for(int k = 0; k < n; k++) {
+	    _proj_t* w = &p[which[k]];
+	    if(w->found) continue;
+	    const char* seg = w->path + offs[k];
+	    const char* dot = strchr(seg, '.');
+	    int seglen = dot ? dot - seg : strlen(seg);
+	    if(seglen != e.klen || memcmp(seg, e.key, seglen) != 0) continue;
+
+	    if(dot == 0) {
+		w->found = true;
+		w->t = e.t;
+		w->vp = e.v;
+		w->vlen = e.vlen;
+		(*left)--;
+	    } else if(e.t == BSON_TYPE_DOCUMENT || e.t == BSON_TYPE_ARRAY) {
+		sub[nsub] = which[k];
+		suboffs[nsub++] = offs[k] + seglen + 1;
+	    }
+	}
+	if(nsub > 0) _project_walk(e.v, e.vlen, p, sub, suboffs, nsub, left);
+    }
+}
+
+static void bson_project_func(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+    if(argc < 2 || argc - 1 > BSONEXT_PROJECT_MAX) {
+	sqlite3_result_error(context, "bson_project(bdata, path, ...) takes 1 to 64 paths", -1);
+	return;
+    }
+    if( sqlite3_value_type(argv[0]) != SQLITE_BLOB) return;
+
+    int n = argc - 1;
+    _proj_t p[BSONEXT_PROJECT_MAX];
+    int which[BSONEXT_PROJECT_MAX], offs[BSONEXT_PROJECT_MAX];
+    int left = 0;
+    for(int k = 0; k < n; k++) {
+	memset(&p[k], 0, sizeof(_proj_t));
+	p[k].path = (const char*)sqlite3_value_text(argv[k + 1]);
+	if(p[k].path == 0) {
+	    p[k].found = true;   // NULL path, null value
+	    p[k].t = BSON_TYPE_NULL;
+	} else {
+	    which[left] = k;
+	    offs[left++] = 0;
+	}
+    }
+
+    bson_t b;
+    uint8_t* owned;
+    if(!_init_bson_expanded(context, &b, argv, &owned)) return;
+
+    int nwant = left;
+    _project_walk(bson_get_data(&b), b.len, p, which, offs, nwant, &left);
+
+    _buf_t out = {0};
+    char ibuf[16];
+    _buf_int32(&out, 0);
+    for(int k = 0; k < n; k++) {
+	int klen = sprintf(ibuf, "%d", k);
+	if(p[k].found && p[k].vp != 0) {
+	    _buf_elem(&out, p[k].t, ibuf, klen, p[k].vp, p[k].vlen);
+	} else {
+	    _buf_elem(&out, BSON_TYPE_NULL, ibuf, klen, 0, 0);
+	}
+    }
+    _buf_byte(&out, 0);
+    _buf_patch_len(&out, 0);
+
+    if(out.oom) {
+	sqlite3_free(out.data);
+	sqlite3_result_error_nomem(context);
+    } else {
+	sqlite3_result_blob(context, out.data, out.len, sqlite3_free);
+    }
+    sqlite3_free(owned);
+}
+
+
+/*
+  Column pieces for a shadow table from its path specs ('path' or
+  'path TYPE').  Shared by bson_shadow_create and bson_shadow_backfill so
+  the backfill INSERT is rebuilt from the stored paths and never read back
+  as SQL.  Returns a message to sqlite3_free on error.
+*/
+typedef struct {
+    char* decl;     // , "col" TYPE ...
+    char* cols;     // "col", ...
+    char* exprs;    // bson_get(p, 'N'), ...
+    char* args;     // , 'path' ...
+} _shadow_sql;
+
+static void _shadow_sql_free(_shadow_sql* q)
+{
+    sqlite3_free(q->decl);
+    sqlite3_free(q->cols);
+    sqlite3_free(q->exprs);
+    sqlite3_free(q->args);
+}
+
+static char* _shadow_sql_build(sqlite3* db, const char** specs, int n, _shadow_sql* q)
+{
+    sqlite3_str* decl = sqlite3_str_new(db);
+    sqlite3_str* cols = sqlite3_str_new(db);
+    sqlite3_str* exprs = sqlite3_str_new(db);
+    sqlite3_str* args = sqlite3_str_new(db);
+    char* names[BSONEXT_PROJECT_MAX] = { 0 };
+    char* err = 0;
+
+    for(int i = 0; i < n && err == 0; i++) {
+	const char* spec = specs[i];
+	int plen = strcspn(spec, " ");
+	const char* type = spec + plen;
+	while(*type == ' ') type++;
+	for(const char* c = type; *c; c++) {
+	    if(!((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9') || *c == ' ')) {
+		err = sqlite3_mprintf("bson_shadow_create: bad column type");
+	    }
+	}
+	if(plen == 0) err = sqlite3_mprintf("bson_shadow_create: empty path");
+
+	char* name = names[i] = sqlite3_mprintf("%.*s", plen, spec);
+	if(name == 0) {
+	    err = sqlite3_mprintf("out of memory");
+	    break;
+	}
+	for(char* c = name; *c; c++) {
+	    if(!((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9'))) *c = '_';
+	}
+
+	// 'a.b' and 'a_b' would both be a_b (and names ignore case):
+	if(err == 0 && sqlite3_stricmp(name, "base_rowid") == 0) {
+	    err = sqlite3_mprintf("bson_shadow_create: path '%.*s' makes column base_rowid", plen, spec);
+	}
+	for(int k = 0; k < i && err == 0; k++) {
+	    if(sqlite3_stricmp(name, names[k]) == 0) {
+		err = sqlite3_mprintf("bson_shadow_create: paths '%.*s' and '%.*s' both make column %s",
+				      (int)strcspn(specs[k], " "), specs[k], plen, spec, name);
+	    }
+	}
+
+	const char* sep = (i > 0) ? ", " : "";
+	sqlite3_str_appendf(decl, ", \"%w\"%s%s", name, *type ? " " : "", type);
+	sqlite3_str_appendf(cols, "%s\"%w\"", sep, name);
+	sqlite3_str_appendf(exprs, "%sbson_get(p, '%d')", sep, i);
+	sqlite3_str_appendf(args, ", '%.*q'", plen, spec);
+    }
+    for(int i = 0; i < n; i++) sqlite3_free(names[i]);
+
+    q->decl = sqlite3_str_finish(decl);
+    q->cols = sqlite3_str_finish(cols);
+    q->exprs = sqlite3_str_finish(exprs);
+    q->args = sqlite3_str_finish(args);
+    if(err == 0 && (q->decl == 0 || q->cols == 0 || q->exprs == 0 || q->args == 0)) {
+	err = sqlite3_mprintf("out of memory");
+    }
+    return err;
+}
+
+// INSERT of base rows with ?1 < rowid <= ?2 into the shadow table:
+static char* _shadow_fill_sql(const char* shadow, const char* base, const char* column, const _shadow_sql* q)
+{
+    return sqlite3_mprintf(
+	"INSERT OR REPLACE INTO \"%w\"(base_rowid, %s) SELECT r, %s"
+	" FROM (SELECT rowid r, bson_project(\"%w\"%s) p FROM \"%w\" WHERE rowid > ?1 AND rowid <= ?2)",
+	shadow, q->cols, q->exprs, column, q->args, base);
+}
+
+/*
+  bson_shadow_create(base, column, path [, path ...])
+
+  Makes <base>_shadow (base_rowid INTEGER PRIMARY KEY, one column per
+  path) and triggers that keep it in step with base.column using one
+  bson_project per write.  Column names are the paths with anything not
+  alphanumeric turned into '_'; two paths that come out the same are an
+  error.  A path may be followed by a space and a column type
+  ('amt REAL') to give the column that affinity.
+
+  Existing rows are not copied here.  bson_shadow_backfill does that in
+  batches, keeping its place in bson_shadow_meta along with the base
+  table, column and paths.  Returns the name of the shadow table.  Called
+  again for the same base it returns the name if the column and paths are
+  the same as before, and is an error otherwise.  Changing the rowid of a
+  base row is not tracked.
+*/
+static void bson_shadow_create_func(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+    if(argc < 3 || argc - 2 > BSONEXT_PROJECT_MAX) {
+	sqlite3_result_error(context, "bson_shadow_create(base, column, path, ...) takes 1 to 64 paths", -1);
+	return;
+    }
+    for(int i = 0; i < argc; i++) {
+	if( sqlite3_value_type(argv[i]) != SQLITE_TEXT) {
+	    sqlite3_result_error(context, "bson_shadow_create: arguments must be text", -1);
+	    return;
+	}
+    }
+    const char* base = (const char*)sqlite3_value_text(argv[0]);
+    const char* column = (const char*)sqlite3_value_text(argv[1]);
+
+    // The paths as a BSON array for bson_shadow_meta:
+    const char* specs[BSONEXT_PROJECT_MAX];
+    _buf_t paths = {0};
+    char ibuf[16];
+    _buf_int32(&paths, 0);
+    for(int i = 2; i < argc; i++) {
+	specs[i - 2] = (const char*)sqlite3_value_text(argv[i]);
+	_buf_byte(&paths, BSON_TYPE_UTF8);
+	_buf_append(&paths, ibuf, sprintf(ibuf, "%d", i - 2) + 1);
+	_buf_int32(&paths, strlen(specs[i - 2]) + 1);
+	_buf_append(&paths, specs[i - 2], strlen(specs[i - 2]) + 1);
+    }
+    _buf_byte(&paths, 0);
+    _buf_patch_len(&paths, 0);
+
+    sqlite3* db = sqlite3_context_db_handle(context);
+    _shadow_sql q;
+    char* err = _shadow_sql_build(db, specs, argc - 2, &q);
+    char* shadow = sqlite3_mprintf("%s_shadow", base);
+    char* sql = 0;
+
+    if(err == 0 && (shadow == 0 || paths.oom)) err = sqlite3_mprintf("out of memory");
+
+    // Called again for the same base:  fine if it asks for what is there,
+    // an error if not, rather than quietly keeping the old shadow:
+    bool exists = false;
+    if(err == 0 && sqlite3_exec(db,
+	    "CREATE TABLE IF NOT EXISTS bson_shadow_meta ("
+	    "  shadow TEXT PRIMARY KEY, base TEXT, base_column TEXT, paths BLOB, next_rowid INTEGER);",
+	    0, 0, &err) == SQLITE_OK) {
+	sqlite3_stmt* stmt = 0;
+	int rc = sqlite3_prepare_v2(db,
+	    "SELECT base = ?2 AND base_column = ?3 AND paths = ?4 FROM bson_shadow_meta WHERE shadow = ?1"
+	    " UNION ALL SELECT 0 FROM sqlite_master WHERE type = 'table' AND name = ?1 COLLATE NOCASE"
+	    "  AND NOT EXISTS (SELECT 1 FROM bson_shadow_meta WHERE shadow = ?1)", -1, &stmt, 0);
+	if(rc == SQLITE_OK) {
+	    sqlite3_bind_text(stmt, 1, shadow, -1, SQLITE_STATIC);
+	    sqlite3_bind_text(stmt, 2, base, -1, SQLITE_STATIC);
+	    sqlite3_bind_text(stmt, 3, column, -1, SQLITE_STATIC);
+	    sqlite3_bind_blob(stmt, 4, paths.data, paths.len, SQLITE_STATIC);
+	    rc = sqlite3_step(stmt);
+	    if(rc == SQLITE_ROW) {
+		exists = true;
+		if(sqlite3_column_int(stmt, 0) == 0) {
+		    err = sqlite3_mprintf("bson_shadow_create: %s already exists with a different column or paths", shadow);
+		}
+		rc = SQLITE_DONE;
+	    }
+	}
+	sqlite3_finalize(stmt);
+	if(err == 0 && rc != SQLITE_DONE) err = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    }
+
+    if(err == 0 && !exists) {
+	sql = sqlite3_mprintf(
+	    "CREATE TABLE IF NOT EXISTS \"%w\" (base_rowid INTEGER PRIMARY KEY%s);"
+	    "CREATE TRIGGER IF NOT EXISTS \"%w_ins\" AFTER INSERT ON \"%w\" BEGIN"
+	    "  INSERT OR REPLACE INTO \"%w\"(base_rowid, %s) SELECT new.rowid, %s FROM (SELECT bson_project(new.\"%w\"%s) p);"
+	    " END;"
+	    "CREATE TRIGGER IF NOT EXISTS \"%w_upd\" AFTER UPDATE OF \"%w\" ON \"%w\" BEGIN"
+	    "  INSERT OR REPLACE INTO \"%w\"(base_rowid, %s) SELECT new.rowid, %s FROM (SELECT bson_project(new.\"%w\"%s) p);"
+	    " END;"
+	    "CREATE TRIGGER IF NOT EXISTS \"%w_del\" AFTER DELETE ON \"%w\" BEGIN"
+	    "  DELETE FROM \"%w\" WHERE base_rowid = old.rowid;"
+	    " END;",
+	    shadow, q.decl,
+	    shadow, base, shadow, q.cols, q.exprs, column, q.args,
+	    shadow, column, base, shadow, q.cols, q.exprs, column, q.args,
+	    shadow, base, shadow);
+	if(sql == 0) err = sqlite3_mprintf("out of memory");
+    }
+
+    if(err == 0 && !exists && sqlite3_exec(db, sql, 0, 0, &err) == SQLITE_OK) {
+	sqlite3_stmt* stmt = 0;
+	int rc = sqlite3_prepare_v2(db,
+	    "INSERT INTO bson_shadow_meta VALUES (?1, ?2, ?3, ?4, -9223372036854775808)", -1, &stmt, 0);
+	if(rc == SQLITE_OK) {
+	    sqlite3_bind_text(stmt, 1, shadow, -1, SQLITE_STATIC);
+	    sqlite3_bind_text(stmt, 2, base, -1, SQLITE_STATIC);
+	    sqlite3_bind_text(stmt, 3, column, -1, SQLITE_STATIC);
+	    sqlite3_bind_blob(stmt, 4, paths.data, paths.len, SQLITE_STATIC);
+	    rc = sqlite3_step(stmt);
+	}
+	sqlite3_finalize(stmt);
+	if(rc != SQLITE_OK && rc != SQLITE_DONE) err = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    }
+
+    if(err != 0) {
+	sqlite3_result_error(context, err, -1);
+    } else {
+	sqlite3_result_text(context, shadow, -1, SQLITE_TRANSIENT);
+    }
+
+    sqlite3_free(err);
+    sqlite3_free(sql);
+    sqlite3_free(shadow);
+    sqlite3_free(paths.data);
+    _shadow_sql_free(&q);
+}
+
+/*
+  bson_shadow_backfill(shadow [, batch])
+
+  Copies the next batch (default 10000) of base rows, by rowid, into the
+  shadow table and returns how many it did; 0 means caught up.  Call it
+  repeatedly, each call in its own transaction, so the work is committed
+  as it goes and readers aren't held off for the whole table.
+*/
+static void bson_shadow_backfill_func(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+    assert( argc==1 || argc==2 );
+
+    if( sqlite3_value_type(argv[0]) != SQLITE_TEXT) return;
+    const char* shadow = (const char*)sqlite3_value_text(argv[0]);
+    sqlite3_int64 batch = (argc > 1) ? sqlite3_value_int64(argv[1]) : 10000;
+    if(batch <= 0) batch = 10000;
+
+    sqlite3* db = sqlite3_context_db_handle(context);
+    sqlite3_stmt* stmt = 0;
+    char* base = 0;
+    char* column = 0;
+    char* fill = 0;
+    const char* err = 0;
+    sqlite3_int64 from = 0, to = 0, n = 0;
+
+    int rc = sqlite3_prepare_v2(db,
+	"SELECT base, base_column, paths, next_rowid FROM bson_shadow_meta WHERE shadow = ?1", -1, &stmt, 0);
+    if(rc == SQLITE_OK) {
+	sqlite3_bind_text(stmt, 1, shadow, -1, SQLITE_STATIC);
+	if((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+	    rc = SQLITE_OK;
+	    base = sqlite3_mprintf("%s", sqlite3_column_text(stmt, 0));
+	    column = sqlite3_mprintf("%s", sqlite3_column_text(stmt, 1));
+	    from = sqlite3_column_int64(stmt, 3);
+
+	    // Rebuild the INSERT from the paths; only strings are taken:
+	    const uint8_t* pdata = sqlite3_column_blob(stmt, 2);
+	    int plen = sqlite3_column_bytes(stmt, 2);
+	    const char* specs[BSONEXT_PROJECT_MAX];
+	    int nspecs = 0;
+	    _belem e;
+	    bool berr = !_looks_like_bson(pdata, plen);
+	    for(const uint8_t* p = berr ? 0 : pdata + 4; p != 0 && (p = _next_elem(p, pdata + plen - 1, &e, &berr)) != 0; ) {
+		if(e.t != BSON_TYPE_UTF8 || nspecs == BSONEXT_PROJECT_MAX || e.v[e.vlen - 1] != 0) {
+		    berr = true;
+		    break;
+		}
+		specs[nspecs++] = (const char*)e.v + 4;
+	    }
+	    if(berr || nspecs == 0) {
+		err = "bson_shadow_backfill: bad paths in bson_shadow_meta";
+	    } else if(base && column) {
+		_shadow_sql q;
+		char* qerr = _shadow_sql_build(db, specs, nspecs, &q);
+		if(qerr == 0) fill = _shadow_fill_sql(shadow, base, column, &q);
+		_shadow_sql_free(&q);
+		if(qerr != 0) {
+		    sqlite3_free(qerr);
+		    err = "bson_shadow_backfill: bad paths in bson_shadow_meta";
+		}
+	    }
+	    if(err == 0 && (base == 0 || column == 0 || fill == 0)) rc = SQLITE_NOMEM;
+	} else if(rc == SQLITE_DONE) {
+	    err = "bson_shadow_backfill: no such shadow table";
+	}
+    }
+    sqlite3_finalize(stmt);
+    stmt = 0;
+
+    // Where does this batch end?
+    if(rc == SQLITE_OK && err == 0) {
+	char* sql = sqlite3_mprintf(
+	    "SELECT count(*), max(r) FROM (SELECT rowid r FROM \"%w\" WHERE rowid > ?1 ORDER BY rowid LIMIT ?2)", base);
+	rc = sql ? sqlite3_prepare_v2(db, sql, -1, &stmt, 0) : SQLITE_NOMEM;
+	sqlite3_free(sql);
+	if(rc == SQLITE_OK) {
+	    sqlite3_bind_int64(stmt, 1, from);
+	    sqlite3_bind_int64(stmt, 2, batch);
+	    if((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		n = sqlite3_column_int64(stmt, 0);
+		to = sqlite3_column_int64(stmt, 1);
+		rc = SQLITE_OK;
+	    }
+	}
+	sqlite3_finalize(stmt);
+	stmt = 0;
+    }
+
+    if(rc == SQLITE_OK && err == 0 && n > 0) {
+	rc = sqlite3_prepare_v2(db, fill, -1, &stmt, 0);
+	if(rc == SQLITE_OK) {
+	    sqlite3_bind_int64(stmt, 1, from);
+	    sqlite3_bind_int64(stmt, 2, to);
+	    rc = sqlite3_step(stmt);
+	    if(rc == SQLITE_DONE) rc = SQLITE_OK;
+	}
+	sqlite3_finalize(stmt);
+	stmt = 0;
+
+	if(rc == SQLITE_OK) {
+	    rc = sqlite3_prepare_v2(db, "UPDATE bson_shadow_meta SET next_rowid = ?1 WHERE shadow = ?2", -1, &stmt, 0);
+	    if(rc == SQLITE_OK) {
+		sqlite3_bind_int64(stmt, 1, to);
+		sqlite3_bind_text(stmt, 2, shadow, -1, SQLITE_STATIC);
+		rc = sqlite3_step(stmt);
+		if(rc == SQLITE_DONE) rc = SQLITE_OK;
+	    }
+	    sqlite3_finalize(stmt);
+	}
+    }
+
+    if(err != 0) {
+	sqlite3_result_error(context, err, -1);
+    } else if(rc != SQLITE_OK) {
+	sqlite3_result_error(context, sqlite3_errmsg(db), -1);
+    } else {
+	sqlite3_result_int64(context, n);
+    }
+    sqlite3_free(base);
+    sqlite3_free(column);
+    sqlite3_free(fill);
+}
+
+
+
+/*
+  bson_get_all(bdata, dotpath) table-valued function:  one row per match
+  of a dotpath that may contain "*" / "$[]" segments.  Columns are the
+  concrete path of the match, its value as bson_get would return it, and
+  its type name as in bson_type.  Matches are found as rows are asked
+  for, so a LIMIT stops the walk early.  Compact BSON must go through
+  bson_expand first.
+*/
+#define BSON_GET_ALL_PATH     0
+#define BSON_GET_ALL_VALUE    1
+#define BSON_GET_ALL_TYPE     2
+#define BSON_GET_ALL_BSON     3
+#define BSON_GET_ALL_DOTPATH  4
+
+typedef struct {
+    sqlite3_vtab_cursor base;
+    uint8_t* data;          // private copy of the document
+    char* dotpath;
+    _fan_t f;
+    bool eof;
+    sqlite3_int64 rowid;
+} _get_all_cursor;
+
+static int bson_get_all_connect(sqlite3* db, void* pAux, int argc, const char* const* argv,
+				sqlite3_vtab** ppVtab, char** pzErr)
+{
+    int rc = sqlite3_declare_vtab(db, "CREATE TABLE x(path TEXT, value, type TEXT, bson HIDDEN, dotpath HIDDEN)");
+    if(rc != SQLITE_OK) return rc;
+    sqlite3_vtab_config(db, SQLITE_VTAB_INNOCUOUS);
+
+    *ppVtab = sqlite3_malloc(sizeof(sqlite3_vtab));
+    if(*ppVtab == 0) return SQLITE_NOMEM;
+    memset(*ppVtab, 0, sizeof(sqlite3_vtab));
+    return SQLITE_OK;
+}
+
+static int bson_get_all_disconnect(sqlite3_vtab* pVtab)
+{
+    sqlite3_free(pVtab);
+    return SQLITE_OK;
+}
+
+// Both bson and dotpath must be given:
+static int bson_get_all_best_index(sqlite3_vtab* pVtab, sqlite3_index_info* info)
+{
+    int at[2] = { -1, -1 };
+    for(int i = 0; i < info->nConstraint; i++) {
+	const struct sqlite3_index_constraint* c = &info->aConstraint[i];
+	if(c->op != SQLITE_INDEX_CONSTRAINT_EQ) continue;
+	if(c->iColumn == BSON_GET_ALL_BSON || c->iColumn == BSON_GET_ALL_DOTPATH) {
+	    if(!c->usable) return SQLITE_CONSTRAINT;
+	    at[c->iColumn - BSON_GET_ALL_BSON] = i;
+	}
+    }
+    if(at[0] < 0 || at[1] < 0) return SQLITE_CONSTRAINT;
+
+    for(int k = 0; k < 2; k++) {
+	info->aConstraintUsage[at[k]].argvIndex = k + 1;
+	info->aConstraintUsage[at[k]].omit = 1;
+    }
+    info->estimatedCost = 100;
+    info->estimatedRows = 100;
+    return SQLITE_OK;
+}
+
+static int bson_get_all_open(sqlite3_vtab* pVtab, sqlite3_vtab_cursor** ppCursor)
+{
+    _get_all_cursor* c = sqlite3_malloc(sizeof(_get_all_cursor));
+    if(c == 0) return SQLITE_NOMEM;
+    memset(c, 0, sizeof(_get_all_cursor));
+    c->eof = true;
+    *ppCursor = &c->base;
+    return SQLITE_OK;
+}
+
+static void _get_all_reset(_get_all_cursor* c)
+{
+    sqlite3_free(c->data);
+    sqlite3_free(c->dotpath);
+    sqlite3_free(c->f.path.data);
+    c->data = 0;
+    c->dotpath = 0;
+    memset(&c->f, 0, sizeof(_fan_t));
+    c->eof = true;
+    c->rowid = 0;
+}
+
+static int bson_get_all_close(sqlite3_vtab_cursor* cur)
+{
+    _get_all_reset((_get_all_cursor*)cur);
+    sqlite3_free(cur);
+    return SQLITE_OK;
+}
+
+static int bson_get_all_next(sqlite3_vtab_cursor* cur)
+{
+    _get_all_cursor* c = (_get_all_cursor*)cur;
+    c->eof = !_fan_next(&c->f);
+    c->rowid++;
+    if(c->f.err || c->f.path.oom) {
+	sqlite3_free(cur->pVtab->zErrMsg);
+	cur->pVtab->zErrMsg = sqlite3_mprintf(c->f.err ? "invalid BSON" : "out of memory");
+	return SQLITE_ERROR;
+    }
+    return SQLITE_OK;
+}
+
+static int bson_get_all_filter(sqlite3_vtab_cursor* cur, int idxNum, const char* idxStr,
+			       int argc, sqlite3_value** argv)
+{
+    _get_all_cursor* c = (_get_all_cursor*)cur;
+    _get_all_reset(c);
+
+    if( sqlite3_value_type(argv[0]) != SQLITE_BLOB) return SQLITE_OK;  // no rows
+    if( sqlite3_value_type(argv[1]) == SQLITE_NULL) return SQLITE_OK;
+
+    const uint8_t* data = sqlite3_value_blob(argv[0]);
+    int len = sqlite3_value_bytes(argv[0]);
+    const char* err = 0;
+    if(_is_compact(data, len)) {
+	err = "bson_get_all: compact BSON; use bson_expand()";
+    } else if(!_looks_like_bson(data, len)) {
+	err = "invalid BSON";
+    }
+    if(err != 0) {
+	sqlite3_free(cur->pVtab->zErrMsg);
+	cur->pVtab->zErrMsg = sqlite3_mprintf("%s", err);
+	return SQLITE_ERROR;
+    }
+
+    // The arguments are only good until we return, so keep copies:
+    c->data = sqlite3_malloc64(len);
+    c->dotpath = sqlite3_mprintf("%s", sqlite3_value_text(argv[1]));
+    if(c->data == 0 || c->dotpath == 0) return SQLITE_NOMEM;
+    memcpy(c->data, data, len);
+
+    if(!_fan_init(&c->f, c->dotpath, c->data, len)) {
+	sqlite3_free(cur->pVtab->zErrMsg);
+	cur->pVtab->zErrMsg = sqlite3_mprintf("dotpath has too many segments");
+	return SQLITE_ERROR;
+    }
+    c->rowid = -1;
+    return bson_get_all_next(cur);
+}
+
+static int bson_get_all_eof(sqlite3_vtab_cursor* cur)
+{
+    return ((_get_all_cursor*)cur)->eof;
+}
+
+static int bson_get_all_column(sqlite3_vtab_cursor* cur, sqlite3_context* context, int col)
+{
+    _get_all_cursor* c = (_get_all_cursor*)cur;
+    switch(col) {
+    case BSON_GET_ALL_PATH:
+	sqlite3_result_text(context, (const char*)c->f.path.data, c->f.path.len, SQLITE_TRANSIENT);
+	break;
+    case BSON_GET_ALL_VALUE:
+	_fan_result(context, &c->f);
+	break;
+    case BSON_GET_ALL_TYPE:
+	sqlite3_result_text(context, _type_name(c->f.e.t), -1, SQLITE_STATIC);
+	break;
+    case BSON_GET_ALL_BSON:
+	sqlite3_result_blob(context, c->data, c->f.lv[0].len, SQLITE_TRANSIENT);
+	break;
+    case BSON_GET_ALL_DOTPATH:
+	sqlite3_result_text(context, c->dotpath, -1, SQLITE_TRANSIENT);
+	break;
+    }
+    return SQLITE_OK;
+}
+
+static int bson_get_all_rowid(sqlite3_vtab_cursor* cur, sqlite3_int64* pRowid)
+{
+    *pRowid = ((_get_all_cursor*)cur)->rowid;
+    return SQLITE_OK;
+}
+
+static sqlite3_module bson_get_all_module = {
+    0,                          // iVersion
+    0,                          // xCreate:  eponymous only
+    bson_get_all_connect,
+    bson_get_all_best_index,
+    bson_get_all_disconnect,
+    0,                          // xDestroy
+    bson_get_all_open,
+    bson_get_all_close,
+    bson_get_all_filter,
+    bson_get_all_next,
+    bson_get_all_eof,
+    bson_get_all_column,
+    bson_get_all_rowid,         // the rest are read-only/unused
+};
+
+
+/*
+  bson_from_json_lines(filename) table-valued function:  streams a file of
+  newline delimited EJSON, one document per line, as rows of (line, doc).
+  Blank lines are skipped and a trailing \r is ignored.  A line that does
+  not parse stops the scan with an error naming the line.  The file is read
+  in large chunks through one buffer that is reused for every line:
+
+    insert into MYDATA (bson_column) select doc from bson_from_json_lines('/data/in.jsonl');
+
+  It reads files, so it cannot be used from triggers, views or schema.
+*/
+#define BSON_FROM_JSON_LINES_LINE      0
+#define BSON_FROM_JSON_LINES_DOC       1
+#define BSON_FROM_JSON_LINES_FILENAME  2
+
+#define BSONEXT_LINES_BUFSIZE (1 << 16)
+
+typedef struct {
+    sqlite3_vtab_cursor base;
+    FILE* f;
+    char* filename;
+    char* buf;              // read buffer; unconsumed text is [pos, len)
+    size_t cap, len, pos;
+    bool file_eof;
+    sqlite3_int64 line;     // line number of the current document
+    bson_t b;
+    bool have;              // b holds the current document
+    bool eof;
+} _lines_cursor;
+
+static int bson_from_json_lines_connect(sqlite3* db, void* pAux, int argc, const char* const* argv,
+					sqlite3_vtab** ppVtab, char** pzErr)
+{
+    int rc = sqlite3_declare_vtab(db, "CREATE TABLE x(line INTEGER, doc BLOB, filename HIDDEN)");
+    if(rc != SQLITE_OK) return rc;
+    sqlite3_vtab_config(db, SQLITE_VTAB_DIRECTONLY);
+
+    *ppVtab = sqlite3_malloc(sizeof(sqlite3_vtab));
+    if(*ppVtab == 0) return SQLITE_NOMEM;
+    memset(*ppVtab, 0, sizeof(sqlite3_vtab));
+    return SQLITE_OK;
+}
+
+static int bson_from_json_lines_disconnect(sqlite3_vtab* pVtab)
+{
+    sqlite3_free(pVtab);
+    return SQLITE_OK;
+}
+
+// filename must be given:
+static int bson_from_json_lines_best_index(sqlite3_vtab* pVtab, sqlite3_index_info* info)
+{
+    for(int i = 0; i < info->nConstraint; i++) {
+	const struct sqlite3_index_constraint* c = &info->aConstraint[i];
+	if(c->op == SQLITE_INDEX_CONSTRAINT_EQ && c->iColumn == BSON_FROM_JSON_LINES_FILENAME) {
+	    if(!c->usable) return SQLITE_CONSTRAINT;
+	    info->aConstraintUsage[i].argvIndex = 1;
+	    info->aConstraintUsage[i].omit = 1;
+	    info->estimatedCost = 1000000;
+	    info->estimatedRows = 1000000;
+	    return SQLITE_OK;
+	}
+    }
+    return SQLITE_CONSTRAINT;
+}
+
+static int bson_from_json_lines_open(sqlite3_vtab* pVtab, sqlite3_vtab_cursor** ppCursor)
+{
+    _lines_cursor* c = sqlite3_malloc(sizeof(_lines_cursor));
+    if(c == 0) return SQLITE_NOMEM;
+    memset(c, 0, sizeof(_lines_cursor));
+    c->eof = true;
+    *ppCursor = &c->base;
+    return SQLITE_OK;
+}
+
+static void _lines_reset(_lines_cursor* c)
+{
+    if(c->f != 0) fclose(c->f);
+    if(c->have) bson_destroy(&c->b);
+    sqlite3_free(c->filename);
+    c->f = 0;
+    c->have = false;
+    c->filename = 0;
+    c->len = c->pos = 0;
+    c->file_eof = false;
+    c->line = 0;
+    c->eof = true;
+}
+
+static int bson_from_json_lines_close(sqlite3_vtab_cursor* cur)
+{
+    _lines_cursor* c = (_lines_cursor*)cur;
+    _lines_reset(c);
+    sqlite3_free(c->buf);
+    sqlite3_free(c);
+    return SQLITE_OK;
+}
+
+// Next line, without its \n, or 0 at end of file; -1 on read error:
+static int _lines_read(_lines_cursor* c, const char** start, size_t* n)
+{
+    for(;;) {
+	char* nl = memchr(c->buf + c->pos, '\n', c->len - c->pos);
+	if(nl != 0) {
+	    *start = c->buf + c->pos;
+	    *n = nl - *start;
+	    c->pos = nl + 1 - c->buf;
+	    return 1;
+	}
+	if(c->file_eof) {
+	    if(c->pos == c->len) return 0;
+	    *start = c->buf + c->pos;
+	    *n = c->len - c->pos;
+	    c->pos = c->len;
+	    return 1;
+	}
+
+	// Keep the partial line, make room after it and read more:
+	memmove(c->buf, c->buf + c->pos, c->len - c->pos);
+	c->len -= c->pos;
+	c->pos = 0;
+	if(c->len == c->cap) {
+	    size_t ncap = c->cap ? c->cap * 2 : BSONEXT_LINES_BUFSIZE;
+	    char* nbuf = sqlite3_realloc64(c->buf, ncap);
+	    if(nbuf == 0) return -1;
+	    c->buf = nbuf;
+	    c->cap = ncap;
+	}
+	size_t got = fread(c->buf + c->len, 1, c->cap - c->len, c->f);
+	if(got == 0) {
+	    if(ferror(c->f)) return -1;
+	    c->file_eof = true;
+	}
+	c->len += got;
+    }
+}
+
+static int bson_from_json_lines_next(sqlite3_vtab_cursor* cur)
+{
+    _lines_cursor* c = (_lines_cursor*)cur;
+    if(c->have) {
+	bson_destroy(&c->b);
+	c->have = false;
+    }
+
+    for(;;) {
+	const char* s;
+	size_t n;
+	int rc = _lines_read(c, &s, &n);
+	if(rc <= 0) {
+	    c->eof = true;
+	    if(rc == 0) return SQLITE_OK;
+	    sqlite3_free(cur->pVtab->zErrMsg);
+	    cur->pVtab->zErrMsg = sqlite3_mprintf("bson_from_json_lines: cannot read %s", c->filename);
+	    return SQLITE_ERROR;
+	}
+	c->line++;
+
+	if(n > 0 && s[n - 1] == '\r') n--;
+	size_t k = 0;
+	while(k < n && (s[k] == ' ' || s[k] == '\t')) k++;
+	if(k == n) continue;
+
+	bson_error_t err;
+	if(!bson_init_from_json(&c->b, s, n, &err)) {
+	    // libbson has already destroyed c->b; have stays false so
+	    // _lines_reset won't destroy it a second time.
+	    c->eof = true;
+	    sqlite3_free(cur->pVtab->zErrMsg);
+	    cur->pVtab->zErrMsg = sqlite3_mprintf("bson_from_json_lines: %s line %lld: cannot parse EJSON",
+						  c->filename, c->line);
+	    return SQLITE_ERROR;
+	}
+	c->have = true;
+	c->eof = false;
+	return SQLITE_OK;
+    }
+}
+
+static int bson_from_json_lines_filter(sqlite3_vtab_cursor* cur, int idxNum, const char* idxStr,
+				       int argc, sqlite3_value** argv)
+{
+    _lines_cursor* c = (_lines_cursor*)cur;
+    _lines_reset(c);
+
+    if( sqlite3_value_type(argv[0]) != SQLITE_TEXT) return SQLITE_OK;  // no rows
+
+    c->filename = sqlite3_mprintf("%s", sqlite3_value_text(argv[0]));
+    if(c->filename == 0) return SQLITE_NOMEM;
+    c->f = fopen(c->filename, "rb");
+    if(c->f == 0) {
+	sqlite3_free(cur->pVtab->zErrMsg);
+	cur->pVtab->zErrMsg = sqlite3_mprintf("bson_from_json_lines: cannot open %s", c->filename);
+	return SQLITE_ERROR;
+    }
+
+    // _lines_read scans the buffer before it reads, so it must exist;
+    // kept across filters and freed in close:
+    if(c->buf == 0) {
+	c->buf = sqlite3_malloc64(BSONEXT_LINES_BUFSIZE);
+	if(c->buf == 0) return SQLITE_NOMEM;
+	c->cap = BSONEXT_LINES_BUFSIZE;
+    }
+    return bson_from_json_lines_next(cur);
+}
+
+static int bson_from_json_lines_eof(sqlite3_vtab_cursor* cur)
+{
+    return ((_lines_cursor*)cur)->eof;
+}
+
+static int bson_from_json_lines_column(sqlite3_vtab_cursor* cur, sqlite3_context* context, int col)
+{
+    _lines_cursor* c = (_lines_cursor*)cur;
+    switch(col) {
+    case BSON_FROM_JSON_LINES_LINE:
+	sqlite3_result_int64(context, c->line);
+	break;
+    case BSON_FROM_JSON_LINES_DOC:
+	sqlite3_result_blob(context, bson_get_data(&c->b), c->b.len, SQLITE_TRANSIENT);
+	break;
+    case BSON_FROM_JSON_LINES_FILENAME:
+	sqlite3_result_text(context, c->filename, -1, SQLITE_TRANSIENT);
+	break;
+    }
+    return SQLITE_OK;
+}
+
+static int bson_from_json_lines_rowid(sqlite3_vtab_cursor* cur, sqlite3_int64* pRowid)
+{
+    *pRowid = ((_lines_cursor*)cur)->line;
+    return SQLITE_OK;
+}
+
+static sqlite3_module bson_from_json_lines_module = {
+    0,                          // iVersion
+    0,                          // xCreate:  eponymous only
+    bson_from_json_lines_connect,
+    bson_from_json_lines_best_index,
+    bson_from_json_lines_disconnect,
+    0,                          // xDestroy
+    bson_from_json_lines_open,
+    bson_from_json_lines_close,
+    bson_from_json_lines_filter,
+    bson_from_json_lines_next,
+    bson_from_json_lines_eof,
+    bson_from_json_lines_column,
+    bson_from_json_lines_rowid, // the rest are read-only/unused
+};
+
+/*
+  bson_to_json_chunks(bdata [, chunk_size]) table-valued function:  the
+  JSON of bson_to_json(bdata) in pieces of chunk_size bytes (default
+  BSON_JSON_CHUNK_DEFAULT; the last one may be shorter), rendered as rows
+  are asked for.  The input is kept (sqlite3_value_dup) for the life of
+  the cursor, but the JSON is never held as one string:  memory is the
+  document plus one chunk, so a client can write out the JSON of a very
+  large document piece by piece:
+
+    select chunk from bson_to_json_chunks((select bdata from MYDATA where id = 7), 1048576) order by i;
+
+  Chunks end on a UTF-8 character boundary so each is valid TEXT; that
+  can make one a few bytes short.  Compact BSON must go through
+  bson_expand first.
+*/
+#define BSON_JSON_CHUNK_I           0
+#define BSON_JSON_CHUNK_CHUNK       1
+#define BSON_JSON_CHUNK_BSON        2
+#define BSON_JSON_CHUNK_SIZE        3
+
+#define BSON_JSON_CHUNK_DEFAULT     65536
+#define BSON_JSON_CHUNK_MIN         16
+
+typedef struct {
+    sqlite3_vtab_cursor base;
+    sqlite3_value* bson;    // the argument, kept while we walk it
+    sqlite3_int64 chunk_size;
+    _jwalk w;
+    _buf_t out;             // current chunk
+    bool eof;
+    sqlite3_int64 i;
+} _json_chunks_cursor;
+
+static int bson_to_json_chunks_connect(sqlite3* db, void* pAux, int argc, const char* const* argv,
+				       sqlite3_vtab** ppVtab, char** pzErr)
+{
+    int rc = sqlite3_declare_vtab(db, "CREATE TABLE x(i INTEGER, chunk TEXT, bson HIDDEN, chunk_size HIDDEN)");
+    if(rc != SQLITE_OK) return rc;
+    sqlite3_vtab_config(db, SQLITE_VTAB_INNOCUOUS);
+
+    *ppVtab = sqlite3_malloc(sizeof(sqlite3_vtab));
+    if(*ppVtab == 0) return SQLITE_NOMEM;
+    memset(*ppVtab, 0, sizeof(sqlite3_vtab));
+    return SQLITE_OK;
+}
+
+static int bson_to_json_chunks_disconnect(sqlite3_vtab* pVtab)
+{
+    sqlite3_free(pVtab);
+    return SQLITE_OK;
+}
+
+// bson must be given; chunk_size is optional.  idxNum 1 means it was:
+static int bson_to_json_chunks_best_index(sqlite3_vtab* pVtab, sqlite3_index_info* info)
+{
+    int at[2] = { -1, -1 };
+    for(int i = 0; i < info->nConstraint; i++) {
+	const struct sqlite3_index_constraint* c = &info->aConstraint[i];
+	if(c->op != SQLITE_INDEX_CONSTRAINT_EQ) continue;
+	if(c->iColumn == BSON_JSON_CHUNK_BSON || c->iColumn == BSON_JSON_CHUNK_SIZE) {
+	    if(!c->usable) return SQLITE_CONSTRAINT;
+	    at[c->iColumn - BSON_JSON_CHUNK_BSON] = i;
+	}
+    }
+    if(at[0] < 0) return SQLITE_CONSTRAINT;
+
+    info->aConstraintUsage[at[0]].argvIndex = 1;
+    info->aConstraintUsage[at[0]].omit = 1;
+    if(at[1] >= 0) {
+	info->aConstraintUsage[at[1]].argvIndex = 2;
+	info->aConstraintUsage[at[1]].omit = 1;
+	info->idxNum = 1;
+    }
+    info->estimatedCost = 100;
+    info->estimatedRows = 100;
+    return SQLITE_OK;
+}
+
+static int bson_to_json_chunks_open(sqlite3_vtab* pVtab, sqlite3_vtab_cursor** ppCursor)
+{
+    _json_chunks_cursor* c = sqlite3_malloc(sizeof(_json_chunks_cursor));
+    if(c == 0) return SQLITE_NOMEM;
+    memset(c, 0, sizeof(_json_chunks_cursor));
+    c->eof = true;
+    *ppCursor = &c->base;
+    return SQLITE_OK;
+}
+
+static void _json_chunks_reset(_json_chunks_cursor* c)
+{
+    _jw_free(&c->w);
+    memset(&c->w, 0, sizeof(_jwalk));
+    sqlite3_value_free(c->bson);
+    sqlite3_free(c->out.data);
+    c->bson = 0;
+    memset(&c->out, 0, sizeof(_buf_t));
+    c->eof = true;
+    c->i = 0;
+}
+
+static int bson_to_json_chunks_close(sqlite3_vtab_cursor* cur)
+{
+    _json_chunks_reset((_json_chunks_cursor*)cur);
+    sqlite3_free(cur);
+    return SQLITE_OK;
+}
+
+static int bson_to_json_chunks_next(sqlite3_vtab_cursor* cur)
+{
+    _json_chunks_cursor* c = (_json_chunks_cursor*)cur;
+    c->i++;
+    if(!_jw_more(&c->w)) {
+	c->eof = true;
+	return SQLITE_OK;
+    }
+    c->out.len = 0;
+    if(!_jw_fill(&c->w, &c->out, c->chunk_size)) {
+	sqlite3_free(cur->pVtab->zErrMsg);
+	cur->pVtab->zErrMsg = sqlite3_mprintf(c->out.oom || c->w.tok.oom ? "out of memory" : "invalid BSON");
+	return SQLITE_ERROR;
+    }
+    c->eof = false;
+    return SQLITE_OK;
+}
+
+static int bson_to_json_chunks_filter(sqlite3_vtab_cursor* cur, int idxNum, const char* idxStr,
+				      int argc, sqlite3_value** argv)
+{
+    _json_chunks_cursor* c = (_json_chunks_cursor*)cur;
+    _json_chunks_reset(c);
+
+    if( sqlite3_value_type(argv[0]) != SQLITE_BLOB) return SQLITE_OK;  // no rows
+
+    c->chunk_size = BSON_JSON_CHUNK_DEFAULT;
+    if(idxNum == 1 && sqlite3_value_type(argv[1]) != SQLITE_NULL) {
+	c->chunk_size = sqlite3_value_int64(argv[1]);
+    }
+    if(c->chunk_size < BSON_JSON_CHUNK_MIN) c->chunk_size = BSON_JSON_CHUNK_MIN;
+
+    const uint8_t* data = sqlite3_value_blob(argv[0]);
+    int len = sqlite3_value_bytes(argv[0]);
+    const char* err = 0;
+    if(_is_compact(data, len)) {
+	err = "bson_to_json_chunks: compact BSON; use bson_expand()";
+    } else if(!_looks_like_bson(data, len)) {
+	err = "invalid BSON";
+    }
+    if(err != 0) {
+	sqlite3_free(cur->pVtab->zErrMsg);
+	cur->pVtab->zErrMsg = sqlite3_mprintf("%s", err);
+	return SQLITE_ERROR;
+    }
+
+    // The argument is only good until we return:
+    c->bson = sqlite3_value_dup(argv[0]);
+    if(c->bson == 0) return SQLITE_NOMEM;
+
+    _jw_init(&c->w, sqlite3_value_blob(c->bson), len);
+    c->i = -1;
+    return bson_to_json_chunks_next(cur);
+}
+
+static int bson_to_json_chunks_eof(sqlite3_vtab_cursor* cur)
+{
+    return ((_json_chunks_cursor*)cur)->eof;
+}
+
+static int bson_to_json_chunks_column(sqlite3_vtab_cursor* cur, sqlite3_context* context, int col)
+{
+    _json_chunks_cursor* c = (_json_chunks_cursor*)cur;
+    switch(col) {
+    case BSON_JSON_CHUNK_I:
+	sqlite3_result_int64(context, c->i);
+	break;
+    case BSON_JSON_CHUNK_CHUNK:
+	sqlite3_result_text64(context, (const char*)c->out.data, c->out.len, SQLITE_TRANSIENT, SQLITE_UTF8);
+	break;
+    case BSON_JSON_CHUNK_BSON:
+	sqlite3_result_value(context, c->bson);
+	break;
+    case BSON_JSON_CHUNK_SIZE:
+	sqlite3_result_int64(context, c->chunk_size);
+	break;
+    }
+    return SQLITE_OK;
+}
+
+static int bson_to_json_chunks_rowid(sqlite3_vtab_cursor* cur, sqlite3_int64* pRowid)
+{
+    *pRowid = ((_json_chunks_cursor*)cur)->i;
+    return SQLITE_OK;
+}
+
+static sqlite3_module bson_to_json_chunks_module = {
+    0,                          // iVersion
+    0,                          // xCreate:  eponymous only
+    bson_to_json_chunks_connect,
+    bson_to_json_chunks_best_index,
+    bson_to_json_chunks_disconnect,
+    0,                          // xDestroy
+    bson_to_json_chunks_open,
+    bson_to_json_chunks_close,
+    bson_to_json_chunks_filter,
+    bson_to_json_chunks_next,
+    bson_to_json_chunks_eof,
+    bson_to_json_chunks_column,
+    bson_to_json_chunks_rowid,  // the rest are read-only/unused
+};
+
+
+#ifdef _WIN32
+__declspec(dllexport)
+#endif
+int sqlite3_bson_init(
+  sqlite3 *db, 
+  char **pzErrMsg, 
+  const sqlite3_api_routines *pApi
+){
+  int rc = SQLITE_OK;
+  SQLITE_EXTENSION_INIT2(pApi);
+  (void)pzErrMsg;  /* Unused parameter */
+
+  // Per-connection state (key dictionary cache, etc.).  Every function
+  // registered with it holds a reference; see _conn_release.
+  bsonext_conn* conn = sqlite3_malloc(sizeof(bsonext_conn));
+  if(conn == 0) return SQLITE_NOMEM;
+  memset(conn, 0, sizeof(bsonext_conn));
+
+  rc = sqlite3_create_function_v2(db, "bson_get", 2,
+                   SQLITE_UTF8|SQLITE_INNOCUOUS|SQLITE_DETERMINISTIC,
+		   _conn_ref(conn), bson_get_func, 0, 0, _conn_release);
+
+  // Nice convenience; same as bson_get(bson_column, ""):
+  for(int nargs = 1; nargs <= 2; nargs++) {
+      rc = sqlite3_create_function_v2(db, "bson_to_json", nargs,
+		   SQLITE_UTF8|SQLITE_INNOCUOUS|SQLITE_DETERMINISTIC,
+		   _conn_ref(conn), bson_to_json_func, 0, 0, _conn_release);
+  }
+
+  rc = sqlite3_create_function_v2(db, "bson_get_bson", 2,
+                   SQLITE_UTF8|SQLITE_INNOCUOUS|SQLITE_DETERMINISTIC|SQLITE_RESULT_SUBTYPE,
+		   _conn_ref(conn), bson_get_bson_func, 0, 0, _conn_release);
+
+  // Key-dictionary compact storage; not deterministic because
+  // bson_compact may add to bson_keydict, and direct-only because it
+  // creates bson_keydict if need be.  The readers (bson_get etc.
+  // and bson_expand) consult bson_keydict but stay deterministic
+  // because its rows can't be changed or deleted:
+  rc = sqlite3_create_function_v2(db, "bson_compact", 2,
+		   SQLITE_UTF8|SQLITE_DIRECTONLY,
+		   _conn_ref(conn), bson_compact_func, 0, 0, _conn_release);
+
+  rc = sqlite3_create_function_v2(db, "bson_expand", 1,
+                   SQLITE_UTF8|SQLITE_INNOCUOUS|SQLITE_DETERMINISTIC,
+		   _conn_ref(conn), bson_expand_func, 0, 0, _conn_release);
+
+  // Bloom filter of all dotpaths for cheap existence pre-filtering:
+  rc = sqlite3_create_function_v2(db, "bson_key_signature", 1,
+		   SQLITE_UTF8|SQLITE_INNOCUOUS|SQLITE_DETERMINISTIC,
+		   _conn_ref(conn), bson_key_signature_func, 0, 0, _conn_release);
+
+  rc = sqlite3_create_function(db, "bson_sig_may_contain", 2,
+		   SQLITE_UTF8|SQLITE_INNOCUOUS|SQLITE_DETERMINISTIC,
+		   0, bson_sig_may_contain_func, 0, 0);
+
+  // Stable 64-bit content hash; 1, 2 or 3 args:
+  for(int nargs = 1; nargs <= 3; nargs++) {
+      rc = sqlite3_create_function_v2(db, "bson_hash", nargs,
+		   SQLITE_UTF8|SQLITE_INNOCUOUS|SQLITE_DETERMINISTIC,
+		   _conn_ref(conn), bson_hash_func, 0, 0, _conn_release);
+  }
+
+  // MongoDB ordering across types and into documents and arrays:
+  rc = sqlite3_create_function_v2(db, "bson_compare", 2,
+		   SQLITE_UTF8|SQLITE_INNOCUOUS|SQLITE_DETERMINISTIC,
+		   _conn_ref(conn), bson_compare_func, 0, 0, _conn_release);
+
+  rc = sqlite3_create_collation_v2(db, "BSON", SQLITE_UTF8, 0, bson_collation_cmp, 0);
+  if(rc != SQLITE_OK) return rc;
+
+  // Deltas between two versions of a document and applying them:
+  rc = sqlite3_create_function_v2(db, "bson_diff", 2,
+		   SQLITE_UTF8|SQLITE_INNOCUOUS|SQLITE_DETERMINISTIC,
+		   _conn_ref(conn), bson_diff_func, 0, 0, _conn_release);
+
+  rc = sqlite3_create_function_v2(db, "bson_patch", 2,
+		   SQLITE_UTF8|SQLITE_INNOCUOUS|SQLITE_DETERMINISTIC,
+		   _conn_ref(conn), bson_patch_func, 0, 0, _conn_release);
+
+  // Which paths are worth a functional index:
+  rc = sqlite3_create_function_v2(db, "bson_path_stats", 1,
+		   SQLITE_UTF8|SQLITE_INNOCUOUS,
+		   _conn_ref(conn), 0, bson_path_stats_step, bson_path_stats_final, _conn_release);
+
+  for(int nargs = 3; nargs <= 4; nargs++) {
+      rc = sqlite3_create_function_v2(db, "bson_index_advice", nargs,
+		   SQLITE_UTF8|SQLITE_DIRECTONLY,
+		   0, bson_index_advice_func, 0, 0, 0);
+  }
+
+  // Assemble BSON from grouped rows without going through JSON:
+  // they read BSONEXT_SUBTYPE_ARRAY on their values and bson_group_array sets it:
+  rc = sqlite3_create_function_v2(db, "bson_group_array", 1,
+		   SQLITE_UTF8|SQLITE_INNOCUOUS|SQLITE_DETERMINISTIC|SQLITE_SUBTYPE|SQLITE_RESULT_SUBTYPE,
+		   _conn_ref(conn), 0, bson_group_array_step, bson_group_array_final, _conn_release);
+
+  rc = sqlite3_create_function_v2(db, "bson_group_object", 2,
+		   SQLITE_UTF8|SQLITE_INNOCUOUS|SQLITE_DETERMINISTIC|SQLITE_SUBTYPE,
+		   _conn_ref(conn), 0, bson_group_object_step, bson_group_object_final, _conn_release);
+
+  rc = sqlite3_create_function_v2(db, "bson_as_array", 1,
+		   SQLITE_UTF8|SQLITE_INNOCUOUS|SQLITE_DETERMINISTIC|SQLITE_RESULT_SUBTYPE,
+		   0, bson_as_array_func, 0, 0, 0);
+
+  // Cheap questions about structure; nothing is converted:
+  rc = sqlite3_create_function_v2(db, "bson_type", 2,
+		   SQLITE_UTF8|SQLITE_INNOCUOUS|SQLITE_DETERMINISTIC,
+		   _conn_ref(conn), bson_type_func, 0, 0, _conn_release);
+
+  rc = sqlite3_create_function_v2(db, "bson_exists", 2,
+		   SQLITE_UTF8|SQLITE_INNOCUOUS|SQLITE_DETERMINISTIC,
+		   _conn_ref(conn), bson_exists_func, 0, 0, _conn_release);
+
+  rc = sqlite3_create_function_v2(db, "bson_size", 2,
+		   SQLITE_UTF8|SQLITE_INNOCUOUS|SQLITE_DETERMINISTIC,
+		   _conn_ref(conn), bson_size_func, 0, 0, _conn_release);
+
+  rc = sqlite3_create_function_v2(db, "bson_keys", 2,
+		   SQLITE_UTF8|SQLITE_INNOCUOUS|SQLITE_DETERMINISTIC,
+		   _conn_ref(conn), bson_keys_func, 0, 0, _conn_release);
+
+  // GeoJSON extents, and an R*Tree over them:
+  for(int nargs = 2; nargs <= 3; nargs++) {
+      rc = sqlite3_create_function_v2(db, "bson_geo_bbox", nargs,
+		   SQLITE_UTF8|SQLITE_INNOCUOUS|SQLITE_DETERMINISTIC,
+		   _conn_ref(conn), bson_geo_bbox_func, 0, 0, _conn_release);
+  }
+
+  for(int nargs = 3; nargs <= 4; nargs++) {
+      rc = sqlite3_create_function_v2(db, "bson_geo_rtree_create", nargs,
+		   SQLITE_UTF8|SQLITE_DIRECTONLY,
+		   0, bson_geo_rtree_create_func, 0, 0, 0);
+  }
+
+  // Many documents per row, with min/max of chosen paths up front:
+  rc = sqlite3_create_function_v2(db, "bson_seq_append", -1,
+		   SQLITE_UTF8|SQLITE_INNOCUOUS|SQLITE_DETERMINISTIC,
+		   _conn_ref(conn), bson_seq_append_func, 0, 0, _conn_release);
+
+  rc = sqlite3_create_function_v2(db, "bson_seq_group", -1,
+		   SQLITE_UTF8|SQLITE_INNOCUOUS|SQLITE_DETERMINISTIC,
+		   _conn_ref(conn), 0, bson_seq_group_step, bson_seq_group_final, _conn_release);
+
+  rc = sqlite3_create_function(db, "bson_seq_count", 1,
+		   SQLITE_UTF8|SQLITE_INNOCUOUS|SQLITE_DETERMINISTIC,
+		   0, bson_seq_count_func, 0, 0);
+
+  rc = sqlite3_create_function(db, "bson_seq_min", 2,
+		   SQLITE_UTF8|SQLITE_INNOCUOUS|SQLITE_DETERMINISTIC,
+		   "min", bson_seq_minmax_func, 0, 0);
+
+  rc = sqlite3_create_function(db, "bson_seq_max", 2,
+		   SQLITE_UTF8|SQLITE_INNOCUOUS|SQLITE_DETERMINISTIC,
+		   "max", bson_seq_minmax_func, 0, 0);
+
+  rc = sqlite3_create_module(db, "bson_seq_each", &bson_seq_each_module, 0);
+
+  // Several paths in one walk, and narrow side tables built from that:
+  rc = sqlite3_create_function_v2(db, "bson_project", -1,
+		   SQLITE_UTF8|SQLITE_INNOCUOUS|SQLITE_DETERMINISTIC,
+		   _conn_ref(conn), bson_project_func, 0, 0, _conn_release);
+
+  rc = sqlite3_create_function(db, "bson_shadow_create", -1,
+		   SQLITE_UTF8|SQLITE_DIRECTONLY,
+		   0, bson_shadow_create_func, 0, 0);
+
+  for(int nargs = 1; nargs <= 2; nargs++) {
+      rc = sqlite3_create_function(db, "bson_shadow_backfill", nargs,
+		   SQLITE_UTF8|SQLITE_DIRECTONLY,
+		   0, bson_shadow_backfill_func, 0, 0);
+  }
+
+  // Every match of a wildcard dotpath, one row each:
+  rc = sqlite3_create_module(db, "bson_get_all", &bson_get_all_module, 0);
+
+  // Bulk load from a file of EJSON lines:
+  rc = sqlite3_create_module(db, "bson_from_json_lines", &bson_from_json_lines_module, 0);
+
+  // JSON of a large document a piece at a time:
+  rc = sqlite3_create_module(db, "bson_to_json_chunks", &bson_to_json_chunks_module, 0);
+
+  // Full text search over string values only, if FTS5 is there:
+  fts5_api* fts5 = _fts5_api(db);
+  if(fts5 != 0) {
+      static fts5_tokenizer bson_tok = { _bson_tok_create, _bson_tok_delete, _bson_tok_tokenize };
+      rc = fts5->xCreateTokenizer(fts5, "bson", fts5, &bson_tok, 0);
+  }
 
   // Easier way to insert EJSON into BLOB column:
   rc = sqlite3_create_function(db, "bson_from_json", 1,
@@ -0,0 +1,160 @@
+// Copyright (c) 2022-2024  Buzz Moschetti <buzz.moschetti@gmail.com>
+//
+// Permission to use, copy, modify, and distribute this software and its documentation for any purpose, without fee, and without a written agreement is hereby granted,
+// provided that the above copyright notice and this paragraph and the following two paragraphs appear in all copies.
+//
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST PROFITS,
+// ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION, EVEN IF THE AUTHOR HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// THE AUTHOR SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+// THE SOFTWARE PROVIDED HEREUNDER IS ON AN "AS IS" BASIS, AND THE AUTHOR HAS NO OBLIGATIONS TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "bsonext_bulk.h"
+
+struct bsonext_bulk {
+    sqlite3* db;
+    sqlite3_stmt* ins;
+    int batch_size;
+    int in_batch;           // rows since BEGIN
+    int own_txn;            // false if the caller had a transaction open
+    int txn_open;
+    sqlite3_int64 rows;
+    double t0;
+};
+
+// Seconds on a clock that only goes forward; only differences are used:
+static double _now(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER f, t;
+    QueryPerformanceFrequency(&f);
+    QueryPerformanceCounter(&t);
+    return (double)t.QuadPart / f.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+static int _exec(sqlite3* db, const char* sql)
+{
+    return sqlite3_exec(db, sql, 0, 0, 0);
+}
+
+static int _commit(bsonext_bulk_t* bk)
+{
+    if(!bk->txn_open) return SQLITE_OK;
+    int rc = _exec(bk->db, "COMMIT");
+
+    // BUSY leaves the transaction open; keep it and its rows for a retry:
+    if(rc == SQLITE_BUSY && !sqlite3_get_autocommit(bk->db)) return rc;
+
+    if(rc != SQLITE_OK) {
+	if(!sqlite3_get_autocommit(bk->db)) _exec(bk->db, "ROLLBACK");
+	bk->rows -= bk->in_batch;
+    }
+    bk->txn_open = 0;
+    bk->in_batch = 0;
+    return rc;
+}
+
+int bsonext_bulk_open(sqlite3* db, const char* table, const char* column, int batch_size,
+		      bsonext_bulk_t** pbk)
+{
+    *pbk = 0;
+    bsonext_bulk_t* bk = sqlite3_malloc(sizeof(bsonext_bulk_t));
+    if(bk == 0) return SQLITE_NOMEM;
+    memset(bk, 0, sizeof(bsonext_bulk_t));
+
+    char* sql = sqlite3_mprintf("INSERT INTO \"%w\" (\"%w\") VALUES (?)", table, column);
+    if(sql == 0) {
+	sqlite3_free(bk);
+	return SQLITE_NOMEM;
+    }
+    int rc = sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &bk->ins, 0);
+    sqlite3_free(sql);
+    if(rc != SQLITE_OK) {
+	sqlite3_free(bk);
+	return rc;
+    }
+
+    bk->db = db;
+    bk->batch_size = (batch_size > 0) ? batch_size : BSONEXT_BULK_BATCH_DEFAULT;
+    bk->own_txn = sqlite3_get_autocommit(db);
+    bk->t0 = _now();
+    *pbk = bk;
+    return SQLITE_OK;
+}
+
+int bsonext_bulk_add(bsonext_bulk_t* bk, const bson_t* b)
+{
+    int rc;
+    if(bk->own_txn && !bk->txn_open) {
+	if((rc = _exec(bk->db, "BEGIN")) != SQLITE_OK) return rc;
+	bk->txn_open = 1;
+    }
+
+    // The bytes only have to live until the step, so no copy:
+    sqlite3_bind_blob(bk->ins, 1, bson_get_data(b), b->len, SQLITE_STATIC);
+    rc = sqlite3_step(bk->ins);
+    sqlite3_reset(bk->ins);
+    sqlite3_clear_bindings(bk->ins);
+    if(rc != SQLITE_DONE) {
+	if(bk->txn_open) {
+	    _exec(bk->db, "ROLLBACK");
+	    bk->rows -= bk->in_batch;
+	    bk->txn_open = 0;
+	    bk->in_batch = 0;
+	}
+	return rc;
+    }
+
+    bk->rows++;
+    if(bk->txn_open && ++bk->in_batch >= bk->batch_size) {
+	return _commit(bk);
+    }
+    return SQLITE_OK;
+}
+
+int bsonext_bulk_add_reader(bsonext_bulk_t* bk, bson_reader_t* reader, sqlite3_int64* nread)
+{
+    sqlite3_int64 n = 0;
+    int rc = SQLITE_OK;
+    bool eof = false;
+    const bson_t* b;
+
+    // Each document is good only until the next read, which is all we need:
+    while((b = bson_reader_read(reader, &eof)) != 0) {
+	if((rc = bsonext_bulk_add(bk, b)) != SQLITE_OK) break;
+	n++;
+    }
+    if(rc == SQLITE_OK && !eof) rc = SQLITE_CORRUPT;  // truncated or bad document in the stream
+    if(nread != 0) *nread = n;
+    return rc;
+}
+
+void bsonext_bulk_stats(const bsonext_bulk_t* bk, bsonext_bulk_stats_t* st)
+{
+    st->rows = bk->rows;
+    st->secs = _now() - bk->t0;
+    st->rows_per_sec = (st->secs > 0) ? st->rows / st->secs : 0;
+}
+
+int bsonext_bulk_close(bsonext_bulk_t* bk, bsonext_bulk_stats_t* st)
+{
+    if(bk == 0) return SQLITE_OK;
+    int rc = _commit(bk);
+    if(rc == SQLITE_BUSY && bk->txn_open) return rc;
+    sqlite3_finalize(bk->ins);
+    if(st != 0) bsonext_bulk_stats(bk, st);
+    sqlite3_free(bk);
+    return rc;
+}
@@ -0,0 +1,88 @@
+// Copyright (c) 2022-2024  Buzz Moschetti <buzz.moschetti@gmail.com>
+//
+// Permission to use, copy, modify, and distribute this software and its documentation for any purpose, without fee, and without a written agreement is hereby granted,
+// provided that the above copyright notice and this paragraph and the following two paragraphs appear in all copies.
+//
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST PROFITS,
+// ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION, EVEN IF THE AUTHOR HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// THE AUTHOR SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+// THE SOFTWARE PROVIDED HEREUNDER IS ON AN "AS IS" BASIS, AND THE AUTHOR HAS NO OBLIGATIONS TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+
+/*
+  Bulk insert of BSON documents from a C client.
+
+  Loading with a prepare, bind, step and finalize per document, each in
+  its own implicit transaction (as example1.c does for a handful of rows),
+  spends most of its time preparing and syncing.  This prepares the INSERT
+  once, binds each document's bytes in place with no copy, and commits
+  every batch_size rows:
+
+    bsonext_bulk_t* bk;
+    if(bsonext_bulk_open(db, "MYDATA", "bson_column", 10000, &bk) == SQLITE_OK) {
+	while( ... more docs ... ) {
+	    if(bsonext_bulk_add(bk, b) != SQLITE_OK) break;
+	}
+	bsonext_bulk_stats_t st;
+	bsonext_bulk_close(bk, &st);
+	printf("%lld rows, %.0f rows/s\n", st.rows, st.rows_per_sec);
+    }
+
+  All calls return sqlite result codes; sqlite3_errmsg(db) has the
+  detail.  If the caller already has a transaction open, rows go into it
+  and no BEGIN/COMMIT is issued.  Otherwise a failed add rolls back the
+  current batch only; earlier batches are already committed.
+
+  A COMMIT that gets SQLITE_BUSY (another connection is reading) is not
+  a failure of the batch:  the transaction stays open with its rows, the
+  call returns SQLITE_BUSY, and the next add or close tries the COMMIT
+  again.  bsonext_bulk_close frees bk unless it returns SQLITE_BUSY, so
+  a caller can wait and call it again.  Any other COMMIT error rolls the
+  batch back.
+
+  Build by compiling bsonext_bulk.c with the client.  The extension need
+  not be loaded to use it.
+*/
+#ifndef BSONEXT_BULK_H
+#define BSONEXT_BULK_H
+
+#include <sqlite3.h>
+#include <bson.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BSONEXT_BULK_BATCH_DEFAULT  10000
+
+typedef struct bsonext_bulk bsonext_bulk_t;
+
+typedef struct {
+    sqlite3_int64 rows;     // added so far; after close, committed
+    double secs;            // open to close
+    double rows_per_sec;
+} bsonext_bulk_stats_t;
+
+// batch_size <= 0 means BSONEXT_BULK_BATCH_DEFAULT:
+int bsonext_bulk_open(sqlite3* db, const char* table, const char* column, int batch_size,
+		      bsonext_bulk_t** pbk);
+
+int bsonext_bulk_add(bsonext_bulk_t* bk, const bson_t* b);
+
+// Every document from reader (e.g. bson_reader_new_from_file) until it is
+// exhausted.  *nread, if not NULL, gets the number added by this call:
+int bsonext_bulk_add_reader(bsonext_bulk_t* bk, bson_reader_t* reader, sqlite3_int64* nread);
+
+// Progress so far without closing:
+void bsonext_bulk_stats(const bsonext_bulk_t* bk, bsonext_bulk_stats_t* st);
+
+// Commits what is pending and frees bk on every return except SQLITE_BUSY,
+// when bk stays open with its rows pending so close can be retried.  st
+// may be NULL:
+int bsonext_bulk_close(bsonext_bulk_t* bk, bsonext_bulk_stats_t* st);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
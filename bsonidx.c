@@ -0,0 +1,676 @@
+// Copyright (c) 2022-2024  Buzz Moschetti <buzz.moschetti@gmail.com>
+//
+// Permission to use, copy, modify, and distribute this software and its documentation for any purpose, without fee, and without a written agreement is hereby granted,
+// provided that the above copyright notice and this paragraph and the following two paragraphs appear in all copies.
+//
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST PROFITS,
+// ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION, EVEN IF THE AUTHOR HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// THE AUTHOR SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+// THE SOFTWARE PROVIDED HEREUNDER IS ON AN "AS IS" BASIS, AND THE AUTHOR HAS NO OBLIGATIONS TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+
+/*
+  bsonidx:  pull dotpaths out of a BSON column into a sidecar table, on
+  all cores, ready to be indexed.
+
+  CREATE INDEX on bson_get(bdata,'x.y') decodes every document on one core
+  inside one connection.  Here the table is split by rowid range over N
+  threads, each with its own read-only connection and the extension
+  loaded.  Each document is walked once (bson_project) no matter how many
+  paths are asked for.  Threads sort what they read into runs in temp
+  files; the runs are then merged and inserted in key order in one
+  transaction with one prepared statement, and the index is made last.
+
+  The sidecar is
+      side (base_rowid INTEGER, <path columns>)
+  with index side_idx on (<path columns>, base_rowid).  Column names are
+  the paths with anything not alphanumeric turned into '_'; paths that
+  come out the same (x.y and x_y) are refused.  Ordering is sqlite's own:
+  NULL, numbers, text (binary), blob.
+
+  Everything is built as side_bsonidx_tmp and renamed to side only when
+  the load and the index succeed; on any error it is dropped, so the
+  sidecar either appears complete or not at all.
+
+  usage:  bsonidx [-j threads] [-x extension] [-n] dbfile table column sidecar path [path ...]
+	  -n   don't create the index
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include <sqlite3.h>
+
+
+// Records per sorted run; bounds the memory a thread holds:
+#ifndef BSONIDX_RUN_ROWS
+#define BSONIDX_RUN_ROWS 500000
+#endif
+
+static int ncols;             // number of paths, same for every record
+static char* select_sql;      // what each thread runs over its rowid range
+static const char* ext_path = "bsonext";
+
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int activate_extension(sqlite3 *db, char* err, int errlen)
+{
+    const char* entry_point = "sqlite3_bson_init"; // ALWAYS the same!
+
+    int rc = sqlite3_enable_load_extension(db, 1); // TRUE
+    if(rc != SQLITE_OK) {
+	snprintf(err, errlen, "cannot enable extension loading");
+	return 1;
+    }
+
+    char *zErrMsg = 0;
+    rc = sqlite3_load_extension(db, ext_path, entry_point, &zErrMsg);
+    if(rc != SQLITE_OK) {
+	snprintf(err, errlen, "load ext [%s] failed: %d: %s", ext_path, rc, zErrMsg);
+	sqlite3_free(zErrMsg);
+	return 1;
+    }
+
+    return 0; // OK
+}
+
+
+/*
+  A record is
+      int64 rowid, then per column:  type byte + payload
+  where the payload is 8 bytes for SQLITE_INTEGER/SQLITE_FLOAT, a 4 byte
+  length plus the bytes for SQLITE_TEXT/SQLITE_BLOB, and nothing for
+  SQLITE_NULL.  Runs are written as 4 byte length + record.  The same
+  layout is sorted in memory, written, merged and bound to the insert.
+*/
+typedef struct {
+    int t;
+    sqlite3_int64 i;
+    double d;
+    const unsigned char* p;
+    int n;
+} val_t;
+
+static const unsigned char* get_val(const unsigned char* q, val_t* v)
+{
+    v->t = *q++;
+    switch(v->t) {
+    case SQLITE_INTEGER:
+	memcpy(&v->i, q, 8);
+	return q + 8;
+    case SQLITE_FLOAT:
+	memcpy(&v->d, q, 8);
+	return q + 8;
+    case SQLITE_TEXT:
+    case SQLITE_BLOB:
+	memcpy(&v->n, q, 4);
+	v->p = q + 4;
+	return q + 4 + v->n;
+    }
+    return q;
+}
+
+// NULL < INTEGER = FLOAT < TEXT < BLOB, as in sqlite:
+static int type_class(int t)
+{
+    switch(t) {
+    case SQLITE_NULL: return 0;
+    case SQLITE_INTEGER:
+    case SQLITE_FLOAT: return 1;
+    case SQLITE_TEXT: return 2;
+    }
+    return 3;
+}
+
+static int cmp_val(const val_t* a, const val_t* b)
+{
+    int ca = type_class(a->t), cb = type_class(b->t);
+    if(ca != cb) return ca < cb ? -1 : 1;
+
+    if(ca == 1) {
+	if(a->t == SQLITE_INTEGER && b->t == SQLITE_INTEGER) {
+	    return (a->i > b->i) - (a->i < b->i);
+	}
+	double x = (a->t == SQLITE_INTEGER) ? (double)a->i : a->d;
+	double y = (b->t == SQLITE_INTEGER) ? (double)b->i : b->d;
+	return (x > y) - (x < y);
+    }
+    if(ca >= 2) {
+	int r = memcmp(a->p, b->p, a->n < b->n ? a->n : b->n);
+	if(r != 0) return r;
+	return (a->n > b->n) - (a->n < b->n);
+    }
+    return 0;
+}
+
+static int cmp_rec(const unsigned char* a, const unsigned char* b)
+{
+    sqlite3_int64 ra, rb;
+    memcpy(&ra, a, 8);
+    memcpy(&rb, b, 8);
+    a += 8;
+    b += 8;
+
+    for(int k = 0; k < ncols; k++) {
+	val_t va, vb;
+	a = get_val(a, &va);
+	b = get_val(b, &vb);
+	int r = cmp_val(&va, &vb);
+	if(r != 0) return r;
+    }
+    return (ra > rb) - (ra < rb);
+}
+
+static int qsort_rec(const void* a, const void* b)
+{
+    return cmp_rec(*(const unsigned char**)a, *(const unsigned char**)b);
+}
+
+
+
+typedef struct {
+    sqlite3_int64 lo, hi;   // rowid range, inclusive
+    const char* dbfile;
+
+    unsigned char* arena;   // records of the current run, back to back
+    size_t len, cap;
+    size_t* offs;           // where each one starts
+    int nrecs;
+
+    FILE** runs;
+    int nruns;
+    sqlite3_int64 rows;
+    char err[512];
+} worker_t;
+
+static int put(worker_t* w, const void* p, size_t n)
+{
+    if(w->len + n > w->cap) {
+	size_t ncap = w->cap ? w->cap * 2 : 1 << 20;
+	while(ncap < w->len + n) ncap *= 2;
+	unsigned char* a = realloc(w->arena, ncap);
+	if(a == 0) return 1;
+	w->arena = a;
+	w->cap = ncap;
+    }
+    memcpy(w->arena + w->len, p, n);
+    w->len += n;
+    return 0;
+}
+
+static int flush_run(worker_t* w)
+{
+    if(w->nrecs == 0) return 0;
+
+    // Offsets become pointers only now; the arena may have moved while filling:
+    unsigned char** recs = malloc(w->nrecs * sizeof(unsigned char*));
+    FILE** runs = realloc(w->runs, (w->nruns + 1) * sizeof(FILE*));
+    FILE* f = tmpfile();
+    if(recs == 0 || runs == 0 || f == 0) {
+	snprintf(w->err, sizeof(w->err), "cannot make sorted run");
+	free(recs);
+	if(runs) w->runs = runs;
+	if(f) fclose(f);
+	return 1;
+    }
+    w->runs = runs;
+
+    for(int i = 0; i < w->nrecs; i++) {
+	recs[i] = w->arena + w->offs[i];
+    }
+    qsort(recs, w->nrecs, sizeof(unsigned char*), qsort_rec);
+
+    for(int i = 0; i < w->nrecs; i++) {
+	int32_t n;
+	memcpy(&n, recs[i] - 4, 4);
+	fwrite(recs[i] - 4, 4 + n, 1, f);
+    }
+    free(recs);
+
+    if(ferror(f) || fflush(f) != 0) {
+	snprintf(w->err, sizeof(w->err), "cannot write sorted run");
+	fclose(f);
+	return 1;
+    }
+    rewind(f);
+    w->runs[w->nruns++] = f;
+    w->len = 0;
+    w->nrecs = 0;
+    return 0;
+}
+
+static void* worker(void* arg)
+{
+    worker_t* w = arg;
+    sqlite3* db = 0;
+    sqlite3_stmt* stmt = 0;
+
+    w->offs = malloc(BSONIDX_RUN_ROWS * sizeof(size_t));
+    if(w->offs == 0) {
+	snprintf(w->err, sizeof(w->err), "out of memory");
+	return 0;
+    }
+
+    int rc = sqlite3_open_v2(w->dbfile, &db, SQLITE_OPEN_READONLY|SQLITE_OPEN_NOMUTEX, 0);
+    if(rc != SQLITE_OK) {
+	snprintf(w->err, sizeof(w->err), "cannot open [%s]: %s", w->dbfile, sqlite3_errmsg(db));
+	sqlite3_close(db);
+	return 0;
+    }
+    if(activate_extension(db, w->err, sizeof(w->err)) != 0) {
+	sqlite3_close(db);
+	return 0;
+    }
+
+    rc = sqlite3_prepare_v2(db, select_sql, -1, &stmt, 0);
+    if(rc != SQLITE_OK) {
+	snprintf(w->err, sizeof(w->err), "prep [%s]: %s", select_sql, sqlite3_errmsg(db));
+	sqlite3_close(db);
+	return 0;
+    }
+    sqlite3_bind_int64(stmt, 1, w->lo);
+    sqlite3_bind_int64(stmt, 2, w->hi);
+
+    while((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+	int32_t reclen = 8;
+	for(int k = 0; k < ncols; k++) {
+	    int t = sqlite3_column_type(stmt, k + 1);
+	    reclen += 1 + ((t == SQLITE_INTEGER || t == SQLITE_FLOAT) ? 8 :
+			   (t == SQLITE_NULL) ? 0 : 4 + sqlite3_column_bytes(stmt, k + 1));
+	}
+
+	// Each record is preceded by its length so the sort can find it:
+	int bad = put(w, &reclen, 4);
+	w->offs[w->nrecs++] = w->len;
+
+	sqlite3_int64 rowid = sqlite3_column_int64(stmt, 0);
+	bad |= put(w, &rowid, 8);
+	for(int k = 0; k < ncols; k++) {
+	    unsigned char t = sqlite3_column_type(stmt, k + 1);
+	    bad |= put(w, &t, 1);
+	    if(t == SQLITE_INTEGER) {
+		sqlite3_int64 i = sqlite3_column_int64(stmt, k + 1);
+		bad |= put(w, &i, 8);
+	    } else if(t == SQLITE_FLOAT) {
+		double d = sqlite3_column_double(stmt, k + 1);
+		bad |= put(w, &d, 8);
+	    } else if(t == SQLITE_TEXT || t == SQLITE_BLOB) {
+		const void* p = (t == SQLITE_TEXT) ? (const void*)sqlite3_column_text(stmt, k + 1) : sqlite3_column_blob(stmt, k + 1);
+		int32_t n = sqlite3_column_bytes(stmt, k + 1);
+		bad |= put(w, &n, 4);
+		bad |= put(w, p, n);
+	    }
+	}
+	if(bad) {
+	    snprintf(w->err, sizeof(w->err), "out of memory");
+	    break;
+	}
+	w->rows++;
+
+	if(w->nrecs == BSONIDX_RUN_ROWS && flush_run(w) != 0) break;
+    }
+    if(rc != SQLITE_ROW && rc != SQLITE_DONE) {
+	snprintf(w->err, sizeof(w->err), "step: %s", sqlite3_errmsg(db));
+    }
+    if(w->err[0] == 0) flush_run(w);
+
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    free(w->arena);
+    free(w->offs);
+    w->arena = 0;
+    w->offs = 0;
+    return 0;
+}
+
+
+
+/*
+  k-way merge over all runs from all threads.  A small binary heap of
+  run readers ordered by their current record.
+*/
+typedef struct {
+    FILE* f;
+    unsigned char* rec;
+    int cap;
+} reader_t;
+
+static int next_rec(reader_t* r)
+{
+    int32_t n;
+    if(fread(&n, 4, 1, r->f) != 1) return 0;
+    if(n > r->cap) {
+	unsigned char* p = realloc(r->rec, n);
+	if(p == 0) return -1;
+	r->rec = p;
+	r->cap = n;
+    }
+    return fread(r->rec, n, 1, r->f) == 1 ? 1 : -1;
+}
+
+static void sift_down(reader_t** heap, int n, int i)
+{
+    for(;;) {
+	int m = i, l = 2 * i + 1, r = 2 * i + 2;
+	if(l < n && cmp_rec(heap[l]->rec, heap[m]->rec) < 0) m = l;
+	if(r < n && cmp_rec(heap[r]->rec, heap[m]->rec) < 0) m = r;
+	if(m == i) return;
+	reader_t* t = heap[i];
+	heap[i] = heap[m];
+	heap[m] = t;
+	i = m;
+    }
+}
+
+static int load(sqlite3* db, const char* insert_sql, worker_t* ws, int nthreads, sqlite3_int64* loaded)
+{
+    int nruns = 0;
+    for(int t = 0; t < nthreads; t++) nruns += ws[t].nruns;
+
+    reader_t* readers = calloc(nruns > 0 ? nruns : 1, sizeof(reader_t));
+    reader_t** heap = calloc(nruns > 0 ? nruns : 1, sizeof(reader_t*));
+    if(readers == 0 || heap == 0) {
+	fprintf(stderr, "out of memory\n");
+	free(readers);
+	free(heap);
+	return 1;
+    }
+
+    int n = 0, j = 0, bad = 0;
+    for(int t = 0; t < nthreads; t++) {
+	for(int r = 0; r < ws[t].nruns; r++) {
+	    readers[j].f = ws[t].runs[r];
+	    int got = next_rec(&readers[j]);
+	    if(got < 0) bad = 1;
+	    if(got > 0) heap[n++] = &readers[j];
+	    j++;
+	}
+    }
+    for(int i = n / 2 - 1; i >= 0; i--) sift_down(heap, n, i);
+
+    sqlite3_stmt* stmt = 0;
+    int rc = sqlite3_prepare_v2(db, insert_sql, -1, &stmt, 0);
+    if(rc != SQLITE_OK) {
+	fprintf(stderr, "prep [%s]: %s\n", insert_sql, sqlite3_errmsg(db));
+	bad = 1;
+    }
+
+    sqlite3_exec(db, "BEGIN", 0, 0, 0);
+
+    while(!bad && n > 0) {
+	reader_t* r = heap[0];
+
+	sqlite3_int64 rowid;
+	memcpy(&rowid, r->rec, 8);
+	sqlite3_bind_int64(stmt, 1, rowid);
+
+	const unsigned char* q = r->rec + 8;
+	for(int k = 0; k < ncols; k++) {
+	    val_t v;
+	    q = get_val(q, &v);
+	    switch(v.t) {
+	    case SQLITE_INTEGER: sqlite3_bind_int64(stmt, k + 2, v.i); break;
+	    case SQLITE_FLOAT: sqlite3_bind_double(stmt, k + 2, v.d); break;
+	    case SQLITE_TEXT: sqlite3_bind_text(stmt, k + 2, (const char*)v.p, v.n, SQLITE_STATIC); break;
+	    case SQLITE_BLOB: sqlite3_bind_blob(stmt, k + 2, v.p, v.n, SQLITE_STATIC); break;
+	    default: sqlite3_bind_null(stmt, k + 2);
+	    }
+	}
+	if(sqlite3_step(stmt) != SQLITE_DONE) {
+	    fprintf(stderr, "insert: %s\n", sqlite3_errmsg(db));
+	    bad = 1;
+	}
+	sqlite3_reset(stmt);
+	(*loaded)++;
+
+	int got = next_rec(r);
+	if(got < 0) {
+	    fprintf(stderr, "cannot read sorted run\n");
+	    bad = 1;
+	} else if(got == 0) {
+	    heap[0] = heap[--n];
+	}
+	sift_down(heap, n, 0);
+    }
+
+    sqlite3_finalize(stmt);
+    sqlite3_exec(db, bad ? "ROLLBACK" : "COMMIT", 0, 0, 0);
+
+    for(j = 0; j < nruns; j++) {
+	fclose(readers[j].f);
+	free(readers[j].rec);
+    }
+    free(readers);
+    free(heap);
+    return bad;
+}
+
+
+
+/*
+  usage:  bsonidx [-j threads] [-x extension] [-n] dbfile table column sidecar path [path ...]
+ */
+int main(int argc, char* argv[]) {
+    int nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    bool make_index = true;
+    int opt;
+
+    while((opt = getopt(argc, argv, "j:x:n")) != -1) {
+	switch(opt) {
+	case 'j': nthreads = atoi(optarg); break;
+	case 'x': ext_path = optarg; break;
+	case 'n': make_index = false; break;
+	default:
+	    fprintf(stderr, "usage: bsonidx [-j threads] [-x extension] [-n] dbfile table column sidecar path [path ...]\n");
+	    return 1;
+	}
+    }
+    if(argc - optind < 5) {
+	fprintf(stderr, "usage: bsonidx [-j threads] [-x extension] [-n] dbfile table column sidecar path [path ...]\n");
+	return 1;
+    }
+    if(nthreads < 1) nthreads = 1;
+
+    const char* dbf = argv[optind];
+    const char* table = argv[optind + 1];
+    const char* column = argv[optind + 2];
+    const char* side = argv[optind + 3];
+    char** paths = &argv[optind + 4];
+    ncols = argc - optind - 4;
+
+    sqlite3* db;
+    int rc = sqlite3_open(dbf, &db);
+    if( rc ) {
+	fprintf(stderr, "cannot open [%s]: %s\n", dbf, sqlite3_errmsg(db));
+	return 1;
+    }
+    char err[512];
+    if(activate_extension(db, err, sizeof(err)) != 0) {
+	fprintf(stderr, "%s\n", err);
+	return 1;
+    }
+
+    // Build the SQL:  names for the sidecar columns, and one bson_project per row.
+    sqlite3_str* cols = sqlite3_str_new(db);
+    sqlite3_str* gets = sqlite3_str_new(db);
+    sqlite3_str* args = sqlite3_str_new(db);
+    sqlite3_str* qs = sqlite3_str_new(db);
+    char** names = calloc(ncols, sizeof(char*));
+    if(names == 0) {
+	fprintf(stderr, "out of memory\n");
+	return 1;
+    }
+    for(int k = 0; k < ncols; k++) {
+	char* name = names[k] = sqlite3_mprintf("%s", paths[k]);
+	if(name == 0) {
+	    fprintf(stderr, "out of memory\n");
+	    return 1;
+	}
+	for(char* c = name; *c; c++) {
+	    if(!((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9'))) *c = '_';
+	}
+
+	// Column names are case-insensitive in sqlite:
+	const char* clash = sqlite3_stricmp(name, "base_rowid") == 0 ? "base_rowid" : 0;
+	for(int j = 0; j < k && clash == 0; j++) {
+	    if(sqlite3_stricmp(name, names[j]) == 0) clash = paths[j];
+	}
+	if(clash != 0) {
+	    fprintf(stderr, "path [%s] and [%s] both make column [%s]\n", paths[k], clash, name);
+	    return 1;
+	}
+
+	sqlite3_str_appendf(cols, ", \"%w\"", name);
+	sqlite3_str_appendf(gets, ", bson_get(p, '%d')", k);
+	sqlite3_str_appendf(args, ", %Q", paths[k]);
+	sqlite3_str_appendf(qs, ", ?");
+    }
+    char* c_cols = sqlite3_str_finish(cols);
+    char* c_gets = sqlite3_str_finish(gets);
+    char* c_args = sqlite3_str_finish(args);
+    char* c_qs = sqlite3_str_finish(qs);
+
+    select_sql = sqlite3_mprintf(
+	"SELECT r%s FROM (SELECT rowid r, bson_project(\"%w\"%s) p FROM \"%w\" WHERE rowid BETWEEN ?1 AND ?2)",
+	c_gets, column, c_args, table);
+
+    // The index gets its final name right away; only the table is renamed.
+    char* tmp = sqlite3_mprintf("%s_bsonidx_tmp", side);
+    char* drop_sql = sqlite3_mprintf("DROP TABLE IF EXISTS \"%w\"", tmp);
+    char* create_sql = sqlite3_mprintf("CREATE TABLE \"%w\" (base_rowid INTEGER%s)", tmp, c_cols);
+    char* insert_sql = sqlite3_mprintf("INSERT INTO \"%w\" (base_rowid%s) VALUES (?%s)", tmp, c_cols, c_qs);
+    char* index_sql = sqlite3_mprintf("CREATE INDEX \"%w_idx\" ON \"%w\" (%s, base_rowid)", side, tmp, c_cols + 2);
+    char* rename_sql = sqlite3_mprintf("ALTER TABLE \"%w\" RENAME TO \"%w\"", tmp, side);
+
+    // Make the sidecar first so a bad or taken name fails before any work
+    // is done.  A _tmp table can only be left over from a killed run.
+    char* zErrMsg = 0;
+    sqlite3_stmt* stmt = 0;
+    bool taken = false;
+    if(sqlite3_prepare_v2(db, "SELECT 1 FROM sqlite_master WHERE name = ?1 COLLATE NOCASE", -1, &stmt, 0) == SQLITE_OK) {
+	sqlite3_bind_text(stmt, 1, side, -1, SQLITE_STATIC);
+	taken = sqlite3_step(stmt) == SQLITE_ROW;
+    }
+    sqlite3_finalize(stmt);
+    if(taken) {
+	fprintf(stderr, "[%s] already exists\n", side);
+	return 1;
+    }
+    if(sqlite3_exec(db, drop_sql, 0, 0, &zErrMsg) != SQLITE_OK
+       || sqlite3_exec(db, create_sql, 0, 0, &zErrMsg) != SQLITE_OK) {
+	fprintf(stderr, "%s: %s\n", create_sql, zErrMsg);
+	return 1;
+    }
+
+    sqlite3_int64 lo = 0, hi = -1;
+    char* range_sql = sqlite3_mprintf("SELECT min(rowid), max(rowid) FROM \"%w\"", table);
+    if(sqlite3_prepare_v2(db, range_sql, -1, &stmt, 0) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW
+       && sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+	lo = sqlite3_column_int64(stmt, 0);
+	hi = sqlite3_column_int64(stmt, 1);
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_free(range_sql);
+
+    // Split [lo, hi] into nthreads ranges; go through unsigned so the span can't overflow.
+    worker_t* ws = calloc(nthreads, sizeof(worker_t));
+    pthread_t* tids = calloc(nthreads, sizeof(pthread_t));
+    if(ws == 0 || tids == 0) {
+	fprintf(stderr, "out of memory\n");
+	sqlite3_exec(db, drop_sql, 0, 0, 0);
+	return 1;
+    }
+    sqlite3_uint64 span = (sqlite3_uint64)hi - (sqlite3_uint64)lo;
+    sqlite3_uint64 step = span / nthreads + 1;
+
+    double t0 = now();
+    int started = 0, bad = 0;
+    for(int t = 0; t < nthreads && !bad; t++) {
+	ws[t].dbfile = dbf;
+	ws[t].lo = (sqlite3_int64)((sqlite3_uint64)lo + step * t);
+	ws[t].hi = (t == nthreads - 1) ? hi : (sqlite3_int64)((sqlite3_uint64)lo + step * (t + 1) - 1);
+	if(hi < lo || (sqlite3_uint64)step * t > span) {
+	    ws[t].lo = 1;   // nothing for this one
+	    ws[t].hi = 0;
+	}
+	if(pthread_create(&tids[t], 0, worker, &ws[t]) != 0) {
+	    fprintf(stderr, "cannot start thread %d\n", t);
+	    bad = 1;
+	} else {
+	    started++;
+	}
+    }
+
+    // Threads that did start are waited for, and their runs closed, either way:
+    sqlite3_int64 rows = 0;
+    for(int t = 0; t < started; t++) {
+	pthread_join(tids[t], 0);
+	if(ws[t].err[0]) {
+	    fprintf(stderr, "thread %d: %s\n", t, ws[t].err);
+	    bad = 1;
+	}
+	rows += ws[t].rows;
+    }
+    double t1 = now();
+    fprintf(stderr, "extract: %lld rows, %d threads, %.2fs\n", (long long)rows, nthreads, t1 - t0);
+
+    sqlite3_int64 loaded = 0;
+    if(!bad) {
+	bad = load(db, insert_sql, ws, started, &loaded);
+    } else {
+	for(int t = 0; t < started; t++) {
+	    for(int r = 0; r < ws[t].nruns; r++) fclose(ws[t].runs[r]);
+	}
+    }
+    double t2 = now();
+    fprintf(stderr, "merge+load: %lld rows, %.2fs\n", (long long)loaded, t2 - t1);
+
+    if(!bad && make_index) {
+	if(sqlite3_exec(db, index_sql, 0, 0, &zErrMsg) != SQLITE_OK) {
+	    fprintf(stderr, "%s: %s\n", index_sql, zErrMsg);
+	    sqlite3_free(zErrMsg);
+	    bad = 1;
+	}
+	fprintf(stderr, "index: %.2fs\n", now() - t2);
+    }
+    if(!bad && sqlite3_exec(db, rename_sql, 0, 0, &zErrMsg) != SQLITE_OK) {
+	fprintf(stderr, "%s: %s\n", rename_sql, zErrMsg);
+	sqlite3_free(zErrMsg);
+	bad = 1;
+    }
+    if(bad) {
+	// takes the index with it
+	sqlite3_exec(db, drop_sql, 0, 0, 0);
+	fprintf(stderr, "[%s] not created\n", side);
+    }
+
+    for(int t = 0; t < nthreads; t++) free(ws[t].runs);
+    free(ws);
+    free(tids);
+    for(int k = 0; k < ncols; k++) sqlite3_free(names[k]);
+    free(names);
+    sqlite3_free(select_sql);
+    sqlite3_free(tmp);
+    sqlite3_free(drop_sql);
+    sqlite3_free(create_sql);
+    sqlite3_free(rename_sql);
+    sqlite3_free(insert_sql);
+    sqlite3_free(index_sql);
+    sqlite3_free(c_cols);
+    sqlite3_free(c_gets);
+    sqlite3_free(c_args);
+    sqlite3_free(c_qs);
+    sqlite3_close(db);
+
+    return bad;
+}
@@ -15,6 +15,7 @@
 
 #include <bson.h>
 
+#include "bsonext_bulk.h"
 
 static void do_exec(sqlite3 *db, const char* sql) {
     sqlite3_stmt* stmt = 0;
@@ -108,9 +109,7 @@ static void do_fetch(sqlite3 *db, const char* sql) {
 
 
 
-static void insert(sqlite3 *db, int nn) {
-    sqlite3_stmt* stmt = 0;
-
+static int insert(bsonext_bulk_t* bk, int nn) {
     char jbuf[256];
 
     //
@@ -123,32 +122,16 @@ static void insert(sqlite3 *db, int nn) {
     bson_t* b = bson_new_from_json((const uint8_t *)jbuf, strlen(jbuf), &err);
 
     //
-    //  Now, get the raw bytes from the BSON object to save as a BLOB:
+    //  The bulk loader binds the raw bytes of the BSON object as a BLOB
+    //  to a statement it prepared once, and commits in batches, so this
+    //  is fast for millions of rows too:
     //
-    const uint8_t* data = bson_get_data(b);
-    int32_t len = b->len; // yes; there is no bson_get_len(b)
-
-    int rc = sqlite3_prepare_v2(db, "INSERT INTO FOO (bdata) values (?)", -1, &stmt, 0 );
+    int rc = bsonext_bulk_add(bk, b);
     if(rc != SQLITE_OK) {
-	printf("ERROR prep rc: %d\n", rc);
-	return;
-    } 
-    
-    rc = sqlite3_bind_blob( stmt, 1, (const void*) data, len, SQLITE_STATIC);
-    if(rc != SQLITE_OK) {
-	printf("ERROR: bind rc: %d\n", rc);
-	return;
-    }
-
-    // Doing an insert means we expect a single result DONE back:
-    rc = sqlite3_step( stmt );
-    if(rc != SQLITE_DONE) {
 	printf("? INSERT yields rc %d\n", rc);
     }
-	
-    rc = sqlite3_clear_bindings( stmt );
-    rc = sqlite3_reset( stmt );
-    rc = sqlite3_finalize( stmt );  //  Finalize the prepared stat
+    bson_destroy(b);
+    return rc;
 }
 
 static void create(sqlite3 *db) {
@@ -213,7 +196,18 @@ int main(int argc, char* argv[]) {
     // If you don't want to keep blasting the DB, you can comment
     // these out:
     create(db);
-    for(int i = 0; i < 3; i++) { insert(db, i); }
+    bsonext_bulk_t* bk;
+    rc = bsonext_bulk_open(db, "FOO", "bdata", 0, &bk);
+    if(rc != SQLITE_OK) {
+	printf("bulk open failed: %d: %s\n", rc, sqlite3_errmsg(db));
+    } else {
+	for(int i = 0; i < 3; i++) { insert(bk, i); }
+
+	// BUSY means the last batch is still pending; wait and try again:
+	bsonext_bulk_stats_t st;
+	while(bsonext_bulk_close(bk, &st) == SQLITE_BUSY) sqlite3_sleep(10);
+	printf("inserted %lld rows, %.0f rows/s\n", st.rows, st.rows_per_sec);
+    }
 
 
     
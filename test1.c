@@ -144,6 +144,26 @@ static void exec_bst(sqlite3 *db, const char* desc, const char* sql, bson_type_t
     }	
 }
 
+// The statement must fail, and the error message must contain exp_msg:
+static void exec_bet(sqlite3 *db, const char* desc, const char* sql, const char* exp_msg)
+{
+    sqlite3_stmt* stmt = 0;
+    printf("%s ... ", desc);
+
+    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0 );
+    if(rc == SQLITE_OK) {
+	while((rc = sqlite3_step(stmt)) == SQLITE_ROW) ;
+    }
+    if(rc == SQLITE_DONE) {
+	printf("FAIL; %s: [expect error [%s]; got none]\n", sql, exp_msg);
+    } else if(strstr(sqlite3_errmsg(db), exp_msg) == NULL) {
+	printf("FAIL; %s: [expect error [%s]; got [%s]]\n", sql, exp_msg, sqlite3_errmsg(db));
+    } else {
+	printf("ok\n");
+    }
+    sqlite3_finalize( stmt );
+}
+
 double dval = 3.14159;
 int ival = 7;
 long lval = 743859238573L;
@@ -317,6 +337,9 @@ int main(int argc, char* argv[]) {
 
     int zval = 0;
     int oval = 1;        
+    int mval = -1;
+    int sigwide = 2048; // 1000 distinct paths at 10 bits each, rounded up
+    int sigsize = 64;
     
 
     const char* fake_binary = "Pretend this is a JPEG";
@@ -353,12 +376,159 @@ int main(int argc, char* argv[]) {
 	{"date exists", basic_scalar_test, "select bson_get(bdata,'hdr.ts') from bsontest", BSON_TYPE_UTF8, "2023-01-12T13:14:15.678Z"},
 	{"decimal exists", basic_scalar_test, "select bson_get(bdata,'amt') from bsontest", BSON_TYPE_UTF8, "10.09"},
 	{"binary exists", basic_scalar_test, "select bson_get(bdata,'thumbnail') from bsontest", BSON_TYPE_UTF8, &bval},
+
+	// Compact (key dictionary) storage must read the same as regular BSON:
+	{"compact roundtrip", basic_scalar_test, "select bson_expand(bson_compact(bdata,1)) = bdata from bsontest", BSON_TYPE_INT32, &oval},
+	{"compact is smaller", basic_scalar_test, "select length(bson_compact(bdata,1)) < length(bdata) from bsontest", BSON_TYPE_INT32, &oval},
+	{"compact string", basic_scalar_test, "select bson_get(bson_compact(bdata,1),'hdr.id') from bsontest", BSON_TYPE_UTF8, "A0"},
+	{"compact double", basic_scalar_test, "select bson_get(bson_compact(bdata,1),'A.B.2') from bsontest", BSON_TYPE_DOUBLE, &dval},
+	{"compact !exists", basic_scalar_test, "select bson_get(bson_compact(bdata,1),'hdr.nope') from bsontest", BSON_TYPE_NULL, 0},
+	{"compact !exists rows", basic_scalar_test, "select count(bson_get(c,'hdr.nope')) from (select bson_compact(bdata,1) c from bsontest union all select bson_compact(bdata2,1) from bsontest)", BSON_TYPE_INT32, &zval},
+	{"compact to_json", basic_scalar_test, "select bson_to_json(bson_compact(bdata,1)) = bson_to_json(bdata) from bsontest", BSON_TYPE_INT32, &oval},
+	{"compact get_bson", basic_scalar_test, "select bson_get_bson(bson_compact(bdata,1),'A.B') = bson_get_bson(bdata,'A.B') from bsontest", BSON_TYPE_INT32, &oval},
+
+	{"signature size", basic_scalar_test, "select length(bson_key_signature(bdata)) from bsontest", BSON_TYPE_INT32, &sigsize},
+	{"signature has leaf", basic_scalar_test, "select bson_sig_may_contain(bson_key_signature(bdata),'hdr.id') from bsontest", BSON_TYPE_INT32, &oval},
+	{"signature has parent", basic_scalar_test, "select bson_sig_may_contain(bson_key_signature(bdata),'A.B') from bsontest", BSON_TYPE_INT32, &oval},
+	{"signature !has", basic_scalar_test, "select bson_sig_may_contain(bson_key_signature(bdata),'not.here') from bsontest", BSON_TYPE_INT32, &zval},
+	{"signature array offset", basic_scalar_test, "select bson_sig_may_contain(bson_key_signature(bdata),'A.B.7.X') from bsontest", BSON_TYPE_INT32, &oval},
+	{"signature wide", basic_scalar_test, "select length(bson_key_signature(bson_group_object('k' || value, value))) from (with recursive n(value) as (select 1 union all select value + 1 from n where value < 1000) select value from n)", BSON_TYPE_INT32, &sigwide},
+
+	{"hash differs", basic_scalar_test, "select bson_hash(bdata) != bson_hash(bdata2) from bsontest", BSON_TYPE_INT32, &oval},
+	{"hash subtree", basic_scalar_test, "select bson_hash(bdata,'A') = bson_hash(bdata2,'A') from bsontest", BSON_TYPE_INT32, &oval},
+	{"hash !exists", basic_scalar_test, "select bson_hash(bdata,'not.here') from bsontest", BSON_TYPE_NULL, 0},
+	{"hash compact", basic_scalar_test, "select bson_hash(bson_compact(bdata,1)) = bson_hash(bdata) from bsontest", BSON_TYPE_INT32, &oval},
+	{"hash ordered", basic_scalar_test, "select bson_hash(bson_from_json('{\"a\":1,\"b\":{\"c\":2,\"d\":3}}')) = bson_hash(bson_from_json('{\"b\":{\"d\":3,\"c\":2},\"a\":1}'))", BSON_TYPE_INT32, &zval},
+	{"hash unordered", basic_scalar_test, "select bson_hash(bson_from_json('{\"a\":1,\"b\":{\"c\":2,\"d\":3}}'),'',1) = bson_hash(bson_from_json('{\"b\":{\"d\":3,\"c\":2},\"a\":1}'),'',1)", BSON_TYPE_INT32, &oval},
+
+	{"compare equal", basic_scalar_test, "select bson_compare(bdata, bdata) from bsontest", BSON_TYPE_INT32, &zval},
+	{"compare doc", basic_scalar_test, "select bson_compare(bdata, bdata2) from bsontest", BSON_TYPE_INT32, &mval},
+	{"compare doc reversed", basic_scalar_test, "select bson_compare(bdata2, bdata) from bsontest", BSON_TYPE_INT32, &oval},
+	{"compare int/double", basic_scalar_test, "select bson_compare(bson_from_json('{\"a\":2}'), bson_from_json('{\"a\":2.5}'))", BSON_TYPE_INT32, &mval},
+	{"compare int/long equal", basic_scalar_test, "select bson_compare(bson_from_json('{\"a\":7}'), bson_from_json('{\"a\":{\"$numberLong\":\"7\"}}'))", BSON_TYPE_INT32, &zval},
+	{"compare type order", basic_scalar_test, "select bson_compare(bson_from_json('{\"a\":\"x\"}'), bson_from_json('{\"a\":99}'))", BSON_TYPE_INT32, &oval},
+	{"compare prefix", basic_scalar_test, "select bson_compare(bson_from_json('{\"a\":1}'), bson_from_json('{\"a\":1,\"b\":0}'))", BSON_TYPE_INT32, &mval},
+	{"collate BSON", basic_scalar_test, "select group_concat(bson_get(d,'a')) from (select d from (select bson_from_json('{\"a\":10}') d union all select bson_from_json('{\"a\":9.5}') union all select bson_from_json('{\"a\":-1}')) order by cast(d as text) collate BSON)", BSON_TYPE_UTF8, "-1,9.5,10"},
+	{"compare bad string len", basic_scalar_test, "select bson_compare(x'0c0000000261000000000000', bson_from_json('{\"a\":\"x\"}'))", BSON_TYPE_INT32, &mval},
+
+	{"diff/patch round trip", basic_scalar_test, "select bson_patch(bdata, bson_diff(bdata, bdata2)) = bdata2 from bsontest", BSON_TYPE_INT32, &oval},
+	{"diff identical", basic_scalar_test, "select bson_to_json(bson_diff(bdata, bdata)) from bsontest", BSON_TYPE_UTF8, "{ }"},
+	{"diff array splice", basic_scalar_test, "select bson_get(bson_diff(bson_from_json('{\"a\":[1,2,3]}'), bson_from_json('{\"a\":[1,5,6,3]}')), '$splice.a.1')", BSON_TYPE_INT32, &oval},
+	{"patch splice", basic_scalar_test, "select bson_patch(x, bson_diff(x, y)) = y from (select bson_from_json('{\"a\":[1,2,3]}') x, bson_from_json('{\"a\":[1,5,6,3]}') y)", BSON_TYPE_INT32, &oval},
+	{"diff insert before", basic_scalar_test, "select bson_get(bson_diff(bson_from_json('{\"a\":1,\"b\":2}'), bson_from_json('{\"a\":1,\"x\":0,\"b\":2}')), '$before.x')", BSON_TYPE_UTF8, "b"},
+	{"patch reorder", basic_scalar_test, "select bson_patch(x, bson_diff(x, y)) = y and bson_get(bson_diff(x, y), '$set') is null from (select bson_from_json('{\"a\":1,\"b\":{\"p\":1,\"q\":2},\"c\":3}') x, bson_from_json('{\"c\":3,\"a\":1,\"b\":{\"q\":2,\"p\":1}}') y)", BSON_TYPE_INT32, &oval},
+	{"patch set new parent", basic_scalar_test, "select bson_get(bson_patch(bson_from_json('{\"a\":1}'), bson_from_json('{\"$set\":{\"x.y\":\"two\"}}')), 'x.y')", BSON_TYPE_UTF8, "two"},
+	{"patch unset", basic_scalar_test, "select bson_get(bson_patch(bson_from_json('{\"a\":1,\"b\":2}'), bson_from_json('{\"$unset\":{\"a\":true}}')), 'a') is null", BSON_TYPE_INT32, &oval},
+
+	{"path stats count", basic_scalar_test, "select json_extract(bson_path_stats(d),'$.paths.\"hdr.id\".count') = 2 from (select bdata d from bsontest union all select bdata2 from bsontest)", BSON_TYPE_INT32, &oval},
+	{"path stats ndv", basic_scalar_test, "select json_extract(bson_path_stats(d),'$.paths.\"hdr.id\".ndv') = 2 from (select bdata d from bsontest union all select bdata2 from bsontest)", BSON_TYPE_INT32, &oval},
+	{"path stats types", basic_scalar_test, "select json_extract(bson_path_stats(bdata),'$.paths.amt.types.decimal') from bsontest", BSON_TYPE_INT32, &oval},
+	{"path stats empty", basic_scalar_test, "select bson_path_stats(bdata) from bsontest where 0", BSON_TYPE_UTF8, "{\"rows\":0,\"paths\":{}}"},
+	{"index advice", basic_scalar_test, "select bson_index_advice(bson_path_stats(d), 'bsontest', 'bdata', 'select * from bsontest where bson_get(bdata,''hdr.id'') = ''A3''') like '%CREATE INDEX%''hdr.id''%' from (select bdata d from bsontest union all select bdata2 from bsontest)", BSON_TYPE_INT32, &oval},
+	{"index advice name clash", basic_scalar_test, "select bson_index_advice('{\"rows\":100,\"paths\":{\"a.b\":{\"count\":100,\"ndv\":100},\"a_b\":{\"count\":100,\"ndv\":100}}}', 'bsontest', 'bdata') like '%\"bsontest_a_b\"%\"bsontest_a_b_2\"%'", BSON_TYPE_INT32, &oval},
+
+	{"group_array", basic_scalar_test, "select bson_get(bson_group_array(x),'1') = 2.5 from (select 1 x union all select 2.5)", BSON_TYPE_INT32, &oval},
+	{"group_array long", basic_scalar_test, "select bson_get(bson_group_array(x),'0') = 1099511627776 from (select 1099511627776 x)", BSON_TYPE_INT32, &oval},
+	{"group_array docs", basic_scalar_test, "select bson_get(bson_group_array(bdata),'0.amt') from bsontest", BSON_TYPE_UTF8, "10.09"},
+	{"group_array empty", basic_scalar_test, "select length(bson_group_array(bdata)) = 5 from bsontest where 0", BSON_TYPE_INT32, &oval},
+	{"group_object", basic_scalar_test, "select bson_get(bson_group_object('h', bson_get_bson(bdata,'hdr')),'h.id') from bsontest", BSON_TYPE_UTF8, "A0"},
+	{"group_object nested array", basic_scalar_test, "select bson_type(bson_group_object('k', bson_as_array(a)),'k') from (select bson_group_array(x) a from (select 'p' x union all select 'q'))", BSON_TYPE_UTF8, "array"},
+	{"group_object nested empty", basic_scalar_test, "select bson_type(bson_group_object('k', bson_as_array(a)),'k') from (select bson_group_array(x) a from (select 1 x where 0))", BSON_TYPE_UTF8, "array"},
+	{"group_array index keys", basic_scalar_test, "select bson_type(bson_group_array(bson_from_json('{\"0\":1}')),'0') from bsontest", BSON_TYPE_UTF8, "object"},
+	{"group_array get_bson array", basic_scalar_test, "select bson_type(bson_group_array(bson_get_bson(bdata,'A.B')),'0') from bsontest", BSON_TYPE_UTF8, "array"},
+
+	{"type string", basic_scalar_test, "select bson_type(bdata,'hdr.id') from bsontest", BSON_TYPE_UTF8, "string"},
+	{"type object", basic_scalar_test, "select bson_type(bdata,'hdr') from bsontest", BSON_TYPE_UTF8, "object"},
+	{"type array elem", basic_scalar_test, "select bson_type(bdata,'A.B.2') from bsontest", BSON_TYPE_UTF8, "double"},
+	{"type !exists", basic_scalar_test, "select bson_type(bdata,'hdr.nope') from bsontest", BSON_TYPE_NULL, 0},
+	{"exists", basic_scalar_test, "select bson_exists(bdata,'A.B.1.Y') from bsontest", BSON_TYPE_INT32, &oval},
+	{"!exists", basic_scalar_test, "select bson_exists(bdata,'A.B.9') from bsontest", BSON_TYPE_INT32, &zval},
+	{"size", basic_scalar_test, "select bson_size(bdata,'') = length(bdata) from bsontest", BSON_TYPE_INT32, &oval},
+	{"size compact", basic_scalar_test, "select bson_size(bson_compact(bdata,1),'hdr') = bson_size(bdata,'hdr') from bsontest", BSON_TYPE_INT32, &oval},
+	{"keys", basic_scalar_test, "select bson_keys(bdata,'hdr') from bsontest", BSON_TYPE_UTF8, "[\"id\",\"ts\",\"bigint\"]"},
+	{"keys scalar", basic_scalar_test, "select bson_keys(bdata,'hdr.id') from bsontest", BSON_TYPE_NULL, 0},
+	{"keys compact", basic_scalar_test, "select bson_keys(bson_compact(bdata,1),'hdr') from bsontest", BSON_TYPE_UTF8, "[\"id\",\"ts\",\"bigint\"]"},
+	{"size compact array", basic_scalar_test, "select bson_size(bson_compact(bdata,1),'A.B') = bson_size(bdata,'A.B') from bsontest", BSON_TYPE_INT32, &oval},
+
+	{"geo bbox point", basic_scalar_test, "select bson_geo_bbox(bson_from_json('{\"loc\":{\"type\":\"Point\",\"coordinates\":[-73.9,40.7]}}'),'loc')", BSON_TYPE_UTF8, "[-73.9,40.7,-73.9,40.7]"},
+	{"geo bbox polygon", basic_scalar_test, "select bson_geo_bbox(bson_from_json('{\"loc\":{\"type\":\"Polygon\",\"coordinates\":[[[10,10],[20,10],[20,30],[10,10]]]}}'),'loc',3) = 30", BSON_TYPE_INT32, &oval},
+	{"geo bbox !geo", basic_scalar_test, "select bson_geo_bbox(bdata,'hdr') from bsontest", BSON_TYPE_NULL, 0},
+
+	{"seq count", basic_scalar_test, "select bson_seq_count(bson_seq_append(bson_seq_append(null, bdata, 'hdr.id'), bdata2)) = 2 from bsontest", BSON_TYPE_INT32, &oval},
+	{"seq min", basic_scalar_test, "select bson_seq_min(bson_seq_append(bson_seq_append(null, bdata, 'hdr.id'), bdata2), 'hdr.id') from bsontest", BSON_TYPE_UTF8, "A0"},
+	{"seq max", basic_scalar_test, "select bson_seq_max(bson_seq_append(bson_seq_append(null, bdata, 'hdr.id'), bdata2), 'hdr.id') from bsontest", BSON_TYPE_UTF8, "A3"},
+	{"seq group", basic_scalar_test, "select bson_seq_max(bson_seq_group(d, 'hdr.id'), 'hdr.id') from (select bdata d from bsontest union all select bdata2 from bsontest)", BSON_TYPE_UTF8, "A3"},
+	{"seq each", basic_scalar_test, "select count(*) from bsontest, bson_seq_each(bson_seq_append(bson_seq_append(null, bdata), bdata2), 'hdr.id') where value = 'A3'", BSON_TYPE_INT32, &oval},
+	{"seq each wildcard", basic_scalar_test, "select value = bson_get(bdata,'A.B.*') from bsontest, bson_seq_each(bson_seq_append(null, bdata), 'A.B.*')", BSON_TYPE_INT32, &oval},
+	{"seq each doc", basic_scalar_test, "select doc = bdata2 from bsontest, bson_seq_each(bson_seq_append(bson_seq_append(null, bdata), bdata2)) where i = 1", BSON_TYPE_INT32, &oval},
+	{"project", basic_scalar_test, "select bson_get(bson_project(bdata, 'not.here', 'hdr.id'), '1') from bsontest", BSON_TYPE_UTF8, "A0"},
+	{"project !exists", basic_scalar_test, "select bson_get(bson_project(bdata, 'not.here', 'hdr.id'), '0') from bsontest", BSON_TYPE_NULL, 0},
+	{"wildcard get", basic_scalar_test, "select bson_get(bson_get_bson(bdata,'A.B.$[].Y.*'), '1') from bsontest", BSON_TYPE_UTF8, "ff"},
+	{"wildcard !match", basic_scalar_test, "select bson_get(bdata,'A.*.nope') from bsontest", BSON_TYPE_NULL, 0},
+	{"get_all path", basic_scalar_test, "select path from bsontest, bson_get_all(bdata,'A.B.*.X')", BSON_TYPE_UTF8, "A.B.1.X"},
+	{"get_all limit", basic_scalar_test, "select count(*) from (select 1 from bsontest, bson_get_all(bdata,'*') limit 1)", BSON_TYPE_INT32, &oval},
+	{"to_json max_bytes", basic_scalar_test, "select substr(bson_to_json(bdata, 10), 11) from bsontest", BSON_TYPE_UTF8, "...(truncated)"},
+	{"to_json chunks", basic_scalar_test, "select (select group_concat(chunk, '') from (select chunk from bson_to_json_chunks(bdata, 16) order by i)) = bson_to_json(bdata) from bsontest", BSON_TYPE_INT32, &oval},
     };
 
     for(int q = 0; q < sizeof(XXX)/sizeof(struct scalar_test); q++) {
 	exec_bst(db,XXX[q].name, XXX[q].a1, XXX[q].a2, XXX[q].a3);
     }
 
+    // bson_keydict made in a transaction that rolls back is made again:
+    sqlite3_exec(db, "drop table bson_keydict", 0, 0, 0);
+    sqlite3_exec(db, "begin", 0, 0, 0);
+    exec_bst(db,"compact in txn", "select bson_compact(bson_from_json('{\"a\":1}'),1) is not null", BSON_TYPE_INT32, &oval);
+    sqlite3_exec(db, "rollback", 0, 0, 0);
+    exec_bst(db,"compact after rollback", "select bson_expand(bson_compact(bson_from_json('{\"b\":2}'),1)) = bson_from_json('{\"b\":2}')", BSON_TYPE_INT32, &oval);
+    exec_bst(db,"compact after rollback keydict", "select count(*) from bson_keydict where key = 'a'", BSON_TYPE_INT32, &zval);
+
+    // FTS5 sees only string values; keys, numbers and excluded paths are not indexed:
+    sqlite3_exec(db, "create virtual table bsonfts using fts5(bdata, tokenize=\"bson exclude 'A' paths 1\")", 0, 0, 0);
+    exec_bct(db,"fts5 bson index", "insert into bsonfts(rowid, bdata) select rowid, bdata from bsontest", 1);
+    exec_bst(db,"fts5 match value", "select count(*) from bsonfts where bsonfts match 'a0'", BSON_TYPE_INT32, &oval);
+    exec_bst(db,"fts5 !match key", "select count(*) from bsonfts where bsonfts match 'hdr'", BSON_TYPE_INT32, &zval);
+    exec_bst(db,"fts5 !match excluded", "select count(*) from bsonfts where bsonfts match 'qq'", BSON_TYPE_INT32, &zval);
+    exec_bst(db,"fts5 match path", "select count(*) from bsonfts where bsonfts match '\"hdr.id: a0\"'", BSON_TYPE_INT32, &oval);
+
+    // R*Tree kept in step with a BSON column by triggers:
+    sqlite3_exec(db, "create table geotest (b BSON)", 0, 0, 0);
+    exec_bst(db,"geo rtree create", "select bson_geo_rtree_create('geotest','b','loc')", BSON_TYPE_UTF8, "geotest_loc_rtree");
+    exec_bct(db,"geo rtree insert", "insert into geotest values (bson_from_json('{\"loc\":{\"type\":\"LineString\",\"coordinates\":[[0,0],[2,5]]}}'))", 1);
+    exec_bst(db,"geo rtree lookup", "select count(*) from geotest_loc_rtree where minx >= -1 and maxx <= 3 and maxy >= 4", BSON_TYPE_INT32, &oval);
+    exec_bct(db,"geo rtree delete", "delete from geotest", 1);
+    exec_bst(db,"geo rtree empty", "select count(*) from geotest_loc_rtree", BSON_TYPE_INT32, &zval);
+
+    // Shadow table kept in step by triggers, existing rows brought over by backfill:
+    sqlite3_exec(db, "create table shadowtest as select bdata from bsontest", 0, 0, 0);
+    exec_bst(db,"shadow create", "select bson_shadow_create('shadowtest','bdata','hdr.id')", BSON_TYPE_UTF8, "shadowtest_shadow");
+    exec_bst(db,"shadow backfill", "select bson_shadow_backfill('shadowtest_shadow')", BSON_TYPE_INT32, &oval);
+    exec_bst(db,"shadow backfill done", "select bson_shadow_backfill('shadowtest_shadow')", BSON_TYPE_INT32, &zval);
+    exec_bct(db,"shadow insert", "insert into shadowtest select bdata2 from bsontest", 1);
+    exec_bst(db,"shadow lookup", "select count(*) from shadowtest_shadow where hdr_id = 'A3'", BSON_TYPE_INT32, &oval);
+    exec_bct(db,"shadow delete", "delete from shadowtest", 2);
+    exec_bst(db,"shadow empty", "select count(*) from shadowtest_shadow", BSON_TYPE_INT32, &zval);
+    exec_bet(db,"shadow name clash", "select bson_shadow_create('shadowtest','bdata','a.b','a_b')", "paths 'a.b' and 'a_b' both make column a_b");
+    exec_bst(db,"shadow create again", "select bson_shadow_create('shadowtest','bdata','hdr.id')", BSON_TYPE_UTF8, "shadowtest_shadow");
+    exec_bet(db,"shadow other paths", "select bson_shadow_create('shadowtest','bdata','hdr.ts')", "shadowtest_shadow already exists");
+
+    // NDJSON bulk load; blank lines are skipped but still counted:
+    FILE* jl = fopen("test1.jsonl", "w");
+    if(jl != 0) {
+	fputs("{\"a\":1}\n\n{\"a\":{\"$numberLong\":\"2\"}}\r\n", jl);
+	fclose(jl);
+    }
+    exec_bst(db,"json lines", "select count(*) from bson_from_json_lines('test1.jsonl') where line = 3 and bson_get(doc,'a') = 2", BSON_TYPE_INT32, &oval);
+
+    // A line that isn't EJSON fails the statement and names the line:
+    jl = fopen("test1.jsonl", "w");
+    if(jl != 0) {
+	fputs("{\"a\":1}\n\n{\"a\":\n{\"a\":3}\n", jl);
+	fclose(jl);
+    }
+    exec_bet(db,"json lines bad line", "select count(*) from bson_from_json_lines('test1.jsonl')", "test1.jsonl line 3:");
+    remove("test1.jsonl");
+
     // Recall jbuf and jbuf2 differ by a bit!
     exec_bst(db,"verify bdata = bdata2 is false", "select bdata = bdata2 from bsontest", BSON_TYPE_INT32, &zval);
     
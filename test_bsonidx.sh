@@ -0,0 +1,64 @@
+#!/bin/sh
+#
+#  Builds a sidecar with bsonidx and checks it against the base table.
+#  Needs the sqlite3 shell and a built bsonext and bsonidx:
+#
+#    make -f Makefile.linux test_bsonidx
+#
+#  SQLITE3 and EXT can point elsewhere, e.g. SQLITE3=/usr/local/bin/sqlite3
+#
+SQLITE3=${SQLITE3:-sqlite3}
+EXT=${EXT:-./bsonext}
+DB=${DB:-/tmp/test_bsonidx.db}
+
+nfail=0
+
+sql() {
+    $SQLITE3 -batch -noheader -cmd ".load $EXT sqlite3_bson_init" "$DB" "$1"
+}
+
+check() {
+    if [ "$2" = "$3" ]; then
+	echo "$1 ok"
+    else
+	echo "$1 FAIL: got [$2], wanted [$3]"
+	nfail=$((nfail + 1))
+    fi
+}
+
+rm -f "$DB"
+sql "create table T (bdata BLOB);
+     with recursive n(i) as (select 1 union all select i+1 from n where i < 5000)
+     insert into T select bson_from_json(json_object('x', json_object('y', i % 7), 'id', i)) from n;
+     delete from T where rowid % 10 = 0;"
+
+check "base rows" "$(sql 'select count(*) from T')" 4500
+
+./bsonidx -j 4 -x "$EXT" "$DB" T bdata S x.y id 2>/dev/null
+check "exit" $? 0
+check "rows" "$(sql 'select count(*) from S')" "$(sql 'select count(*) from T')"
+check "rows x.y = 3" "$(sql 'select count(*) from S where x_y = 3')" \
+      "$(sql "select count(*) from T where bson_get(bdata, 'x.y') = 3")"
+check "base_rowid" "$(sql 'select count(*) from S join T on T.rowid = S.base_rowid where S.id = bson_get(T.bdata, '\''id'\'')')" \
+      "$(sql 'select count(*) from T')"
+check "index" "$(sql "select count(*) from sqlite_master where type = 'index' and name = 'S_idx'")" 1
+check "no tmp" "$(sql "select count(*) from sqlite_master where name like '%bsonidx_tmp%'")" 0
+
+# Sidecar already there:  refused, existing one untouched.
+./bsonidx -x "$EXT" "$DB" T bdata S x.y 2>/dev/null
+check "exists exit" $? 1
+check "exists rows" "$(sql 'select count(*) from S')" "$(sql 'select count(*) from T')"
+
+# x.y and x_y are both column x_y:  refused before anything is made.
+./bsonidx -x "$EXT" "$DB" T bdata S2 x.y x_y 2>/dev/null
+check "clash exit" $? 1
+check "clash table" "$(sql "select count(*) from sqlite_master where name like 'S2%'")" 0
+
+# Index name already taken:  fails after the load, nothing is left behind.
+sql "create index S3_idx on T (bdata)"
+./bsonidx -x "$EXT" "$DB" T bdata S3 x.y 2>/dev/null
+check "fail exit" $? 1
+check "fail table" "$(sql "select count(*) from sqlite_master where tbl_name like 'S3%'")" 0
+
+rm -f "$DB"
+[ $nfail -eq 0 ]